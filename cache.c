@@ -0,0 +1,343 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "cache.h"
+
+typedef struct
+{
+    time_t      mtime;
+    off_t       size;
+    char       *path;
+} cache_file_t;
+
+static char            *cache_dir = NULL;
+static size_t           cache_max = 0;
+
+/* per run statistics, updated from the worker threads */
+static volatile long    cache_hits = 0;
+static volatile long    cache_misses = 0;
+static volatile long    cache_bytes_saved = 0;
+static volatile long    cache_stored = 0;
+static long             cache_evicted = 0;
+
+static int __mkdirs__ (const char *path);
+static void __object_path__ (const unsigned char *sha1, char *path,
+    size_t maxlen);
+static int __cmp_mtime__ (const void *a, const void *b);
+
+static int
+__mkdirs__ (const char *path)
+{
+    char    *buf, *p;
+
+    buf = strdup (path);
+    if (buf == NULL)
+        return -1;
+
+    for (p = buf + 1; *p; p++) {
+        if (*p != '/')
+            continue;
+        *p = '\0';
+        if (mkdir (buf, 0755) == -1 && errno != EEXIST) {
+            free (buf);
+            return -1;
+        }
+        *p = '/';
+    }
+    if (mkdir (buf, 0755) == -1 && errno != EEXIST) {
+        free (buf);
+        return -1;
+    }
+
+    free (buf);
+    return 0;
+}
+
+static void
+__object_path__ (const unsigned char *sha1, char *path, size_t maxlen)
+{
+    int     i, n;
+
+    n = snprintf (path, maxlen, "%s/%02x/", cache_dir, sha1[0]);
+    for (i = 1; i < 20 && n + 2 < (int) maxlen; i++)
+        n += sprintf (path + n, "%02x", sha1[i]);
+}
+
+int
+cache_init (const char *dir, size_t max_bytes)
+{
+    char        *base;
+    char         path[4096];
+    int          i;
+
+    if (dir == NULL) {
+        if ((base = getenv ("XDG_CACHE_HOME")) != NULL && base[0] != '\0') {
+            snprintf (path, sizeof (path), "%s/githack/objects", base);
+        } else if ((base = getenv ("HOME")) != NULL && base[0] != '\0') {
+            snprintf (path, sizeof (path), "%s/.cache/githack/objects", base);
+        } else {
+            return -1;
+        }
+        dir = path;
+    }
+
+    if (__mkdirs__ (dir) == -1) {
+        fprintf (stderr, "cache: cannot create %s: %s\n", dir, strerror (errno));
+        return -1;
+    }
+
+    /* the output directory becomes our cwd later on */
+    if ((cache_dir = realpath (dir, NULL)) == NULL) {
+        fprintf (stderr, "cache: %s: %s\n", dir, strerror (errno));
+        return -1;
+    }
+    cache_max = max_bytes;
+
+    /* fan-out directories up front, so workers never race on mkdir */
+    for (i = 0; i < 256; i++) {
+        snprintf (path, sizeof (path), "%s/%02x", cache_dir, i);
+        if (mkdir (path, 0755) == -1 && errno != EEXIST) {
+            fprintf (stderr, "cache: cannot create %s: %s\n", path,
+                     strerror (errno));
+            free (cache_dir);
+            cache_dir = NULL;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int
+cache_enabled (void)
+{
+    return cache_dir != NULL;
+}
+
+int
+cache_get (const unsigned char *sha1, unsigned char **data, size_t *len)
+{
+    int             fd;
+    ssize_t         n;
+    size_t          got;
+    struct stat     st;
+    char            path[4096];
+
+    *data = NULL;
+    *len = 0;
+    if (cache_dir == NULL)
+        return -1;
+
+    __object_path__ (sha1, path, sizeof (path));
+    if ((fd = open (path, O_RDONLY)) == -1 || fstat (fd, &st) == -1) {
+        if (fd != -1)
+            close (fd);
+        __sync_fetch_and_add (&cache_misses, 1);
+        return -1;
+    }
+
+    if ((*data = (unsigned char *) malloc (st.st_size + 1)) == NULL) {
+        close (fd);
+        __sync_fetch_and_add (&cache_misses, 1);
+        return -1;
+    }
+    for (got = 0; got < (size_t) st.st_size; got += n) {
+        if ((n = read (fd, *data + got, st.st_size - got)) <= 0) {
+            if (n < 0 && errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            break;
+        }
+    }
+    close (fd);
+
+    if (got != (size_t) st.st_size) {
+        free (*data);
+        *data = NULL;
+        __sync_fetch_and_add (&cache_misses, 1);
+        return -1;
+    }
+
+    /* mtime is the LRU clock */
+    utimes (path, NULL);
+
+    *len = got;
+    __sync_fetch_and_add (&cache_hits, 1);
+    __sync_fetch_and_add (&cache_bytes_saved, (long) got);
+    return 0;
+}
+
+void
+cache_put (const unsigned char *sha1, const unsigned char *data, size_t len)
+{
+    int         fd;
+    ssize_t     n;
+    size_t      done;
+    char        path[4096], tmp[4096];
+
+    if (cache_dir == NULL)
+        return;
+
+    __object_path__ (sha1, path, sizeof (path));
+    snprintf (tmp, sizeof (tmp), "%.4000s.XXXXXX", path);
+    if ((fd = mkstemp (tmp)) == -1)
+        return;
+    fchmod (fd, 0644);
+
+    for (done = 0; done < len; done += n) {
+        if ((n = write (fd, data + done, len - done)) <= 0) {
+            if (n < 0 && errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            break;
+        }
+    }
+
+    /* publish atomically, readers never see a partial object */
+    if (close (fd) == 0 && done == len && rename (tmp, path) == 0) {
+        __sync_fetch_and_add (&cache_stored, 1);
+    } else {
+        unlink (tmp);
+    }
+}
+
+/*
+ * The len bytes cache_get() returned for sha1 turned out corrupt: the
+ * entry goes and the lookup counts as a miss, the object is fetched.
+ */
+void
+cache_drop (const unsigned char *sha1, size_t len)
+{
+    char    path[4096];
+
+    if (cache_dir == NULL)
+        return;
+
+    __object_path__ (sha1, path, sizeof (path));
+    unlink (path);
+    __sync_fetch_and_sub (&cache_hits, 1);
+    __sync_fetch_and_sub (&cache_bytes_saved, (long) len);
+    __sync_fetch_and_add (&cache_misses, 1);
+}
+
+static int
+__cmp_mtime__ (const void *a, const void *b)
+{
+    const cache_file_t *fa = a, *fb = b;
+
+    return fa->mtime < fb->mtime ? -1 : fa->mtime > fb->mtime;
+}
+
+void
+cache_evict (void)
+{
+    DIR            *d;
+    struct dirent  *p;
+    struct stat     st;
+    cache_file_t   *files = NULL, *grown;
+    size_t          nfiles = 0, cap = 0, i;
+    size_t          total = 0;
+    int             sub, failed = 0;
+    char            path[4096];
+
+    if (cache_dir == NULL || cache_max == 0)
+        return;
+
+    for (sub = 0; sub < 256 && !failed; sub++) {
+        snprintf (path, sizeof (path), "%s/%02x", cache_dir, sub);
+        if ((d = opendir (path)) == NULL)
+            continue;
+        while ((p = readdir (d)) != NULL) {
+            if (p->d_name[0] == '.')
+                continue;
+            snprintf (path, sizeof (path), "%s/%02x/%s", cache_dir, sub,
+                      p->d_name);
+            if (stat (path, &st) == -1 || !S_ISREG (st.st_mode))
+                continue;
+            if (nfiles == cap) {
+                grown = realloc (files, (cap ? cap * 2 : 1024)
+                                        * sizeof (cache_file_t));
+                if (grown == NULL) {
+                    failed = 1;
+                    break;
+                }
+                files = grown;
+                cap = cap ? cap * 2 : 1024;
+            }
+            if ((files[nfiles].path = strdup (path)) == NULL) {
+                failed = 1;
+                break;
+            }
+            files[nfiles].mtime = st.st_mtime;
+            files[nfiles].size = st.st_size;
+            total += st.st_size;
+            nfiles++;
+        }
+        closedir (d);
+    }
+
+    /* without the full list the oldest files are unknown, try next time */
+    if (!failed && total > cache_max) {
+        qsort (files, nfiles, sizeof (cache_file_t), __cmp_mtime__);
+        for (i = 0; i < nfiles && total > cache_max; i++) {
+            if (unlink (files[i].path) == 0) {
+                total -= files[i].size;
+                cache_evicted++;
+            }
+        }
+    }
+
+    for (i = 0; i < nfiles; i++)
+        free (files[i].path);
+    free (files);
+}
+
+void
+cache_report (void)
+{
+    long    lookups;
+
+    if (cache_dir == NULL)
+        return;
+
+    lookups = cache_hits + cache_misses;
+    printf ("cache: %ld hits, %ld misses (%.1f%% hit rate), %ld bytes saved, "
+            "%ld stored, %ld evicted\n",
+            cache_hits, cache_misses,
+            lookups ? 100.0 * cache_hits / lookups : 0.0,
+            cache_bytes_saved, cache_stored, cache_evicted);
+}
+
+/* "hits misses saved stored evicted", for another process to add up */
+int
+cache_counts (char *buf, size_t len)
+{
+    return snprintf (buf, len, "%ld %ld %ld %ld %ld", cache_hits,
+                     cache_misses, cache_bytes_saved, cache_stored,
+                     cache_evicted);
+}
+
+int
+cache_add_counts (const char *buf)
+{
+    long    hits, misses, saved, stored, evicted;
+
+    if (sscanf (buf, "%ld %ld %ld %ld %ld", &hits, &misses, &saved, &stored,
+                &evicted) != 5)
+        return -1;
+    cache_hits += hits;
+    cache_misses += misses;
+    cache_bytes_saved += saved;
+    cache_stored += stored;
+    cache_evicted += evicted;
+    return 0;
+}
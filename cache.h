@@ -0,0 +1,33 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <sys/types.h>
+
+/*
+ * Cross-run store of compressed loose objects, laid out like .git/objects:
+ * <dir>/ab/cdef... Entries are touched on every hit and the least recently
+ * used ones are evicted once the store grows past its cap.
+ */
+
+#define CACHE_DEFAULT_MB 1024
+
+int cache_init (const char *dir, size_t max_bytes);
+
+int cache_enabled (void);
+
+int cache_get (const unsigned char *sha1, unsigned char **data, size_t *len);
+
+void cache_put (const unsigned char *sha1, const unsigned char *data,
+    size_t len);
+
+void cache_drop (const unsigned char *sha1, size_t len);
+
+void cache_evict (void);
+
+void cache_report (void);
+
+int cache_counts (char *buf, size_t len);
+
+int cache_add_counts (const char *buf);
+
+#endif /* CACHE_H */
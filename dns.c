@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "dns.h"
+
+typedef enum
+{
+    DNS_PENDING,
+    DNS_DONE
+} dns_state_t;
+
+typedef struct dns_entry
+{
+    char               *host;
+    dns_state_t         state;
+    int                 error;      /* EAI_* of the last lookup, 0 if ok */
+    time_t              expires;
+    dns_addrs_t         addrs;      /* port 0 */
+    struct dns_entry   *next;
+} dns_entry_t;
+
+static dns_entry_t     *dns_cache = NULL;
+static pthread_mutex_t  dns_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   dns_ready = PTHREAD_COND_INITIALIZER;
+
+static dns_entry_t *__dns_find__ (const char *host);
+static dns_entry_t *__dns_claim__ (const char *host, int *owner);
+static void __dns_lookup__ (dns_entry_t *entry);
+static void *__dns_thread__ (void *arg);
+
+static dns_entry_t *
+__dns_find__ (const char *host)
+{
+    dns_entry_t *e;
+
+    for (e = dns_cache; e != NULL; e = e->next) {
+        if (strcmp (e->host, host) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+/*
+ * With dns_lock held: the entry of host. When it's missing or stale it
+ * is marked pending and *owner set, the caller has to resolve it then.
+ */
+static dns_entry_t *
+__dns_claim__ (const char *host, int *owner)
+{
+    dns_entry_t *e;
+
+    *owner = 0;
+    if ((e = __dns_find__ (host)) == NULL) {
+        e = (dns_entry_t *) calloc (1, sizeof (dns_entry_t));
+        if (e == NULL)
+            return NULL;
+        e->host = strdup (host);
+        e->next = dns_cache;
+        dns_cache = e;
+    } else if (e->state == DNS_PENDING || e->expires > time (NULL)) {
+        return e;
+    }
+
+    e->state = DNS_PENDING;
+    *owner = 1;
+    return e;
+}
+
+/* resolve without the lock, then publish the answer to the waiters */
+static void
+__dns_lookup__ (dns_entry_t *entry)
+{
+    struct addrinfo     hints, *res = NULL, *ai;
+    dns_addrs_t         addrs;
+    int                 err;
+
+    memset (&hints, 0, sizeof (hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    addrs.count = 0;
+    err = getaddrinfo (entry->host, NULL, &hints, &res);
+    if (err == 0) {
+        for (ai = res; ai != NULL && addrs.count < DNS_MAX_ADDRS;
+             ai = ai->ai_next) {
+            if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
+                continue;
+            addrs.addr[addrs.count].family = ai->ai_family;
+            addrs.addr[addrs.count].len = ai->ai_addrlen;
+            memcpy (&addrs.addr[addrs.count].addr, ai->ai_addr, ai->ai_addrlen);
+            addrs.count++;
+        }
+        freeaddrinfo (res);
+        if (addrs.count == 0)
+            err = EAI_NONAME;
+    }
+
+    pthread_mutex_lock (&dns_lock);
+    entry->addrs = addrs;
+    entry->error = err;
+    entry->expires = time (NULL) + (err == 0 ? DNS_TTL : DNS_NEGATIVE_TTL);
+    entry->state = DNS_DONE;
+    pthread_cond_broadcast (&dns_ready);
+    pthread_mutex_unlock (&dns_lock);
+}
+
+static void *
+__dns_thread__ (void *arg)
+{
+    __dns_lookup__ ((dns_entry_t *) arg);
+    return NULL;
+}
+
+/*
+ * Addresses of host with port filled in, from the cache when possible.
+ * Returns 0, or an EAI_* code.
+ */
+int
+dns_resolve (const char *host, unsigned short port, dns_addrs_t *addrs)
+{
+    dns_entry_t *e;
+    int          i, err, owner;
+
+    addrs->count = 0;
+
+    pthread_mutex_lock (&dns_lock);
+    if ((e = __dns_claim__ (host, &owner)) == NULL) {
+        pthread_mutex_unlock (&dns_lock);
+        return EAI_MEMORY;
+    }
+    if (owner) {
+        /* others wait on dns_ready meanwhile */
+        pthread_mutex_unlock (&dns_lock);
+        __dns_lookup__ (e);
+        pthread_mutex_lock (&dns_lock);
+    }
+    while (e->state == DNS_PENDING)
+        pthread_cond_wait (&dns_ready, &dns_lock);
+
+    err = e->error;
+    *addrs = e->addrs;
+    pthread_mutex_unlock (&dns_lock);
+
+    for (i = 0; i < addrs->count; i++) {
+        if (addrs->addr[i].family == AF_INET6)
+            ((struct sockaddr_in6 *) &addrs->addr[i].addr)->sin6_port = htons (port);
+        else
+            ((struct sockaddr_in *) &addrs->addr[i].addr)->sin_port = htons (port);
+    }
+    return err;
+}
+
+/* start resolving host in the background, if it isn't cached already */
+void
+dns_prefetch (const char *host)
+{
+    dns_entry_t     *e;
+    pthread_t        tid;
+    pthread_attr_t   attr;
+    int              owner;
+
+    pthread_mutex_lock (&dns_lock);
+    e = __dns_claim__ (host, &owner);
+    pthread_mutex_unlock (&dns_lock);
+    if (e == NULL || !owner)
+        return;
+
+    pthread_attr_init (&attr);
+    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create (&tid, &attr, __dns_thread__, e) != 0)
+        __dns_lookup__ (e);
+    pthread_attr_destroy (&attr);
+}
+
+/*
+ * "host:port:addr,addr,..." as curl's CURLOPT_RESOLVE wants it, so the
+ * curl transfers skip their own lookup. Returns -1 when host doesn't
+ * resolve.
+ */
+int
+dns_format (const char *host, unsigned short port, char *buf, size_t len)
+{
+    dns_addrs_t     addrs;
+    char            ip[INET6_ADDRSTRLEN];
+    const void     *a;
+    size_t          n;
+    int             i;
+
+    if (dns_resolve (host, port, &addrs) != 0)
+        return -1;
+
+    n = snprintf (buf, len, "%s:%u:", host, port);
+    for (i = 0; i < addrs.count && n < len; i++) {
+        if (addrs.addr[i].family == AF_INET6)
+            a = &((struct sockaddr_in6 *) &addrs.addr[i].addr)->sin6_addr;
+        else
+            a = &((struct sockaddr_in *) &addrs.addr[i].addr)->sin_addr;
+        inet_ntop (addrs.addr[i].family, a, ip, sizeof (ip));
+        n += snprintf (buf + n, len - n,
+                       addrs.addr[i].family == AF_INET6 ? "%s[%s]" : "%s%s",
+                       i ? "," : "", ip);
+    }
+    return n < len ? 0 : -1;
+}
+
+/* "name[:port]" or "[v6]:port" into the bare name; port kept if absent */
+void
+dns_split_host (const char *host, char *name, size_t len,
+    unsigned short *port)
+{
+    const char  *end, *colon;
+
+    if (host[0] == '[' && (end = strchr (host, ']')) != NULL) {
+        snprintf (name, len, "%.*s", (int) (end - host - 1), host + 1);
+        colon = end[1] == ':' ? end + 1 : NULL;
+    } else if ((colon = strchr (host, ':')) != NULL
+               && strchr (colon + 1, ':') == NULL) {
+        snprintf (name, len, "%.*s", (int) (colon - host), host);
+    } else {
+        snprintf (name, len, "%s", host);
+        colon = NULL;
+    }
+
+    if (colon != NULL && port != NULL && atoi (colon + 1) > 0)
+        *port = (unsigned short) atoi (colon + 1);
+}
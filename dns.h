@@ -0,0 +1,41 @@
+#ifndef DNS_H
+#define DNS_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/*
+ * Process wide resolver cache. A name is looked up once; concurrent
+ * callers wait for the lookup already in flight, and dns_prefetch()
+ * starts one in the background. getaddrinfo doesn't report record TTLs,
+ * so answers are kept for a fixed time.
+ */
+
+#define DNS_TTL             300     /* seconds an answer is reused */
+#define DNS_NEGATIVE_TTL    10      /* seconds a failure is remembered */
+#define DNS_MAX_ADDRS       16
+
+typedef struct
+{
+    int                     family;
+    socklen_t               len;
+    struct sockaddr_storage addr;
+} dns_addr_t;
+
+typedef struct
+{
+    int             count;
+    dns_addr_t      addr[DNS_MAX_ADDRS];
+} dns_addrs_t;
+
+int dns_resolve (const char *host, unsigned short port, dns_addrs_t *addrs);
+
+void dns_prefetch (const char *host);
+
+int dns_format (const char *host, unsigned short port, char *buf,
+    size_t len);
+
+void dns_split_host (const char *host, char *name, size_t len,
+    unsigned short *port);
+
+#endif /* DNS_H */
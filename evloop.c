@@ -0,0 +1,557 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+#include "evloop.h"
+#include "stats.h"
+
+#if defined(__linux__)
+
+#define EVLOOP_EVENTS   256     /* readiness events taken per epoll_wait */
+#define EVLOOP_WATCHES  4
+
+/* what a transfer hands back when it finishes, in CURLOPT_PRIVATE */
+typedef struct
+{
+    evloop_done_fn  done;
+    void           *arg;
+} evloop_xfer_t;
+
+typedef struct
+{
+    int             fd;
+    evloop_fd_fn    fn;
+    void           *arg;
+} evloop_watch_t;
+
+struct evloop
+{
+    int                 epfd;
+    int                 wakefd;         /* eventfd, written on submit and close */
+    CURLM              *multi;
+    long                curl_deadline;  /* when curl wants a timeout action, -1 never */
+    int                 max_tasks;
+    int                 tasks;          /* holding a slot */
+    int                 transfers;
+    int                 sockets;
+    evloop_task_t      *pending;        /* submitted, waiting for a slot */
+    evloop_task_t      *pending_tail;
+    evloop_source_fn    source;
+    void               *source_arg;
+    pthread_mutex_t     lock;           /* guards incoming and closed */
+    evloop_task_t      *incoming;       /* submitted since the loop last looked */
+    evloop_task_t      *incoming_tail;
+    int                 closed;
+    evloop_timer_t    **timers;         /* min-heap on deadline */
+    int                 timer_count;
+    int                 timer_size;
+    evloop_watch_t      watches[EVLOOP_WATCHES];
+    int                 watch_count;
+    evloop_stats_t      stats;
+};
+
+static int __socket_cb__ (CURL *curl, curl_socket_t s, int what, void *userp,
+    void *socketp);
+static int __timer_cb__ (CURLM *multi, long timeout_ms, void *userp);
+static void __timer_swap__ (evloop_t *loop, int a, int b);
+static void __timer_up__ (evloop_t *loop, int slot);
+static void __timer_down__ (evloop_t *loop, int slot);
+static int __next_timeout__ (evloop_t *loop);
+static void __fire_timers__ (evloop_t *loop);
+static int __take_incoming__ (evloop_t *loop);
+static void __start_pending__ (evloop_t *loop);
+static void __finish_transfers__ (evloop_t *loop);
+static evloop_watch_t *__find_watch__ (evloop_t *loop, int fd);
+
+/* curl wants s watched for what; socketp is non-NULL once s is in epoll */
+static int
+__socket_cb__ (CURL *curl, curl_socket_t s, int what, void *userp,
+    void *socketp)
+{
+    evloop_t           *loop = (evloop_t *) userp;
+    struct epoll_event  ev;
+
+    if (what == CURL_POLL_REMOVE) {
+        /* curl may have closed it already, which dropped it from epoll */
+        epoll_ctl (loop->epfd, EPOLL_CTL_DEL, s, NULL);
+        if (socketp != NULL)
+            loop->sockets--;
+        return 0;
+    }
+
+    memset (&ev, 0, sizeof (ev));
+    ev.events = ((what & CURL_POLL_IN) ? EPOLLIN : 0)
+                | ((what & CURL_POLL_OUT) ? EPOLLOUT : 0);
+    ev.data.fd = s;
+    if (socketp != NULL)
+        return epoll_ctl (loop->epfd, EPOLL_CTL_MOD, s, &ev) == 0 ? 0 : -1;
+
+    if (epoll_ctl (loop->epfd, EPOLL_CTL_ADD, s, &ev) == -1
+        && (errno != EEXIST || epoll_ctl (loop->epfd, EPOLL_CTL_MOD, s, &ev) == -1))
+        return -1;
+    curl_multi_assign (loop->multi, s, loop);
+    if (++loop->sockets > loop->stats.peak_sockets)
+        loop->stats.peak_sockets = loop->sockets;
+    return 0;
+}
+
+/* only noted here, curl must not be driven from inside its own callback */
+static int
+__timer_cb__ (CURLM *multi, long timeout_ms, void *userp)
+{
+    evloop_t   *loop = (evloop_t *) userp;
+
+    loop->curl_deadline = timeout_ms < 0
+                          ? -1 : stats_now_us () + timeout_ms * 1000L;
+    return 0;
+}
+
+static void
+__timer_swap__ (evloop_t *loop, int a, int b)
+{
+    evloop_timer_t *t = loop->timers[a];
+
+    loop->timers[a] = loop->timers[b];
+    loop->timers[b] = t;
+    loop->timers[a]->slot = a;
+    loop->timers[b]->slot = b;
+}
+
+static void
+__timer_up__ (evloop_t *loop, int slot)
+{
+    int     parent;
+
+    while (slot > 0) {
+        parent = (slot - 1) / 2;
+        if (loop->timers[parent]->deadline <= loop->timers[slot]->deadline)
+            break;
+        __timer_swap__ (loop, slot, parent);
+        slot = parent;
+    }
+}
+
+static void
+__timer_down__ (evloop_t *loop, int slot)
+{
+    int     child;
+
+    while ((child = 2 * slot + 1) < loop->timer_count) {
+        if (child + 1 < loop->timer_count
+            && loop->timers[child + 1]->deadline < loop->timers[child]->deadline)
+            child++;
+        if (loop->timers[slot]->deadline <= loop->timers[child]->deadline)
+            break;
+        __timer_swap__ (loop, slot, child);
+        slot = child;
+    }
+}
+
+/* ms until curl or a timer is due, rounded up; -1 if nothing is */
+static int
+__next_timeout__ (evloop_t *loop)
+{
+    long    deadline = loop->curl_deadline, wait;
+
+    if (loop->timer_count > 0
+        && (deadline < 0 || loop->timers[0]->deadline < deadline))
+        deadline = loop->timers[0]->deadline;
+    if (deadline < 0)
+        return -1;
+
+    wait = deadline - stats_now_us ();
+    if (wait <= 0)
+        return 0;
+    return wait / 1000 >= 60000 ? 60000 : (int) ((wait + 999) / 1000);
+}
+
+static void
+__fire_timers__ (evloop_t *loop)
+{
+    evloop_timer_t *timer;
+    long            now = stats_now_us ();
+
+    while (loop->timer_count > 0 && loop->timers[0]->deadline <= now) {
+        timer = loop->timers[0];
+        evloop_timer_cancel (loop, timer);
+        timer->fn (loop, timer);
+    }
+}
+
+/* moves what other threads submitted to pending; true once closed */
+static int
+__take_incoming__ (evloop_t *loop)
+{
+    int     closed;
+
+    pthread_mutex_lock (&loop->lock);
+    if (loop->incoming != NULL) {
+        if (loop->pending == NULL)
+            loop->pending = loop->incoming;
+        else
+            loop->pending_tail->next = loop->incoming;
+        loop->pending_tail = loop->incoming_tail;
+        loop->incoming = loop->incoming_tail = NULL;
+    }
+    closed = loop->closed;
+    pthread_mutex_unlock (&loop->lock);
+    return closed;
+}
+
+static void
+__start_pending__ (evloop_t *loop)
+{
+    evloop_task_t  *task;
+
+    while (loop->tasks < loop->max_tasks) {
+        if ((task = loop->pending) != NULL) {
+            if ((loop->pending = task->next) == NULL)
+                loop->pending_tail = NULL;
+            task->next = NULL;
+        } else if (loop->source == NULL
+                   || (task = loop->source (loop, loop->source_arg)) == NULL) {
+            break;
+        }
+
+        loop->stats.tasks++;
+        if (++loop->tasks > loop->stats.peak_tasks)
+            loop->stats.peak_tasks = loop->tasks;
+        task->start (loop, task);
+    }
+}
+
+static void
+__finish_transfers__ (evloop_t *loop)
+{
+    CURLMsg        *msg;
+    CURL           *curl;
+    CURLcode        res;
+    evloop_xfer_t  *xfer;
+    evloop_xfer_t   done;
+    int             left;
+
+    while ((msg = curl_multi_info_read (loop->multi, &left)) != NULL) {
+        if (msg->msg != CURLMSG_DONE)
+            continue;
+        /* msg goes away with the handle */
+        curl = msg->easy_handle;
+        res = msg->data.result;
+        curl_easy_getinfo (curl, CURLINFO_PRIVATE, (char **) &xfer);
+        done = *xfer;
+        evloop_remove (loop, curl);
+        done.done (loop, curl, res, done.arg);
+    }
+}
+
+static evloop_watch_t *
+__find_watch__ (evloop_t *loop, int fd)
+{
+    int     i;
+
+    for (i = 0; i < loop->watch_count; i++) {
+        if (loop->watches[i].fd == fd)
+            return &loop->watches[i];
+    }
+    return NULL;
+}
+
+evloop_t *
+evloop_new (int max_tasks)
+{
+    evloop_t           *loop;
+    struct epoll_event  ev;
+
+    if (max_tasks < 1 || (loop = calloc (1, sizeof (evloop_t))) == NULL)
+        return NULL;
+
+    loop->max_tasks = max_tasks;
+    loop->curl_deadline = -1;
+    pthread_mutex_init (&loop->lock, NULL);
+    loop->epfd = epoll_create1 (EPOLL_CLOEXEC);
+    loop->wakefd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    loop->multi = curl_multi_init ();
+    if (loop->epfd == -1 || loop->wakefd == -1 || loop->multi == NULL)
+        goto fail;
+
+    memset (&ev, 0, sizeof (ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = loop->wakefd;
+    if (epoll_ctl (loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &ev) == -1)
+        goto fail;
+
+    curl_multi_setopt (loop->multi, CURLMOPT_SOCKETFUNCTION, __socket_cb__);
+    curl_multi_setopt (loop->multi, CURLMOPT_SOCKETDATA, loop);
+    curl_multi_setopt (loop->multi, CURLMOPT_TIMERFUNCTION, __timer_cb__);
+    curl_multi_setopt (loop->multi, CURLMOPT_TIMERDATA, loop);
+    /* idle connections kept for reuse count against the same fd budget */
+    curl_multi_setopt (loop->multi, CURLMOPT_MAXCONNECTS, (long) max_tasks);
+    return loop;
+
+fail:
+    evloop_free (loop);
+    return NULL;
+}
+
+/* queues task for a slot, from any thread */
+int
+evloop_submit (evloop_t *loop, evloop_task_t *task)
+{
+    uint64_t    one = 1;
+    int         wake;
+
+    task->next = NULL;
+    pthread_mutex_lock (&loop->lock);
+    if (loop->closed) {
+        pthread_mutex_unlock (&loop->lock);
+        errno = EPIPE;
+        return -1;
+    }
+    /* the loop takes the whole list at once, one wake-up covers it */
+    wake = loop->incoming == NULL;
+    if (wake)
+        loop->incoming = task;
+    else
+        loop->incoming_tail->next = task;
+    loop->incoming_tail = task;
+    pthread_mutex_unlock (&loop->lock);
+
+    if (wake && write (loop->wakefd, &one, sizeof (one)) != sizeof (one)
+        && errno != EAGAIN)
+        return -1;
+    return 0;
+}
+
+/* fn is only called on the loop thread */
+void
+evloop_set_source (evloop_t *loop, evloop_source_fn fn, void *arg)
+{
+    loop->source = fn;
+    loop->source_arg = arg;
+}
+
+/* no more tasks come, evloop_run() returns once the last one is done */
+void
+evloop_close (evloop_t *loop)
+{
+    uint64_t    one = 1;
+
+    pthread_mutex_lock (&loop->lock);
+    loop->closed = 1;
+    pthread_mutex_unlock (&loop->lock);
+    if (write (loop->wakefd, &one, sizeof (one)) != sizeof (one))
+        ;   /* counter full means a wake-up is pending anyway */
+}
+
+int
+evloop_run (evloop_t *loop)
+{
+    struct epoll_event  events[EVLOOP_EVENTS];
+    evloop_watch_t     *watch;
+    uint64_t            count;
+    int                 n, i, fd, flags, running, closed;
+
+    for (;;) {
+        closed = __take_incoming__ (loop);
+        __start_pending__ (loop);
+        /* the source had nothing either, or some task would hold a slot */
+        if (closed && loop->tasks == 0 && loop->pending == NULL)
+            return 0;
+
+        n = epoll_wait (loop->epfd, events, EVLOOP_EVENTS, __next_timeout__ (loop));
+        if (n == -1 && errno != EINTR)
+            return -1;
+
+        for (i = 0; i < n; i++) {
+            fd = events[i].data.fd;
+            if (fd == loop->wakefd) {
+                if (read (fd, &count, sizeof (count)) != sizeof (count))
+                    ;   /* EAGAIN, someone else's wake-up was read already */
+            } else if ((watch = __find_watch__ (loop, fd)) != NULL) {
+                watch->fn (loop, fd, watch->arg);
+            } else {
+                flags = ((events[i].events & EPOLLIN) ? CURL_CSELECT_IN : 0)
+                        | ((events[i].events & EPOLLOUT) ? CURL_CSELECT_OUT : 0)
+                        | ((events[i].events & (EPOLLERR | EPOLLHUP))
+                           ? CURL_CSELECT_ERR : 0);
+                curl_multi_socket_action (loop->multi, fd, flags, &running);
+            }
+        }
+
+        if (loop->curl_deadline >= 0 && loop->curl_deadline <= stats_now_us ()) {
+            loop->curl_deadline = -1;
+            curl_multi_socket_action (loop->multi, CURL_SOCKET_TIMEOUT, 0,
+                                      &running);
+        }
+        __finish_transfers__ (loop);
+        __fire_timers__ (loop);
+    }
+}
+
+/* starts curl; done gets it back when it finished. Uses CURLOPT_PRIVATE. */
+int
+evloop_add (evloop_t *loop, CURL *curl, evloop_done_fn done, void *arg)
+{
+    evloop_xfer_t  *xfer;
+
+    if ((xfer = malloc (sizeof (evloop_xfer_t))) == NULL)
+        return -1;
+    xfer->done = done;
+    xfer->arg = arg;
+    curl_easy_setopt (curl, CURLOPT_PRIVATE, xfer);
+    if (curl_multi_add_handle (loop->multi, curl) != CURLM_OK) {
+        free (xfer);
+        return -1;
+    }
+    if (++loop->transfers > loop->stats.peak_transfers)
+        loop->stats.peak_transfers = loop->transfers;
+    return 0;
+}
+
+/* stops a transfer before it finished, done is not called */
+void
+evloop_remove (evloop_t *loop, CURL *curl)
+{
+    evloop_xfer_t  *xfer = NULL;
+
+    curl_easy_getinfo (curl, CURLINFO_PRIVATE, (char **) &xfer);
+    if (curl_multi_remove_handle (loop->multi, curl) == CURLM_OK)
+        loop->transfers--;
+    curl_easy_setopt (curl, CURLOPT_PRIVATE, NULL);
+    free (xfer);
+}
+
+/* gives the task's slot to the next pending one */
+void
+evloop_task_done (evloop_t *loop)
+{
+    loop->tasks--;
+}
+
+void
+evloop_timer_init (evloop_timer_t *timer, evloop_timer_fn fn, void *arg)
+{
+    timer->fn = fn;
+    timer->arg = arg;
+    timer->deadline = 0;
+    timer->slot = -1;
+}
+
+/* fires once delay_us from now, re-arms one that is pending */
+int
+evloop_timer_add (evloop_t *loop, evloop_timer_t *timer, long delay_us)
+{
+    evloop_timer_t **timers;
+    int              size;
+
+    evloop_timer_cancel (loop, timer);
+    if (loop->timer_count == loop->timer_size) {
+        size = loop->timer_size ? loop->timer_size * 2 : 64;
+        timers = realloc (loop->timers, size * sizeof (evloop_timer_t *));
+        if (timers == NULL)
+            return -1;
+        loop->timers = timers;
+        loop->timer_size = size;
+    }
+
+    timer->deadline = stats_now_us () + delay_us;
+    timer->slot = loop->timer_count++;
+    loop->timers[timer->slot] = timer;
+    __timer_up__ (loop, timer->slot);
+    return 0;
+}
+
+void
+evloop_timer_cancel (evloop_t *loop, evloop_timer_t *timer)
+{
+    int     slot = timer->slot, last;
+
+    if (slot < 0)
+        return;
+    last = --loop->timer_count;
+    if (slot != last) {
+        __timer_swap__ (loop, slot, last);
+        __timer_up__ (loop, slot);
+        __timer_down__ (loop, slot);
+    }
+    timer->slot = -1;
+}
+
+/* fn runs on the loop thread whenever fd is readable */
+int
+evloop_watch (evloop_t *loop, int fd, evloop_fd_fn fn, void *arg)
+{
+    struct epoll_event  ev;
+
+    if (loop->watch_count == EVLOOP_WATCHES) {
+        errno = ENOSPC;
+        return -1;
+    }
+    memset (&ev, 0, sizeof (ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl (loop->epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+        return -1;
+
+    loop->watches[loop->watch_count].fd = fd;
+    loop->watches[loop->watch_count].fn = fn;
+    loop->watches[loop->watch_count].arg = arg;
+    loop->watch_count++;
+    return 0;
+}
+
+/* a snapshot, safe to take from another thread */
+void
+evloop_get_stats (evloop_t *loop, evloop_stats_t *stats)
+{
+    *stats = loop->stats;
+}
+
+/* after evloop_run() returned; transfers still in it are not cleaned up */
+void
+evloop_free (evloop_t *loop)
+{
+    if (loop == NULL)
+        return;
+    if (loop->multi != NULL)
+        curl_multi_cleanup (loop->multi);
+    if (loop->epfd != -1)
+        close (loop->epfd);
+    if (loop->wakefd != -1)
+        close (loop->wakefd);
+    pthread_mutex_destroy (&loop->lock);
+    free (loop->timers);
+    free (loop);
+}
+
+#else /* no epoll */
+
+evloop_t *
+evloop_new (int max_tasks)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+int evloop_submit (evloop_t *loop, evloop_task_t *task) { return -1; }
+void evloop_set_source (evloop_t *loop, evloop_source_fn fn, void *arg) { }
+void evloop_close (evloop_t *loop) { }
+int evloop_run (evloop_t *loop) { return -1; }
+int evloop_add (evloop_t *loop, CURL *curl, evloop_done_fn done, void *arg) { return -1; }
+void evloop_remove (evloop_t *loop, CURL *curl) { }
+void evloop_task_done (evloop_t *loop) { }
+void evloop_timer_init (evloop_timer_t *timer, evloop_timer_fn fn, void *arg) { }
+int evloop_timer_add (evloop_t *loop, evloop_timer_t *timer, long delay_us) { return -1; }
+void evloop_timer_cancel (evloop_t *loop, evloop_timer_t *timer) { }
+int evloop_watch (evloop_t *loop, int fd, evloop_fd_fn fn, void *arg) { return -1; }
+void evloop_get_stats (evloop_t *loop, evloop_stats_t *stats) { }
+void evloop_free (evloop_t *loop) { }
+
+#endif
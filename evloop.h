@@ -0,0 +1,88 @@
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+#include <curl/curl.h>
+
+/*
+ * Single threaded runtime for many transfers at once. curl's multi
+ * interface says which sockets each transfer waits on and epoll says
+ * which of them are ready, so a transfer in flight costs a little state
+ * and a socket instead of a thread. Work comes in as tasks: a task holds
+ * one of max_tasks slots from its start function until it calls
+ * evloop_task_done(), whatever transfers and timers it runs in between,
+ * and the rest wait their turn in submission order. A source, when set,
+ * is asked for more whenever a slot is free and none is waiting, so a
+ * scheduler can pick what runs next at the last moment. Everything but
+ * evloop_submit() and evloop_close() runs on the thread in evloop_run().
+ * Linux only, evloop_new() fails with ENOSYS elsewhere.
+ */
+
+typedef struct evloop evloop_t;
+typedef struct evloop_task evloop_task_t;
+typedef struct evloop_timer evloop_timer_t;
+
+typedef void (*evloop_start_fn) (evloop_t *loop, evloop_task_t *task);
+
+/* a transfer finished; the handle is out of the loop and the caller's again */
+typedef void (*evloop_done_fn) (evloop_t *loop, CURL *curl, CURLcode res,
+    void *arg);
+
+typedef void (*evloop_timer_fn) (evloop_t *loop, evloop_timer_t *timer);
+
+typedef void (*evloop_fd_fn) (evloop_t *loop, int fd, void *arg);
+
+/* the next task to start, or NULL if none may start right now */
+typedef evloop_task_t *(*evloop_source_fn) (evloop_t *loop, void *arg);
+
+struct evloop_task
+{
+    evloop_start_fn         start;
+    void                   *arg;
+    struct evloop_task     *next;       /* used by the loop */
+};
+
+struct evloop_timer
+{
+    evloop_timer_fn         fn;
+    void                   *arg;
+    long                    deadline;   /* used by the loop */
+    int                     slot;       /* used by the loop, -1 when idle */
+};
+
+typedef struct
+{
+    long            tasks;          /* started */
+    int             peak_tasks;     /* holding a slot at once */
+    int             peak_transfers;
+    int             peak_sockets;
+} evloop_stats_t;
+
+evloop_t *evloop_new (int max_tasks);
+
+int evloop_submit (evloop_t *loop, evloop_task_t *task);
+
+void evloop_set_source (evloop_t *loop, evloop_source_fn fn, void *arg);
+
+void evloop_close (evloop_t *loop);
+
+int evloop_run (evloop_t *loop);
+
+int evloop_add (evloop_t *loop, CURL *curl, evloop_done_fn done, void *arg);
+
+void evloop_remove (evloop_t *loop, CURL *curl);
+
+void evloop_task_done (evloop_t *loop);
+
+void evloop_timer_init (evloop_timer_t *timer, evloop_timer_fn fn, void *arg);
+
+int evloop_timer_add (evloop_t *loop, evloop_timer_t *timer, long delay_us);
+
+void evloop_timer_cancel (evloop_t *loop, evloop_timer_t *timer);
+
+int evloop_watch (evloop_t *loop, int fd, evloop_fd_fn fn, void *arg);
+
+void evloop_get_stats (evloop_t *loop, evloop_stats_t *stats);
+
+void evloop_free (evloop_t *loop);
+
+#endif /* EVLOOP_H */
@@ -1,11 +1,72 @@
 #include <stddef.h>
 #include "githack.h"
+#include "state.h"
 #include <curl/curl.h>
 
 static char            *url = NULL;
 static struct           url_combo url_combo;
-static unsigned short   port = DEFAULT_PORT;
-char                    ip[128] = {0};
+static unsigned short   port = 0;
+static bool             https = false;
+static bool             insecure = false;
+static bool             probe_head = false;
+static bool             use_cache = true;
+static char            *cache_path = NULL;
+static size_t           cache_mb = CACHE_DEFAULT_MB;
+static bool             incremental = false;
+static policy_t         policy = POLICY_INDEX;
+static manifest_t       previous = NULL;
+static validator_t      validators = NULL;
+static int              connect_ms = HTTP_CONNECT_TIMEOUT_MS;
+static int              read_ms = HTTP_READ_TIMEOUT_MS;
+static struct curl_slist *resolve = NULL;
+static int              hedge_pct = HEDGE_PCT;
+
+static char            metrics_path[BUFFER_SIZE];
+static long             metrics_start;
+static sigset_t         metrics_signals;
+
+static int              stage_threads[STAGE_COUNT] = { FETCH_THREADS, 0, WRITE_THREADS };
+static bool             pin_threads = false;
+static int              loop_tasks = 0;     /* -e, 0 fetches with the pool */
+static const char      *targets_path = NULL;
+static int              host_cap = BATCH_HOST_CAP;
+static const char      *stage_names[STAGE_COUNT] = { "fetch", "inflate", "write" };
+
+/* the pipeline's pools while they run, then what they counted */
+static pthread_mutex_t  metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static threadpool       stage_pools[STAGE_COUNT];
+static thpool_stats     stage_stats[STAGE_COUNT];
+static evloop_t        *fetch_loop = NULL;
+static evloop_stats_t   loop_stats;
+
+/* -l state; the host ring is only touched on the loop thread */
+static scan_host_t      scan_hosts = NULL;
+static scan_host_t      ready_head = NULL;
+static scan_host_t      ready_tail = NULL;
+static pthread_mutex_t  batch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   batch_room = PTHREAD_COND_INITIALIZER;
+static int              batch_open = 0;     /* indexed, not finished */
+static int              batch_done = 0;
+static int              batch_failed = 0;
+static long             batch_objects = 0;
+static volatile int     batch_indexing = 0;
+static int              batch_workers = 0;  /* -w, 0 scans in this process */
+static scan_target_t    batch_targets = NULL;
+static int              batch_count = 0;
+static int              shard_fd = -1;      /* a worker's line to the coordinator */
+static pthread_mutex_t  shard_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char      *phase_names[PHASE_COUNT] = {
+    "total", "dns", "connect", "tls", "server", "transfer", "inflate", "write"
+};
+
+/* microseconds per phase; PHASE_TOTAL drives when a request is hedged */
+static stats_hist_t     fetch_phases[PHASE_COUNT];
+static stats_hist_t    *fetch_latency = &fetch_phases[PHASE_TOTAL];
+static volatile long    fetch_requests = 0;
+static volatile long    fetch_bytes = 0;
+static volatile long    hedges_sent = 0;
+static volatile long    hedges_won = 0;
 
 int
 hex2dec (unsigned char *hex, int len)
@@ -25,7 +86,7 @@ char *
 sha12hex (unsigned char *sha1)
 {
     int     i;
-    char    buf[3], result[SHA1_SIZE / 4 + 1];
+    char    buf[3], result[SHA1_SIZE / 4 + 1] = {'\0'};
 
     for (i = 0; i < SHA1_SIZE / 8; i++) {
         sprintf (buf, "%02x", sha1[i]);
@@ -53,12 +114,13 @@ version_check (magic_hdr * magic_head)
     return version == 2 || version == 3 || version == 4 ? true : false;
 }
 
-void
-init_check (int sockfd, magic_hdr * magic_head)
+bool
+init_check (http_body_t *body, magic_hdr * magic_head)
 {
-    read (sockfd, magic_head, sizeof (magic_hdr));
-    assert (signature_check (magic_head) == true);
-    assert (version_check (magic_head) == true);
+    return http_body_read (body, magic_head, sizeof (magic_hdr))
+               == sizeof (magic_hdr)
+           && signature_check (magic_head) == true
+           && version_check (magic_head) == true;
 }
 
 int
@@ -69,8 +131,8 @@ sed2bed (int value)
         ((value & 0x00FF0000) >> 8) | ((value & 0xFF000000) >> 24);
 }
 
-void
-pad_entry (int sockfd, int entry_len)
+int
+pad_entry (http_body_t *body, int entry_len)
 {
     char pad;
     int  i, padlen;
@@ -78,20 +140,21 @@ pad_entry (int sockfd, int entry_len)
     padlen = (8 - (entry_len % 8)) ? (8 - (entry_len % 8)) : 8;
     for (i = 0; i < padlen; i++)
     {
-        readn (sockfd, &pad, 1);
-        assert (pad == '\0');
+        if (http_body_read (body, &pad, 1) != 1 || pad != '\0')
+            return -1;
     }
-
+    return 0;
 }
 
 char *
-get_name (int sockfd, size_t namelen, int *entry_len)
+get_name (http_body_t *body, size_t namelen, int *entry_len)
 {
     char    *name;
 
-    name = (char *) calloc ((unsigned short)0x0FFF, 1);
+    /* entries live for the whole run, don't over-allocate */
+    name = (char *) calloc (namelen < (unsigned short)0x0FFF ? namelen + 1 : 1, 1);
     if (namelen < (unsigned short)0x0FFF) {
-        readn (sockfd, name, namelen);
+        http_body_read (body, name, namelen);
     } else {
         /*read name error, skip*/
     }
@@ -99,13 +162,14 @@ get_name (int sockfd, size_t namelen, int *entry_len)
     return name;
 }
 
-void
-handle_version3orlater (int sockfd, int *entry_len)
+int
+handle_version3orlater (http_body_t *body, int *entry_len)
 {
     struct _extra_flags     extra_flag;
     unsigned char           extra_flag_buf[2];
 
-    readn (sockfd, extra_flag_buf, 2);
+    if (http_body_read (body, extra_flag_buf, 2) != 2)
+        return -1;
     /* 1-bit reserved for future */
     extra_flag.reserved = hex2dec (extra_flag_buf, 2) & (0x0001 << 15);
     /* 1-bit skip-worktree flag (used by sparse checkout) */
@@ -114,8 +178,10 @@ handle_version3orlater (int sockfd, int *entry_len)
     extra_flag.intent_to_add = hex2dec (extra_flag_buf, 2) & (0x0001 << 13);
     /* 13-bit unused, must be zero */
     extra_flag.unused = hex2dec (extra_flag_buf, 2) & (0xFFFF >> 3);
-    assert (extra_flag.unused == 0);
+    if (extra_flag.unused != 0)
+        return -1;
     *entry_len += 2;
+    return 0;
 }
 
 void
@@ -245,44 +311,179 @@ readn (int fd, void *vptr, size_t n)
 }
 
 void
-touch_file_et (http_res_t *response, const char *filename, size_t filesize)
+blob_inflate_init (blob_inflater_t bi, const char *path, size_t filesize)
 {
-    unsigned char   *text;
-    unsigned long    tlen;
-    char            *blob_header;
-    char             filepath[BUFFER_SIZE * 10] = { '\0' };
+    memset (bi, 0, sizeof (blob_inflater));
+    bi->path = path;
+    bi->filesize = filesize;
+    sha1_init (&bi->sha1);
+    bi->zret = inflateInit (&bi->zs);
+}
 
-    if (!filesize) {
-        return;
+int
+blob_inflate_update (blob_inflater_t bi, const unsigned char *data, size_t len)
+{
+    unsigned char   out[INFLATE_CHUNK];
+    unsigned char  *p;
+    size_t          have;
+    long            start;
+
+    if (bi->zret == Z_STREAM_END)
+        return 0; /* ignore trailing bytes */
+    if (bi->zret != Z_OK)
+        return -1;
+
+    bi->zs.next_in = (Bytef *) data;
+    bi->zs.avail_in = len;
+    do {
+        bi->zs.next_out = out;
+        bi->zs.avail_out = INFLATE_CHUNK;
+        start = stats_now_us ();
+        bi->zret = inflate (&bi->zs, Z_NO_FLUSH);
+        bi->inflate_us += stats_now_us () - start;
+        if (bi->zret == Z_BUF_ERROR)
+            bi->zret = Z_OK; /* no progress possible, wait for more input */
+        if (bi->zret != Z_OK && bi->zret != Z_STREAM_END)
+            return -1;
+
+        have = INFLATE_CHUNK - bi->zs.avail_out;
+        sha1_update (&bi->sha1, out, have);
+
+        /* "blob <n>\0" prefix, only hashed */
+        p = out;
+        while (have > 0 && !bi->hdr_done) {
+            have--;
+            if (*p == '\0') {
+                char    expect[BLOB_MAX_LEN + 1];
+
+                bi->hdr[bi->hdr_len] = '\0';
+                snprintf (expect, BLOB_MAX_LEN + 1, "blob %ld", bi->filesize);
+                if (strcmp (bi->hdr, expect) != 0) {
+                    bi->zret = Z_DATA_ERROR;
+                    return -1;
+                }
+                bi->hdr_done = true;
+            } else if (bi->hdr_len < BLOB_MAX_LEN) {
+                bi->hdr[bi->hdr_len++] = *p;
+            } else {
+                bi->zret = Z_DATA_ERROR;
+                return -1;
+            }
+            p++;
+        }
+
+        if (have > 0) {
+            if (bi->written + have > bi->filesize) {
+                bi->zret = Z_DATA_ERROR;
+                return -1;
+            }
+            if (bi->path == NULL) {
+                if (bi->data == NULL
+                    && (bi->data = (unsigned char *) malloc (bi->filesize)) == NULL) {
+                    bi->zret = Z_MEM_ERROR;
+                    return -1;
+                }
+                memcpy (bi->data + bi->written, p, have);
+                bi->written += have;
+                continue;
+            }
+            start = stats_now_us ();
+            if (bi->file == NULL && (bi->file = fopen (bi->path, "wb")) == NULL) {
+                bi->zret = Z_ERRNO;
+                return -1;
+            }
+            if (fwrite (p, 1, have, bi->file) != have) {
+                bi->zret = Z_ERRNO;
+                return -1;
+            }
+            bi->write_us += stats_now_us () - start;
+            bi->written += have;
+        }
+    } while (bi->zs.avail_out == 0 && bi->zret == Z_OK);
+
+    return 0;
+}
+
+blob_status
+blob_inflate_finish (blob_inflater_t bi, const unsigned char *sha1)
+{
+    blob_status     status;
+    unsigned char   digest[SHA1_DIGEST_LEN];
+
+    if (bi->zret == Z_ERRNO || bi->zret == Z_MEM_ERROR) {
+        status = BLOB_IO_ERROR;
+    } else if (bi->zret != Z_STREAM_END || !bi->hdr_done
+               || bi->written != bi->filesize) {
+        status = BLOB_CORRUPT;
+    } else {
+        sha1_final (&bi->sha1, digest);
+        status = memcmp (digest, sha1, SHA1_DIGEST_LEN) ? BLOB_MISMATCH : BLOB_OK;
+    }
+
+    stats_record (&fetch_phases[PHASE_INFLATE], bi->inflate_us);
+    inflateEnd (&bi->zs);
+
+    if (bi->path == NULL) {
+        if (status != BLOB_OK) {
+            free (bi->data);
+            bi->data = NULL;
+        }
+        return status;
     }
-    strncat (filepath, filename, BUFFER_SIZE * 10 - 1);
 
-    blob_header = (char *) malloc (BLOB_MAX_LEN + 1);
-    snprintf(blob_header, BLOB_MAX_LEN + 1, "blob %ld", filesize);
+    /* empty blobs never reach fwrite */
+    if (status == BLOB_OK && bi->file == NULL
+        && (bi->file = fopen (bi->path, "wb")) == NULL) {
+        status = BLOB_IO_ERROR;
+    }
+    if (bi->file != NULL && fclose (bi->file) != 0) {
+        status = BLOB_IO_ERROR;
+    }
+    bi->file = NULL;
+    if (status != BLOB_OK) {
+        unlink (bi->path);
+    }
 
-    tlen = filesize + strlen (blob_header) + 1;
-    text = (unsigned char *) malloc (tlen);
+    stats_record (&fetch_phases[PHASE_WRITE], bi->write_us);
+    return status;
+}
 
-    if (uncompress (text, &tlen, response->content,
-                    response->content_len) != Z_OK) {
-        printf ("%s " ESC "[31m[FAILED]" ESC "[0m\n", filename);
-        free (text);
-        return;
+void
+print_blob_status (const char *filename, blob_status status)
+{
+    switch (status) {
+        case BLOB_OK:
+            printf ("%s " ESC "[35m[OK]" ESC "[0m\n", filename);
+            break;
+        case BLOB_MISMATCH:
+            printf ("%s " ESC "[33m[MISMATCH]" ESC "[0m\n", filename);
+            break;
+        default:
+            printf ("%s " ESC "[31m[FAILED]" ESC "[0m\n", filename);
+            break;
     }
+}
+
+static int
+inflate_sink (void *ctx, const unsigned char *data, size_t len)
+{
+    return blob_inflate_update ((blob_inflater_t) ctx, data, len);
+}
 
-    printf ("%s " ESC "[35m[OK]" ESC "[0m\n", filename);
+/* inflate the object body straight off the connection */
+void
+touch_file_et (http_conn_t *conn, http_res_t *response, const char *filename,
+               size_t filesize, const unsigned char *sha1)
+{
+    blob_inflater   bi;
 
-    FILE *file = fopen (filename, "wb+");
-    /* skip write blob header */
-    if ( (fwrite (text + strlen(blob_header) + 1, 1, filesize,
-                  file)) != filesize) {
-        printf("frite error");
+    if (!filesize) {
         return;
     }
 
-    fclose (file);
-    free (text);
-    free (blob_header);
+    blob_inflate_init (&bi, filename, filesize);
+    http_read_body (conn, response, inflate_sink, &bi);
+    print_blob_status (filename, blob_inflate_finish (&bi, sha1));
 }
 
 int
@@ -311,7 +512,7 @@ create_dir (const char *sPathName)
     return 0;
 }
 
-void
+int
 create_all_path_dir (ce_body_t ce_bd)
 {
     char    *result;
@@ -320,346 +521,2502 @@ create_all_path_dir (ce_body_t ce_bd)
     result = strrchr (ce_bd->name, '/');
     if (result) {
         ptrdiff_t dis = result - ce_bd->name;
-        if (dis > BUFFER_SIZE) {
-            printf ("pathname is too long");
-            exit (-1);
+        if (dis >= BUFFER_SIZE) {
+            fprintf (stderr, "%s: pathname is too long\n", ce_bd->name);
+            return -1;
         }
 
         strncpy (dir, ce_bd->name, dis);
         if (create_dir (dir) == -1) {
             perror ("mkdir error ");
-            exit (-1);
+            return -1;
         }
     }
+    return 0;
 }
 
-int
-process_data (void *buffer, size_t size, size_t nmemb, void *stream)
+/* curl write callback, the compressed object is kept whole for the next stage */
+static size_t
+collect_data (void *buffer, size_t size, size_t nmemb, void *stream)
 {
-    body_t bd = (body_t)stream;
-    size_t buffer_size = size * nmemb;
-
-    /*if realloc first arg is NULL and second arg is not NULL, it's equals malloc()*/
-    bd->content = (unsigned char *) realloc (bd->content, buffer_size + bd->lenght);
-    if (bd->content == NULL) {
-        fprintf(stderr, "realloc memory fail\n");
-        return -1;
+    body_t          raw = (body_t) stream;
+    size_t          buffer_size = size * nmemb;
+    unsigned char  *content;
+    size_t          cap;
+
+    /* doubling keeps the copying linear in the object size */
+    if (raw->content == NULL)
+        raw->cap = 0;
+    if (raw->lenght + buffer_size > raw->cap) {
+        for (cap = raw->cap ? raw->cap : 1024;
+             cap < raw->lenght + buffer_size; cap *= 2)
+            ;
+        content = (unsigned char *) realloc (raw->content, cap);
+        if (content == NULL) {
+            fprintf(stderr, "realloc memory fail\n");
+            return 0; /* a short count makes curl abort the transfer */
+        }
+        raw->content = content;
+        raw->cap = cap;
     }
-
-    memcpy ((void *)(bd->content + bd->lenght), buffer, buffer_size);
-    bd->lenght += buffer_size;
-
+    memcpy (raw->content + raw->lenght, buffer, buffer_size);
+    raw->lenght += buffer_size;
     return buffer_size;
 }
 
-
-void
-task_func (void *arg)
+/*
+ * Same deadlines as the native client, curl races address families
+ * itself. Addresses come from the shared resolver cache.
+ */
+static void
+curl_setup_handle (CURL *curl)
 {
-    body         bd;
-    CURL        *curl;
-    CURLcode     res;
-    size_t       filesize;
-    char        *filename;
-    size_t       retcode;
-    char         object_url[BUFFER_SIZE] = {'\0'};
-
-    ce_body_t ce_body = (ce_body_t) arg;
-    filesize = hex2dec ((ce_body->entry_body->size), 4);
-    filename = ce_body->name;
-
-    concat_object_url (ce_body->entry_body, object_url);
-    if (object_url[0] == '\0') {
-        return;
+    curl_easy_setopt (curl, CURLOPT_CONNECTTIMEOUT_MS, (long) connect_ms);
+    curl_easy_setopt (curl, CURLOPT_HAPPY_EYEBALLS_TIMEOUT_MS,
+                      (long) HTTP_EYEBALLS_DELAY_MS);
+    /* a stalled transfer is one that moves nothing for read_ms */
+    curl_easy_setopt (curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+    curl_easy_setopt (curl, CURLOPT_LOW_SPEED_TIME,
+                      (long) (read_ms + 999) / 1000);
+    curl_easy_setopt (curl, CURLOPT_NOSIGNAL, 1L);
+    if (resolve != NULL)
+        curl_easy_setopt (curl, CURLOPT_RESOLVE, resolve);
+    if (insecure) {
+        curl_easy_setopt (curl, CURLOPT_SSL_VERIFYPEER, 0L);
+        curl_easy_setopt (curl, CURLOPT_SSL_VERIFYHOST, 0L);
     }
+}
 
-    bd.content = (unsigned char *) malloc (1);
-    bd.lenght  = 0;
-
-    curl  = curl_easy_init();
-    if (curl) {
-       curl_easy_setopt(curl, CURLOPT_URL, object_url);
-        /* example.com is redirected, so we tell libcurl to follow redirection */
-        curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void*)&bd);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &process_data);
-
-        /* Perform the request, res will get the return code */
-        res = curl_easy_perform(curl);
-        /* Check for errors */
-        if(res != CURLE_OK) {
-            fprintf(stderr, "curl_easy_perform() failed: %s\t%s\n",
-                            curl_easy_strerror(res),
-                            object_url);
-            return;
-        }
-
-        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE , &retcode);
-        if (retcode == 200 && bd.lenght > 0) {
-            size_t          tlen;
-            unsigned char   *text;
-            char            *blob_header;
+/* pin the object host to what dns_resolve() found, for every transfer */
+static void
+curl_pin_host (void)
+{
+    char            name[256], entry[BUFFER_SIZE];
+    unsigned short  object_port;
 
-            blob_header = (char *) malloc (BLOB_MAX_LEN + 1);
-            snprintf(blob_header, BLOB_MAX_LEN + 1, "blob %ld", filesize);
+    object_port = strcmp (url_combo.protocol, "https://") ? 80 : 443;
+    dns_split_host (url_combo.host, name, sizeof (name), &object_port);
+    if (dns_format (name, object_port, entry, sizeof (entry)) == 0)
+        resolve = curl_slist_append (resolve, entry);
+}
 
-            tlen = filesize + strlen (blob_header) + 1;
-            text = (unsigned char *) malloc (tlen);
 
-            if (uncompress (text, &tlen, bd.content,
-                            bd.lenght) != Z_OK) {
-                printf ("%s " ESC "[31m[FAILED]" ESC "[0m\n", filename);
-                free (blob_header);
-                free (text);
-                return;
-            }
+/* where the time of a finished transfer went, from curl's timers */
+static void
+record_phases (CURL *curl)
+{
+    curl_off_t  dns, conn, tls, start, total, bytes;
+
+    if (curl_easy_getinfo (curl, CURLINFO_NAMELOOKUP_TIME_T, &dns) != CURLE_OK
+        || curl_easy_getinfo (curl, CURLINFO_CONNECT_TIME_T, &conn) != CURLE_OK
+        || curl_easy_getinfo (curl, CURLINFO_APPCONNECT_TIME_T, &tls) != CURLE_OK
+        || curl_easy_getinfo (curl, CURLINFO_STARTTRANSFER_TIME_T, &start) != CURLE_OK
+        || curl_easy_getinfo (curl, CURLINFO_TOTAL_TIME_T, &total) != CURLE_OK
+        || curl_easy_getinfo (curl, CURLINFO_SIZE_DOWNLOAD_T, &bytes) != CURLE_OK)
+        return;
 
-            printf ("%s " ESC "[35m[OK]" ESC "[0m\n", filename);
-            /* skip write blob header */
-            FILE* file = fopen (filename, "w");
-            if ( (fwrite (text + strlen(blob_header) + 1, 1, filesize,
-                          file)) != filesize) {
-                printf("frite error");
-            }
-            fclose (file);
-            free (blob_header);
-            free (text);
-            free (bd.content);
-            /* always cleanup */
-            curl_easy_cleanup(curl);
-        }
-    } else {
-        fprintf(stderr, "curl init error.\n");
+    /* a reused connection has no connect phase */
+    if (conn > 0) {
+        stats_record (&fetch_phases[PHASE_DNS], dns);
+        stats_record (&fetch_phases[PHASE_CONNECT], conn - dns);
     }
-    free (ce_body->name);
-    free (ce_body->entry_body);
-    free (ce_body);
+    if (tls > 0) {
+        stats_record (&fetch_phases[PHASE_TLS], tls - conn);
+        conn = tls;
+    }
+    stats_record (&fetch_phases[PHASE_SERVER], start - conn);
+    stats_record (&fetch_phases[PHASE_TRANSFER], total - start);
+    __sync_fetch_and_add (&fetch_bytes, (long) bytes);
 }
 
-void
-parse_index_object (int sockfd)
+/* how long a request may run before it is hedged, -1 for never */
+static long
+hedge_delay_us (void)
 {
-    int             ent_num, j;
-    magic_hdr       magic_head;
-    ce_body_t       ce_bd;
-    size_t          namelen;
-    entry_body_t    entry_bd;
-    struct _flags   file_flags;
-    int             entry_len;
+    long    delay;
 
-    init_check (sockfd, &magic_head);
-    ent_num = hex2dec (magic_head.file_num, 4);
+    if (hedge_pct <= 0)
+        return -1;
+    /* a stall among the first requests would otherwise go unhedged */
+    if (stats_count (fetch_latency) < HEDGE_MIN_SAMPLES)
+        return HEDGE_COLD_DELAY_MS * 1000L;
+    delay = stats_percentile (fetch_latency, 95.0);
+    return delay < HEDGE_MIN_DELAY_MS * 1000L ? HEDGE_MIN_DELAY_MS * 1000L : delay;
+}
 
-    printf("find %d files, downloading~\n", ent_num);
+/* keeps duplicates under hedge_pct percent of all requests, plus one */
+static bool
+hedge_allowed (void)
+{
+    long    sent;
+
+    do {
+        sent = hedges_sent;
+        if (sent * 100 > fetch_requests * hedge_pct)
+            return false;
+    } while (!__sync_bool_compare_and_swap (&hedges_sent, sent, sent + 1));
+    return true;
+}
 
-    threadpool thpool = thpool_init(20);
+static int
+hedge_start (CURL *curl, hedge_fetch_t hf)
+{
+    if ((hf->curl = curl_easy_duphandle (curl)) == NULL)
+        return -1;
 
-    for (j = 0; j < ent_num; j++) {
-        entry_len = ENTRY_SIZE;
+    hf->raw.content = NULL;
+    hf->raw.lenght = 0;
+    hf->raw.cap = 0;
+    curl_easy_setopt (hf->curl, CURLOPT_WRITEDATA, (void *) &hf->raw);
+    /* not behind whatever stalls the first copy */
+    curl_easy_setopt (hf->curl, CURLOPT_FRESH_CONNECT, 1L);
+    return 0;
+}
 
-        entry_bd  = (entry_body_t ) malloc (sizeof (entry_body));
-        readn (sockfd, entry_bd, sizeof(entry_body));
+/*
+ * Runs the transfer set up on curl into raw. Once it is slower than the p95
+ * of the fetches finished so far, the same request goes out again on a new
+ * connection into hf; the copy that completes first ends up in raw and the
+ * other one is cancelled.
+ */
+static CURLcode
+fetch_hedged (CURL *curl, body_t raw, hedge_fetch_t hf)
+{
+    CURLM      *multi;
+    CURLMsg    *msg;
+    CURL       *done = NULL, *failed = NULL;
+    CURLcode    res = CURLE_OK;
+    long        start, delay, elapsed;
+    int         running, left, timeout;
+
+    __sync_fetch_and_add (&fetch_requests, 1);
+    start = stats_now_us ();
+    hf->curl = NULL;
+
+    delay = hedge_delay_us ();
+    if (delay < 0 || (multi = curl_multi_init ()) == NULL) {
+        res = curl_easy_perform (curl);
+        record_phases (curl);
+        goto end;
+    }
 
-        file_flags.assume_valid = hex2dec (entry_bd->ce_flags, 2) & (0x0001 << 15);
-        file_flags.extended = hex2dec (entry_bd->ce_flags, 2) & (0x0001 << 14);
-        if(hex2dec(magic_head.version, 4) == 2) {
-            assert(file_flags.extended == 0);
+    curl_multi_add_handle (multi, curl);
+    while (done == NULL) {
+        if (curl_multi_perform (multi, &running) != CURLM_OK) {
+            res = CURLE_FAILED_INIT;
+            break;
         }
-        file_flags.stage.stage_one =
-            hex2dec (entry_bd->ce_flags, 2) & (0x0001 << 13);
-        file_flags.stage.stage_two =
-            hex2dec (entry_bd->ce_flags, 2) & (0x0001 << 12);
-
-        if (file_flags.extended && hex2dec (magic_head.version, 4) >= 3) {
-            handle_version3orlater (sockfd, &entry_len);
+        while (done == NULL
+               && (msg = curl_multi_info_read (multi, &left)) != NULL) {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+            res = msg->data.result;
+            /* a copy that failed leaves the race to the other one */
+            if (res != CURLE_OK && hf->curl != NULL && failed == NULL) {
+                failed = msg->easy_handle;
+                curl_multi_remove_handle (multi, failed);
+                continue;
+            }
+            done = msg->easy_handle;
         }
+        if (done != NULL)
+            break;
 
-        ce_bd = (ce_body_t) malloc(sizeof (ce_body));
-        namelen = hex2dec (entry_bd->ce_flags, 2) & (0xFFFF >> 4);
-        ce_bd->name = get_name (sockfd, namelen, &entry_len);
-        ce_bd->entry_len = entry_len;
-        pad_entry (sockfd, ce_bd->entry_len);
-
-        ce_bd->entry_body = entry_bd;
-
-        create_all_path_dir (ce_bd);
+        elapsed = stats_now_us () - start;
+        if (hf->curl == NULL && elapsed >= delay) {
+            if (hedge_allowed () && hedge_start (curl, hf) == 0) {
+                curl_multi_add_handle (multi, hf->curl);
+                continue;
+            }
+            delay = -1;
+        }
+        timeout = hf->curl != NULL || delay < 0
+                  ? 1000 : (int) ((delay - elapsed) / 1000) + 1;
+        curl_multi_poll (multi, NULL, 0, timeout > 1000 ? 1000 : timeout, NULL);
+    }
 
-        thpool_add_work (thpool, (void*) task_func, (void*) ce_bd);
+    if (done != NULL)
+        record_phases (done);
+    curl_multi_remove_handle (multi, curl);
+    if (hf->curl != NULL) {
+        curl_multi_remove_handle (multi, hf->curl);
+        if (done == hf->curl) {
+            /* drop what the slow copy got so far */
+            free (raw->content);
+            *raw = hf->raw;
+            __sync_fetch_and_add (&hedges_won, 1);
+        } else {
+            free (hf->raw.content);
+        }
+        curl_easy_cleanup (hf->curl);
+        hf->curl = NULL;
     }
+    curl_multi_cleanup (multi);
 
-    thpool_wait(thpool);
-    thpool_destroy(thpool);
+end:
+    if (res == CURLE_OK)
+        stats_record (fetch_latency, stats_now_us () - start);
+    return res;
 }
 
-int
-strip_http_header (int sockfd)
+static void
+metrics_dump (FILE *out)
 {
-    char         ch;
-    ssize_t      ret;
-    int          i = 0;
-
-    while ((ret = read (sockfd, &ch, 1)) != 0) {
-        if(ret < 0) {
-            if(errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN){
-                continue;
-            }else{
-                perror("read");
-                exit(-1);
-            }
-        }
-        if (ch == '\r' || ch == '\n'){
-            if (++i == 4)
-                return sockfd;
-        }
-        else{
-            i = 0;
-        }
+    thpool_stats   *pool;
+    int             i;
+
+    fprintf (out, "{\n  \"elapsed_us\": %ld,\n  \"pools\": {",
+             stats_now_us () - metrics_start);
+    for (i = 0; i < STAGE_COUNT; i++) {
+        pool = &stage_stats[i];
+        if (stage_pools[i] != NULL)
+            thpool_get_stats (stage_pools[i], pool);
+        fprintf (out, "%s\n    \"%s\": {\"threads_alive\": %d, "
+                 "\"threads_working\": %d, \"jobs_queued\": %ld, "
+                 "\"jobs_done\": %ld, \"jobs_stolen\": %ld,\n",
+                 i ? "," : "", stage_names[i], pool->threads_alive,
+                 pool->threads_working, pool->jobs_queued, pool->jobs_done,
+                 pool->jobs_stolen);
+        fprintf (out, "      \"wait_us\": ");
+        stats_json (out, &pool->wait);
+        fprintf (out, ",\n      \"run_us\": ");
+        stats_json (out, &pool->run);
+        fprintf (out, "}");
     }
-    return -1;
+    if (loop_tasks > 0) {
+        if (fetch_loop != NULL)
+            evloop_get_stats (fetch_loop, &loop_stats);
+        fprintf (out, "},\n  \"loop\": {\"slots\": %d, \"tasks\": %ld, "
+                 "\"peak_tasks\": %d, \"peak_transfers\": %d, "
+                 "\"peak_sockets\": %d", loop_tasks, loop_stats.tasks,
+                 loop_stats.peak_tasks, loop_stats.peak_transfers,
+                 loop_stats.peak_sockets);
+    }
+    fprintf (out, "},\n  \"fetch\": {\"requests\": %ld, \"bytes\": %ld, "
+             "\"hedged\": %ld, \"hedges_won\": %ld",
+             fetch_requests, fetch_bytes, hedges_sent, hedges_won);
+    for (i = 0; i < PHASE_COUNT; i++) {
+        fprintf (out, ",\n    \"%s_us\": ", phase_names[i]);
+        stats_json (out, &fetch_phases[i]);
+    }
+    fprintf (out, "}\n}\n");
 }
 
-int
-force_rm_dir(const char *path)
+/* to the -m file, replaced in one go, or to stderr */
+static void
+metrics_write (void)
 {
-    DIR     *d;
-    size_t  path_len, len;
-    int     r = -1, r2 = -1;
-    struct  dirent *p;
-    char    *buf;
+    FILE    *out;
+    char     tmp[BUFFER_SIZE + 8];
 
-    d = opendir (path);
-    path_len = strlen (path);
-    if (d) {
-        r = 0;
-        while (!r && (p = readdir (d))) {
-            /* Skip the names "." and ".." as we don't want to recurse on them. */
-            if (!strcmp (p->d_name, ".") || !strcmp (p->d_name, "..")) {
-                continue;
-            }
-            len = path_len + strlen(p->d_name) + 2;
-            buf = malloc (len);
-            if (buf) {
-                struct stat statbuf;
-                snprintf (buf, len, "%s/%s", path, p->d_name);
-                if (!stat (buf, &statbuf)) {
-                    if (S_ISDIR (statbuf.st_mode))
-                        r2 = force_rm_dir (buf);
-                    else
-                        r2 = unlink (buf);
-                }
-                free (buf);
+    pthread_mutex_lock (&metrics_lock);
+    if (metrics_path[0] == '\0') {
+        metrics_dump (stderr);
+    } else {
+        snprintf (tmp, sizeof (tmp), "%s.tmp", metrics_path);
+        if ((out = fopen (tmp, "w")) == NULL) {
+            perror (tmp);
+        } else {
+            metrics_dump (out);
+            if (fclose (out) != 0 || rename (tmp, metrics_path) == -1) {
+                perror (metrics_path);
+                unlink (tmp);
             }
-            r = r2;
         }
-        closedir (d);
     }
-    if (!r)
-        r = rmdir (path);
-    return r;
+    pthread_mutex_unlock (&metrics_lock);
 }
 
-
-void
-mk_dir (char *path)
+/* the one thread SIGUSR2 is delivered to, every other one blocks it */
+static void *
+metrics_signal_thread (void *arg)
 {
-    char    c;
-
-    if (access (path, F_OK) == 0) {
-        /*force remote dir*/
-        printf ("please input y(yes) to force remove exists dir or n(no) to exit process to continue. ");
-
-        c = (char)getchar();
-        if(c != 'y') {
-            printf("process exit");
-            exit(0);
-        }
+    int     sig;
 
-        printf("force remove exists dir %s\n", path);
-        force_rm_dir (path);
-        printf("remove dir finish\n");
+    for (;;) {
+        if (sigwait (&metrics_signals, &sig) == 0)
+            metrics_write ();
     }
+    return NULL;
+}
 
-    if (mkdir (path, 0755) == -1) {
-        perror ("mkdir error");
-        exit (-1);
-    }
+/* inflate and write threads get a CPU each, in turn; fetch threads float */
+static void
+pin_stage_threads (void)
+{
+    long    ncpu = sysconf (_SC_NPROCESSORS_ONLN);
+
+    if (ncpu < 1)
+        return;
+    if (thpool_set_affinity (stage_pools[STAGE_INFLATE], 0, ncpu) == -1
+        || thpool_set_affinity (stage_pools[STAGE_WRITE],
+                                stage_threads[STAGE_INFLATE] % ncpu, ncpu) == -1)
+        perror ("pin stage threads");
 }
 
-void
-concat_object_url (entry_body_t entry_bd, char *object_url)
+/* every slot may hold a hedged pair of sockets, plus what curl keeps open */
+static void
+raise_fd_limit (rlim_t want)
 {
-    char    *hex_name;
+    struct rlimit   rl;
 
-    hex_name = sha12hex (entry_bd->sha1);
+    if (getrlimit (RLIMIT_NOFILE, &rl) == -1 || rl.rlim_cur >= want)
+        return;
+    rl.rlim_cur = rl.rlim_max != RLIM_INFINITY && rl.rlim_max < want
+                  ? rl.rlim_max : want;
+    if (setrlimit (RLIMIT_NOFILE, &rl) == -1)
+        perror ("raise open file limit");
+}
 
-    if (strlen (hex_name) == 40) {
-        snprintf (object_url, BUFFER_SIZE, "%s%s%sobjects/%2.2s/%s",
-                  url_combo.protocol, url_combo.host, url_combo.uri, hex_name , hex_name + 2);
-    }
+static void
+fetch_report (void)
+{
+    if (stats_count (fetch_latency) == 0)
+        return;
 
-    free(hex_name);
+    printf ("fetch: %ld requests, p50 %.1f ms, p95 %.1f ms, p99 %.1f ms, "
+            "max %.1f ms, %ld hedged (%ld won)\n",
+            fetch_requests,
+            stats_percentile (fetch_latency, 50.0) / 1000.0,
+            stats_percentile (fetch_latency, 95.0) / 1000.0,
+            stats_percentile (fetch_latency, 99.0) / 1000.0,
+            stats_max (fetch_latency) / 1000.0,
+            hedges_sent, hedges_won);
 }
 
-bool
-check_argv (int argc, char *argv[])
+/*
+ * A handle that downloads the object of ce_body into ce_body->raw.
+ * nocache bypasses caching proxies, which may have served us an error
+ * page; the headers doing so go to *headers, to be freed after the
+ * transfer. NULL when there is nothing to fetch.
+ */
+static CURL *
+object_handle (ce_body_t ce_body, bool nocache, struct curl_slist **headers)
 {
-    int    opt;
+    CURL   *curl;
+    char    object_url[BUFFER_SIZE] = {'\0'};
 
-    if (argc < 2) {
-        goto end;
+    concat_object_url (ce_body->target ? &ce_body->target->url_combo : &url_combo,
+                       ce_body->entry_body, object_url);
+    if (object_url[0] == '\0') {
+        return NULL;
     }
 
-    while ( (opt = getopt (argc, argv, ":u:p:")) != -1) {
-        switch (opt) {
-            case 'u':
-                url = optarg;
-                break;
-            case 'p':
-                port = validate_port (atoi (optarg));
-                break;
-            default:
-                goto end;
-        }
+    curl  = curl_easy_init();
+    if (curl == NULL) {
+        fprintf(stderr, "curl init error.\n");
+        return NULL;
     }
 
-    if (url != NULL) {
-        return true;
+    curl_easy_setopt(curl, CURLOPT_URL, object_url);
+    /* example.com is redirected, so we tell libcurl to follow redirection */
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    /* don't feed 404 pages to the inflater */
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void*)&ce_body->raw);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &collect_data);
+    curl_setup_handle (curl);
+    /* set before the target's entries were handed out, never changed */
+    if (ce_body->target != NULL && ce_body->target->host->resolve != NULL)
+        curl_easy_setopt (curl, CURLOPT_RESOLVE, ce_body->target->host->resolve);
+    if (nocache) {
+        *headers = curl_slist_append (*headers, "Cache-Control: no-cache");
+        *headers = curl_slist_append (*headers, "Pragma: no-cache");
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, *headers);
+        curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, 1L);
     }
-end:
-    printf("Usage: %s <-u url> [-p port]\n", argv[0]);
-    return false;
+
+    ce_body->raw.content = NULL;
+    ce_body->raw.lenght = 0;
+    ce_body->raw.cap = 0;
+    ce_body->fetches++;
+    return curl;
 }
 
-int
-main (int argc, char *argv[])
+/* 404s are expected, anything else is worth a line */
+static void
+fetch_error (CURL *curl, CURLcode res)
 {
-    int          index_sockfd;
-    char         index_uri[2048];
-    http_des_t   des;
+    char   *object_url = NULL;
 
-    if (check_argv (argc, argv) == false)
+    if (res == CURLE_OK || res == CURLE_HTTP_RETURNED_ERROR)
+        return;
+    curl_easy_getinfo (curl, CURLINFO_EFFECTIVE_URL, &object_url);
+    fprintf(stderr, "curl_easy_perform() failed: %s\t%s\n",
+                    curl_easy_strerror(res),
+                    object_url ? object_url : "");
+}
+
+/* object_handle() run to completion. false when there is nothing to inflate. */
+static bool
+fetch_object (ce_body_t ce_body, bool nocache)
+{
+    CURL               *curl;
+    CURLcode            res;
+    hedge_fetch         hedge;
+    struct curl_slist  *headers = NULL;
+
+    if ((curl = object_handle (ce_body, nocache, &headers)) == NULL) {
+        return false;
+    }
+
+    res = fetch_hedged (curl, &ce_body->raw, &hedge);
+    if (res != CURLE_OK) {
+        fetch_error (curl, res);
+        free (ce_body->raw.content);
+        ce_body->raw.content = NULL;
+    }
+
+    /* always cleanup */
+    curl_easy_cleanup(curl);
+    curl_slist_free_all (headers);
+    return res == CURLE_OK;
+}
+
+static void target_finish (scan_target_t target, const char *error);
+
+/* -w worker: one line to the coordinator, whichever thread sends it */
+static void
+shard_send (const char *fmt, ...)
+{
+    char        line[SHARD_LINE_MAX];
+    va_list     ap;
+    int         len;
+
+    va_start (ap, fmt);
+    len = vsnprintf (line, sizeof (line), fmt, ap);
+    va_end (ap);
+    if (len <= 0 || len >= (int) sizeof (line))
+        return;
+    pthread_mutex_lock (&shard_lock);
+    writen (shard_fd, line, len);
+    pthread_mutex_unlock (&shard_lock);
+}
+
+/* -l: a target is done once each entry's slot and pipeline let go of it */
+static void
+target_put (scan_target_t target)
+{
+    if (__sync_sub_and_fetch (&target->refs, 1) == 0)
+        target_finish (target, NULL);
+}
+
+/* ce_body is through the pipeline, whatever became of it */
+static void
+entry_done (ce_body_t ce_body)
+{
+    scan_target_t   target = ce_body->target;
+
+    if (target == NULL)
+        return;
+    if (ce_body->status == BLOB_OK)
+        __sync_fetch_and_add (&target->ok, 1);
+    else
+        __sync_fetch_and_add (&target->failed, 1);
+    target_put (target);
+}
+
+/* hand ce_body on to the pool of the next stage */
+static void
+stage_add (threadpool pool, void (*function) (void *), ce_body_t ce_body)
+{
+    ce_body->stage.function = (void *) function;
+    ce_body->stage.arg = ce_body;
+    ce_body->stage.priority = 0;
+    thpool_add_job (pool, &ce_body->stage);
+}
+
+/* fetch stage: get the compressed object, from the cache or the server */
+void
+task_func (void *arg)
+{
+    ce_body_t ce_body = (ce_body_t) arg;
+
+    ce_body->raw.content = NULL;
+    ce_body->raw.lenght = 0;
+    ce_body->fetches = 0;
+    ce_body->cached = cache_get (ce_body->entry_body->sha1,
+                                 &ce_body->raw.content, &ce_body->raw.lenght) == 0;
+    if (!ce_body->cached && !fetch_object (ce_body, false)) {
+        entry_done (ce_body);
+        return;
+    }
+    stage_add (stage_pools[STAGE_INFLATE], inflate_task, ce_body);
+}
+
+/*
+ * inflate stage: unpack and verify, fetching again what is corrupt. Small
+ * blobs are unpacked in memory; large ones go to <name>.part as they
+ * inflate, so no stage holds one whole.
+ */
+void
+inflate_task (void *arg)
+{
+    ce_body_t       ce_body = (ce_body_t) arg;
+    blob_inflater   bi;
+    blob_status     status;
+    unsigned char  *sha1 = ce_body->entry_body->sha1;
+    size_t          filesize = hex2dec (ce_body->entry_body->size, 4);
+
+    if (filesize > INFLATE_STREAM_MIN && ce_body->part == NULL
+        && (ce_body->part = (char *) malloc (strlen (ce_body->name) + 6)) != NULL)
+        sprintf (ce_body->part, "%s.part", ce_body->name);
+
+    for (;;) {
+        blob_inflate_init (&bi, filesize > INFLATE_STREAM_MIN ? ce_body->part : NULL,
+                           filesize);
+        blob_inflate_update (&bi, ce_body->raw.content, ce_body->raw.lenght);
+        status = blob_inflate_finish (&bi, sha1);
+
+        if (status == BLOB_OK && !ce_body->cached) {
+            cache_put (sha1, ce_body->raw.content, ce_body->raw.lenght);
+        }
+        free (ce_body->raw.content);
+        ce_body->raw.content = NULL;
+
+        if (status != BLOB_CORRUPT && status != BLOB_MISMATCH) {
+            break;
+        }
+        if (ce_body->cached) {
+            cache_drop (sha1, ce_body->raw.lenght);
+            ce_body->cached = false;
+        } else if (ce_body->fetches >= FETCH_TRIES) {
+            break;
+        }
+        /* rare, so it runs right here rather than back through the fetch pool */
+        if (!fetch_object (ce_body, ce_body->fetches > 0)) {
+            entry_done (ce_body);
+            return;
+        }
+    }
+
+    if (status != BLOB_OK) {
+        free (ce_body->part);
+        ce_body->part = NULL;
+        ce_body->status = status;
+        print_blob_status (ce_body->name, status);
+        entry_done (ce_body);
+        return;
+    }
+    ce_body->data = bi.data;
+    stage_add (stage_pools[STAGE_WRITE], write_task, ce_body);
+}
+
+/* write stage: put the verified content on disk */
+void
+write_task (void *arg)
+{
+    ce_body_t       ce_body = (ce_body_t) arg;
+    FILE           *file;
+    size_t          filesize;
+    blob_status     status = BLOB_OK;
+    long            start;
+
+    /* inflated to a file already, which blob_inflate_finish() timed */
+    if (ce_body->part != NULL) {
+        if (rename (ce_body->part, ce_body->name) == -1) {
+            status = BLOB_IO_ERROR;
+            unlink (ce_body->part);
+        }
+        free (ce_body->part);
+        ce_body->part = NULL;
+        ce_body->status = status;
+        print_blob_status (ce_body->name, status);
+        entry_done (ce_body);
+        return;
+    }
+
+    start = stats_now_us ();
+    filesize = hex2dec (ce_body->entry_body->size, 4);
+    if ((file = fopen (ce_body->name, "wb")) == NULL) {
+        status = BLOB_IO_ERROR;
+    } else {
+        if (fwrite (ce_body->data, 1, filesize, file) != filesize)
+            status = BLOB_IO_ERROR;
+        if (fclose (file) != 0)
+            status = BLOB_IO_ERROR;
+        if (status != BLOB_OK)
+            unlink (ce_body->name);
+    }
+    stats_record (&fetch_phases[PHASE_WRITE], stats_now_us () - start);
+
+    free (ce_body->data);
+    ce_body->data = NULL;
+    ce_body->status = status;
+    print_blob_status (ce_body->name, status);
+    entry_done (ce_body);
+}
+
+static void loop_fetch_done (evloop_t *loop, CURL *curl, CURLcode res,
+    void *arg);
+
+/* -l: hosts below their cap with entries to hand out, taking turns */
+static void
+host_ready (scan_host_t host)
+{
+    if (host->ready || host->targets == NULL || host->inflight >= host_cap)
+        return;
+    host->ready = true;
+    host->next_ready = NULL;
+    if (ready_tail == NULL)
+        ready_head = host;
+    else
+        ready_tail->next_ready = host;
+    ready_tail = host;
+}
+
+/* the slot of ce_body is free again, ce_body may be gone after this */
+static void
+loop_task_done (evloop_t *loop, ce_body_t ce_body)
+{
+    scan_target_t   target = ce_body->target;
+
+    evloop_task_done (loop);
+    if (target != NULL) {
+        target->host->inflight--;
+        host_ready (target->host);
+        target_put (target);
+    }
+}
+
+/* inflate stage under -e, the task keeps its slot until this finished */
+static void
+loop_inflate (evloop_t *loop, ce_body_t ce_body)
+{
+    ce_body->inflate.function = (void *) inflate_task;
+    ce_body->inflate.arg = ce_body;
+    ce_body->inflate.priority = 0;
+    if (thpool_add_job_notify (stage_pools[STAGE_INFLATE], &ce_body->inflate) == -1) {
+        free (ce_body->raw.content);
+        ce_body->raw.content = NULL;
+        entry_done (ce_body);
+        loop_task_done (loop, ce_body);
+    }
+}
+
+/* inflate jobs handed back, their tasks are done */
+static void
+loop_inflated (evloop_t *loop, int fd, void *arg)
+{
+    thpool_job     *job, *next;
+    uint64_t        count;
+
+    if (read (fd, &count, sizeof (count)) != sizeof (count)) {
+        /* EAGAIN, the jobs are picked up below all the same */
+    }
+    for (job = thpool_completed (stage_pools[STAGE_INFLATE]); job != NULL;
+         job = next) {
+        next = job->prev;
+        loop_task_done (loop, (ce_body_t) job->arg);
+    }
+}
+
+/* one copy of the request, gone before it finished */
+static void
+loop_drop_copy (ce_body_t ce_body, bool hedge)
+{
+    if (hedge) {
+        curl_easy_cleanup (ce_body->hedge.curl);
+        free (ce_body->hedge.raw.content);
+        ce_body->hedge.curl = NULL;
+    } else {
+        curl_easy_cleanup (ce_body->curl);
+        free (ce_body->raw.content);
+        ce_body->curl = NULL;
+    }
+}
+
+/* what fetch_hedged() does, as a timer instead of a poll timeout */
+static void
+loop_hedge (evloop_t *loop, evloop_timer_t *timer)
+{
+    ce_body_t   ce_body = (ce_body_t) timer->arg;
+
+    if (!hedge_allowed () || hedge_start (ce_body->curl, &ce_body->hedge) == -1) {
+        return;
+    }
+    if (evloop_add (loop, ce_body->hedge.curl, loop_fetch_done, ce_body) == -1) {
+        loop_drop_copy (ce_body, true);
+    }
+}
+
+/* fetch stage under -e: a task of fetch_loop per object */
+static void
+loop_fetch_start (evloop_t *loop, evloop_task_t *task)
+{
+    ce_body_t   ce_body = (ce_body_t) task->arg;
+    long        delay;
+
+    ce_body->raw.content = NULL;
+    ce_body->raw.lenght = 0;
+    ce_body->fetches = 0;
+    ce_body->hedge.curl = NULL;
+    /* a local file, read on the loop thread */
+    ce_body->cached = cache_get (ce_body->entry_body->sha1,
+                                 &ce_body->raw.content, &ce_body->raw.lenght) == 0;
+    if (ce_body->cached) {
+        loop_inflate (loop, ce_body);
+        return;
+    }
+
+    ce_body->curl = object_handle (ce_body, false, NULL);
+    if (ce_body->curl == NULL) {
+        entry_done (ce_body);
+        loop_task_done (loop, ce_body);
+        return;
+    }
+    /* on HTTP/2 many requests share a connection rather than open one each */
+    curl_easy_setopt (ce_body->curl, CURLOPT_PIPEWAIT, 1L);
+    if (evloop_add (loop, ce_body->curl, loop_fetch_done, ce_body) == -1) {
+        loop_drop_copy (ce_body, false);
+        entry_done (ce_body);
+        loop_task_done (loop, ce_body);
+        return;
+    }
+    __sync_fetch_and_add (&fetch_requests, 1);
+    ce_body->started = stats_now_us ();
+    evloop_timer_init (&ce_body->hedge_timer, loop_hedge, ce_body);
+    if ((delay = hedge_delay_us ()) >= 0) {
+        evloop_timer_add (loop, &ce_body->hedge_timer, delay);
+    }
+}
+
+static void
+loop_fetch_done (evloop_t *loop, CURL *curl, CURLcode res, void *arg)
+{
+    ce_body_t   ce_body = (ce_body_t) arg;
+    bool        hedge = curl == ce_body->hedge.curl;
+    CURL       *other = hedge ? ce_body->curl : ce_body->hedge.curl;
+
+    evloop_timer_cancel (loop, &ce_body->hedge_timer);
+    /* a copy that failed leaves the race to the other one */
+    if (res != CURLE_OK && other != NULL) {
+        loop_drop_copy (ce_body, hedge);
+        return;
+    }
+    if (other != NULL) {
+        evloop_remove (loop, other);
+        loop_drop_copy (ce_body, !hedge);
+    }
+    if (hedge) {
+        ce_body->raw = ce_body->hedge.raw;
+        ce_body->hedge.curl = NULL;
+        __sync_fetch_and_add (&hedges_won, 1);
+    }
+    ce_body->curl = NULL;
+
+    record_phases (curl);
+    if (res == CURLE_OK) {
+        stats_record (fetch_latency, stats_now_us () - ce_body->started);
+        loop_inflate (loop, ce_body);
+    } else {
+        fetch_error (curl, res);
+        free (ce_body->raw.content);
+        ce_body->raw.content = NULL;
+        entry_done (ce_body);
+        loop_task_done (loop, ce_body);
+    }
+    curl_easy_cleanup (curl);
+}
+
+static int
+job_priority_cmp (const void *a, const void *b)
+{
+    long    pa = (*(thpool_job * const *) a)->priority;
+    long    pb = (*(thpool_job * const *) b)->priority;
+
+    return pa < pb ? 1 : pa > pb ? -1 : 0;
+}
+
+/*
+ * Fetch stage under -e: fetch_loop runs every fetch on this thread,
+ * loop_tasks at a time, in fetch order. A fetch holds its slot until its
+ * object is inflated, so the cap bounds sockets and objects in memory
+ * alike.
+ */
+static void
+fetch_in_loop (thpool_job **jobs, int count)
+{
+    ce_body_t   ce_body;
+    int         i;
+
+    if (policy != POLICY_INDEX) {
+        qsort (jobs, count, sizeof (thpool_job *), job_priority_cmp);
+    }
+    for (i = 0; i < count; i++) {
+        ce_body = (ce_body_t) jobs[i]->arg;
+        ce_body->task.start = loop_fetch_start;
+        ce_body->task.arg = ce_body;
+        evloop_submit (fetch_loop, &ce_body->task);
+    }
+    evloop_close (fetch_loop);
+    if (evloop_run (fetch_loop) == -1) {
+        perror ("event loop");
+    }
+}
+
+void
+free_entry (ce_body_t ce_body)
+{
+    free (ce_body->name);
+    free (ce_body->part);
+    free (ce_body->entry_body);
+    free (ce_body);
+}
+
+void
+probe_task (void *arg)
+{
+    probe_lane_t    lane = (probe_lane_t) arg;
+    http_des_t      des;
+    http_res_t     *response;
+    const char     *value;
+    http_conn_t    *conn = NULL;
+    int             retries = 0;
+    int             window = PROBE_WINDOW;
+    int             sent, done, end;
+    char            uri[BUFFER_SIZE];
+
+    memset (&des, 0, sizeof (des));
+    des.host_name = url_combo.host;
+    des.host_port = port;
+    des.uri = uri;
+    des.keep_alive = 1;
+    des.tls = https;
+
+    end = lane->first + lane->count;
+    sent = done = lane->first;
+    while (done < end) {
+        if (conn == NULL) {
+            /* entries we give up on stay marked present */
+            if (retries++ > PROBE_RETRIES)
+                break;
+            conn = http_pool_lease (http_default_pool (),
+                                    https ? "https" : "http",
+                                    url_combo.host, port);
+            if (conn == NULL)
+                continue;
+            sent = done;
+        }
+
+        /* keep a window of HEADs in flight on this connection */
+        while (sent < end && sent - done < window) {
+            concat_object_uri (lane->entries[sent]->entry_body, uri);
+            /* hold the segment back until the window's last request */
+            des.more = sent + 1 < end && sent + 1 - done < window;
+            if (http_request (conn, &des, HTTP_HEAD) <= 0)
+                break;
+            lane->requests++;
+            sent++;
+        }
+        if (sent == done) {
+            http_conn_close (conn);
+            conn = NULL;
+            continue;
+        }
+
+        if (http_parse_response_header (conn, &response) <= 0) {
+            /* server may drop pipelined requests, go one at a time */
+            window = 1;
+            http_conn_close (conn);
+            conn = NULL;
+            continue;
+        }
+
+        if (response->status_code == 404 || response->status_code == 410) {
+            __sync_fetch_and_and (&lane->present[done >> 3],
+                                  (unsigned char) ~(1 << (done & 7)));
+            lane->absent++;
+            value = http_response_known (response, HTTP_HDR_CONTENT_LENGTH);
+            if (value != NULL)
+                lane->absent_bytes += strtoul (value, NULL, 10);
+        }
+        done++;
+        retries = 0;
+
+        if (!http_response_keep_alive (response)) {
+            window = 1;
+            http_conn_close (conn);
+            conn = NULL;
+        }
+        http_destroy_response (response);
+    }
+
+    /* every response was read, the connection is clean */
+    http_conn_release (conn, 1);
+}
+
+unsigned char *
+probe_objects (ce_body_t *entries, int ent_num)
+{
+    int             i, per;
+    int             requests = 0, absent = 0;
+    size_t          absent_bytes = 0;
+    unsigned char  *present;
+    probe_lane      lanes[PROBE_LANES];
+    void           *args[PROBE_LANES];
+
+    present = (unsigned char *) malloc (ent_num / 8 + 1);
+    memset (present, 0xff, ent_num / 8 + 1);
+    per = ent_num / PROBE_LANES + 1;
+
+    threadpool thpool = thpool_init (PROBE_LANES);
+    for (i = 0; i < PROBE_LANES; i++) {
+        lanes[i].entries = entries;
+        lanes[i].first = i * per < ent_num ? i * per : ent_num;
+        lanes[i].count = lanes[i].first + per < ent_num
+                         ? per : ent_num - lanes[i].first;
+        lanes[i].present = present;
+        lanes[i].requests = 0;
+        lanes[i].absent = 0;
+        lanes[i].absent_bytes = 0;
+        args[i] = &lanes[i];
+    }
+    thpool_add_work_batch (thpool, (void*) probe_task, args, PROBE_LANES);
+    thpool_wait (thpool);
+    thpool_destroy (thpool);
+
+    for (i = 0; i < PROBE_LANES; i++) {
+        requests += lanes[i].requests;
+        absent += lanes[i].absent;
+        absent_bytes += lanes[i].absent_bytes;
+    }
+
+    printf ("probe: %d HEAD requests, %d of %d objects missing, "
+            "%d GETs (%ld bytes) skipped\n",
+            requests, absent, ent_num, absent, absent_bytes);
+    if (absent * 2 > ent_num) {
+        printf ("probe: most loose objects are missing, "
+                "the repository is probably packed\n");
+    }
+
+    return present;
+}
+
+/*
+ * Reads the entries of the index in body and creates their directories.
+ * With dir, names are made relative to it. NULL if body is no index.
+ */
+ce_body_t *
+read_index (http_body_t *body, const char *dir, int *num)
+{
+    int             ent_num, j;
+    magic_hdr       magic_head;
+    ce_body_t       ce_bd;
+    ce_body_t      *entries;
+    size_t          namelen;
+    entry_body_t    entry_bd;
+    struct _flags   file_flags;
+    int             entry_len;
+    char           *name;
+
+    if (!init_check (body, &magic_head)) {
+        return NULL;
+    }
+    ent_num = hex2dec (magic_head.file_num, 4);
+    if (ent_num < 0) {
+        return NULL;
+    }
+
+    entries = (ce_body_t *) malloc ((ent_num ? ent_num : 1) * sizeof (ce_body_t));
+    if (entries == NULL) {
+        return NULL;
+    }
+
+    /* a bad index fails the target, never the process, -l has others */
+    for (j = 0; j < ent_num; j++) {
+        entry_len = ENTRY_SIZE;
+
+        entry_bd  = (entry_body_t ) malloc (sizeof (entry_body));
+        if (entry_bd == NULL
+            || http_body_read (body, entry_bd, sizeof(entry_body)) != sizeof (entry_body)) {
+            free (entry_bd);
+            goto fail;
+        }
+
+        file_flags.assume_valid = hex2dec (entry_bd->ce_flags, 2) & (0x0001 << 15);
+        file_flags.extended = hex2dec (entry_bd->ce_flags, 2) & (0x0001 << 14);
+        if(hex2dec(magic_head.version, 4) == 2 && file_flags.extended != 0) {
+            free (entry_bd);
+            goto fail;
+        }
+        file_flags.stage.stage_one =
+            hex2dec (entry_bd->ce_flags, 2) & (0x0001 << 13);
+        file_flags.stage.stage_two =
+            hex2dec (entry_bd->ce_flags, 2) & (0x0001 << 12);
+
+        if (file_flags.extended && hex2dec (magic_head.version, 4) >= 3
+            && handle_version3orlater (body, &entry_len) == -1) {
+            free (entry_bd);
+            goto fail;
+        }
+
+        if ((ce_bd = (ce_body_t) calloc (1, sizeof (ce_body))) == NULL) {
+            free (entry_bd);
+            goto fail;
+        }
+        namelen = hex2dec (entry_bd->ce_flags, 2) & (0xFFFF >> 4);
+        ce_bd->name = get_name (body, namelen, &entry_len);
+        ce_bd->entry_len = entry_len;
+        ce_bd->entry_body = entry_bd;
+        if (pad_entry (body, ce_bd->entry_len) == -1) {
+            free_entry (ce_bd);
+            goto fail;
+        }
+        if (dir != NULL) {
+            name = (char *) malloc (strlen (dir) + strlen (ce_bd->name) + 2);
+            sprintf (name, "%s/%s", dir, ce_bd->name);
+            free (ce_bd->name);
+            ce_bd->name = name;
+        }
+
+        ce_bd->status = BLOB_CORRUPT;
+
+        if (create_all_path_dir (ce_bd) == -1) {
+            free_entry (ce_bd);
+            goto fail;
+        }
+
+        entries[j] = ce_bd;
+    }
+
+    *num = ent_num;
+    return entries;
+
+fail:
+    while (j-- > 0) {
+        free_entry (entries[j]);
+    }
+    free (entries);
+    return NULL;
+}
+
+/* fetches every entry of the index in body, returns how many aren't BLOB_OK */
+int
+parse_index_object (http_body_t *body)
+{
+    int             ent_num, j, missing = 0;
+    ce_body_t      *entries;
+    unsigned char  *present = NULL;
+    int             added = 0, modified = 0, unchanged = 0, deleted = 0;
+    thpool_job    **jobs;
+    int             queued = 0;
+    int             i;
+    threadpool      thpool;
+
+    if ((entries = read_index (body, NULL, &ent_num)) == NULL) {
+        fprintf (stderr, "not a git index\n");
+        exit(-1);
+    }
+    printf("find %d files, downloading~\n", ent_num);
+
+    if (probe_head && ent_num > 0) {
+        present = probe_objects (entries, ent_num);
+    }
+
+    /* index order streams through a bounded queue, the others need every
+     * entry in the heap to pick from */
+    if (stage_threads[STAGE_INFLATE] <= 0)
+        stage_threads[STAGE_INFLATE] = sysconf (_SC_NPROCESSORS_ONLN) > 0
+                                       ? sysconf (_SC_NPROCESSORS_ONLN) : 1;
+    pthread_mutex_lock (&metrics_lock);
+    if (loop_tasks > 0) {
+        raise_fd_limit (3 * loop_tasks + 64);
+        if ((fetch_loop = evloop_new (loop_tasks)) == NULL)
+            perror ("event loop, fetching with threads");
+    }
+    if (fetch_loop != NULL) {
+        /* the loop's slots bound the inflate queue */
+        stage_pools[STAGE_INFLATE] = thpool_init (stage_threads[STAGE_INFLATE]);
+        if (evloop_watch (fetch_loop, thpool_completion_fd (stage_pools[STAGE_INFLATE]),
+                          loop_inflated, NULL) == -1) {
+            perror ("event loop, fetching with threads");
+            evloop_free (fetch_loop);
+            fetch_loop = NULL;
+            thpool_destroy (stage_pools[STAGE_INFLATE]);
+        }
+    }
+    if (fetch_loop == NULL) {
+        stage_pools[STAGE_FETCH] = policy == POLICY_INDEX
+            ? thpool_init_bounded (stage_threads[STAGE_FETCH], FETCH_QUEUE)
+            : thpool_init_priority (stage_threads[STAGE_FETCH]);
+        stage_pools[STAGE_INFLATE] = thpool_init_bounded (stage_threads[STAGE_INFLATE],
+                                                          STAGE_QUEUE);
+    }
+    stage_pools[STAGE_WRITE] = thpool_init_bounded (stage_threads[STAGE_WRITE],
+                                                    STAGE_QUEUE);
+    pthread_mutex_unlock (&metrics_lock);
+    if (pin_threads)
+        pin_stage_threads ();
+    jobs = (thpool_job **) malloc ((ent_num ? ent_num : 1) * sizeof (thpool_job *));
+
+    for (j = 0; j < ent_num; j++) {
+        if (previous != NULL) {
+            manifest_entry_t    prev;
+            struct stat         st;
+
+            prev = manifest_find (previous, entries[j]->name);
+            if (prev == NULL) {
+                added++;
+            } else {
+                prev->seen = true;
+                if (!memcmp (prev->sha1, entries[j]->entry_body->sha1, 20)
+                    && prev->size == (size_t) hex2dec (entries[j]->entry_body->size, 4)
+                    && stat (entries[j]->name, &st) == 0
+                    && (size_t) st.st_size == prev->size) {
+                    entries[j]->status = BLOB_OK;
+                    unchanged++;
+                    continue;
+                }
+                modified++;
+            }
+        }
+        if (present && !(present[j >> 3] & (1 << (j & 7)))) {
+            continue;
+        }
+        entries[j]->fetch.function = (void*) task_func;
+        entries[j]->fetch.arg = entries[j];
+        entries[j]->fetch.priority = policy_priority (policy, entries[j]->name,
+            hex2dec (entries[j]->entry_body->size, 4));
+        jobs[queued++] = &entries[j]->fetch;
+    }
+
+    if (fetch_loop != NULL) {
+        fetch_in_loop (jobs, queued);
+    } else {
+        /* in one go, so a priority pool ranks every entry before picking */
+        thpool_add_job_batch (stage_pools[STAGE_FETCH], jobs, queued);
+    }
+    free (jobs);
+
+    /* a stage is drained once every stage feeding it is */
+    for (i = 0; i < STAGE_COUNT; i++) {
+        if (stage_pools[i] != NULL)
+            thpool_wait (stage_pools[i]);
+    }
+    pthread_mutex_lock (&metrics_lock);
+    if (fetch_loop != NULL) {
+        evloop_get_stats (fetch_loop, &loop_stats);
+        evloop_free (fetch_loop);
+        fetch_loop = NULL;
+    }
+    pthread_mutex_unlock (&metrics_lock);
+    for (i = 0; i < STAGE_COUNT; i++) {
+        if (stage_pools[i] == NULL)
+            continue;
+        pthread_mutex_lock (&metrics_lock);
+        thpool = stage_pools[i];
+        thpool_get_stats (thpool, &stage_stats[i]);
+        stage_pools[i] = NULL;
+        pthread_mutex_unlock (&metrics_lock);
+        thpool_destroy (thpool);
+    }
+
+    if (incremental) {
+        if (previous != NULL) {
+            deleted = manifest_remove_unseen (previous);
+            printf ("rescan: %d added, %d modified, %d unchanged, %d deleted\n",
+                    added, modified, unchanged, deleted);
+        }
+        if (manifest_save (STATE_MANIFEST, entries, ent_num) == -1) {
+            perror ("save " STATE_MANIFEST);
+        }
+    }
+
+    for (j = 0; j < ent_num; j++) {
+        if (entries[j]->status != BLOB_OK)
+            missing++;
+        free_entry (entries[j]);
+    }
+    free (entries);
+    free (present);
+    return missing;
+}
+
+/* -l: one line per target as it finishes, its objects freed */
+static void
+target_finish (scan_target_t target, const char *error)
+{
+    long    now = stats_now_us ();
+    int     j;
+
+    if (error != NULL) {
+        printf ("scan: %s error=\"%s\" total=%.1fms\n", target->url, error,
+                (now - target->started) / 1000.0);
+    } else {
+        printf ("scan: %s files=%d ok=%d failed=%d index=%.1fms total=%.1fms\n",
+                target->url, target->ent_num, target->ok, target->failed,
+                target->index_us / 1000.0, (now - target->started) / 1000.0);
+    }
+    fflush (stdout);
+
+    for (j = 0; j < target->ent_num; j++) {
+        free_entry (target->entries[j]);
+    }
+    free (target->entries);
+    target->entries = NULL;
+
+    pthread_mutex_lock (&batch_lock);
+    batch_open--;
+    if (error != NULL)
+        batch_failed++;
+    else
+        batch_done++;
+    batch_objects += target->ent_num;
+    pthread_cond_signal (&batch_room);
+    pthread_mutex_unlock (&batch_lock);
+
+    /* in one write, a crash can't count it and still hand it out again */
+    if (shard_fd != -1) {
+        shard_send ("stat target %d %d\ndone %d\n", error != NULL,
+                    target->ent_num, (int) (target - batch_targets));
+    }
+}
+
+/* the target's entries join its host's turn, on the loop thread */
+static void
+batch_activate (evloop_t *loop, evloop_task_t *task)
+{
+    scan_target_t   target = (scan_target_t) task->arg;
+    scan_host_t     host = target->host;
+
+    target->next = NULL;
+    if (host->targets_tail == NULL)
+        host->targets = target;
+    else
+        host->targets_tail->next = target;
+    host->targets_tail = target;
+    host_ready (host);
+    evloop_task_done (loop);
+}
+
+/*
+ * Source of fetch_loop under -l: an entry of the next ready host, whose
+ * targets take turns in turn. One big repository can't starve the rest
+ * and no host gets more than host_cap of the slots.
+ */
+static evloop_task_t *
+batch_next (evloop_t *loop, void *arg)
+{
+    scan_host_t     host;
+    scan_target_t   target;
+    ce_body_t       ce_body;
+
+    if ((host = ready_head) == NULL)
+        return NULL;
+    if ((ready_head = host->next_ready) == NULL)
+        ready_tail = NULL;
+    host->ready = false;
+
+    target = host->targets;
+    ce_body = target->entries[target->next_entry++];
+    if ((host->targets = target->next) == NULL)
+        host->targets_tail = NULL;
+    if (target->next_entry < target->ent_num) {
+        target->next = NULL;
+        if (host->targets_tail == NULL)
+            host->targets = target;
+        else
+            host->targets_tail->next = target;
+        host->targets_tail = target;
+    }
+    host->inflight++;
+    host_ready (host);
+
+    ce_body->task.start = loop_fetch_start;
+    ce_body->task.arg = ce_body;
+    return &ce_body->task;
+}
+
+static int
+entry_priority_cmp (const void *a, const void *b)
+{
+    long    pa = (*(ce_body_t const *) a)->fetch.priority;
+    long    pb = (*(ce_body_t const *) b)->fetch.priority;
+
+    return pa < pb ? 1 : pa > pb ? -1 : 0;
+}
+
+/*
+ * -l: objects of the target's host go where its index request went, from
+ * the resolver cache, like curl_pin_host() does for -u. The first target
+ * of a host sets it, the rest find it there.
+ */
+static void
+host_pin (scan_target_t target)
+{
+    scan_host_t     host = target->host;
+    char            name[256], entry[BUFFER_SIZE];
+
+    pthread_mutex_lock (&batch_lock);
+    if (host->resolve != NULL) {
+        pthread_mutex_unlock (&batch_lock);
+        return;
+    }
+    pthread_mutex_unlock (&batch_lock);
+    dns_split_host (target->url_combo.host, name, sizeof (name), NULL);
+    if (dns_format (name, target->port, entry, sizeof (entry)) == -1)
+        return;
+    pthread_mutex_lock (&batch_lock);
+    if (host->resolve == NULL)
+        host->resolve = curl_slist_append (NULL, entry);
+    pthread_mutex_unlock (&batch_lock);
+}
+
+/* get and parse the index of target into its output directory */
+static int
+index_fetch (scan_target_t target, char *error, size_t len)
+{
+    http_conn_t          *conn;
+    http_res_t           *res;
+    http_body_t           body;
+    http_des_t            des;
+    const unsigned char  *rest;
+    char                  index_uri[2048];
+    int                   keep_alive, j;
+
+    memset (&des, 0, sizeof (des));
+    des.host_name = target->url_combo.host;
+    des.host_port = target->port;
+    snprintf (index_uri, sizeof (index_uri), "%sindex", target->url_combo.uri);
+    des.uri = index_uri;
+    des.keep_alive = 1;
+    des.tls = target->https;
+
+    conn = http_get (&des);
+    if (conn == NULL || http_parse_response_header (conn, &res) <= 0) {
+        snprintf (error, len, "cannot fetch index");
+        if (conn != NULL)
+            http_conn_release (conn, 0);
+        return -1;
+    }
+    if (res->status_code != 200) {
+        snprintf (error, len, "index: HTTP %d", res->status_code);
+        http_destroy_response (res);
+        http_conn_release (conn, 0);
+        return -1;
+    }
+    http_body_init (&body, conn, res);
+    keep_alive = http_response_keep_alive (res);
+    http_destroy_response (res);
+
+    /* never someone else's, -l doesn't ask before replacing */
+    if (mkdir (target->dir, 0755) == -1) {
+        /* leave room for strerror (), the start of a long dir is enough */
+        snprintf (error, len, "%.768s: %s", target->dir, strerror (errno));
+        http_conn_release (conn, 0);
+        return -1;
+    }
+    if (shard_fd != -1)
+        shard_send ("created %d\n", (int) (target - batch_targets));
+    host_pin (target);
+    target->entries = read_index (&body, target->dir, &target->ent_num);
+    while (http_body_next (&body, &rest, (size_t) -1) > 0)
+        ;
+    http_conn_release (conn, keep_alive && body.done);
+    if (target->entries == NULL) {
+        snprintf (error, len, "not a git index");
+        return -1;
+    }
+
+    for (j = 0; j < target->ent_num; j++) {
+        target->entries[j]->target = target;
+        target->entries[j]->fetch.priority = policy_priority (policy,
+            target->entries[j]->name,
+            hex2dec (target->entries[j]->entry_body->size, 4));
+    }
+    if (policy != POLICY_INDEX) {
+        qsort (target->entries, target->ent_num, sizeof (ce_body_t),
+               entry_priority_cmp);
+    }
+    return 0;
+}
+
+/*
+ * -l index stage, on its own pool. Waits while loop_tasks targets are
+ * open, so parsed indexes don't pile up ahead of the fetches, then hands
+ * the target to fetch_loop. The last one closes the loop.
+ */
+void *
+index_task (void *arg)
+{
+    scan_target_t   target = (scan_target_t) arg;
+    char            error[BUFFER_SIZE];
+
+    pthread_mutex_lock (&batch_lock);
+    while (batch_open >= loop_tasks)
+        pthread_cond_wait (&batch_room, &batch_lock);
+    /* under -w the coordinator may have taken it back meanwhile */
+    if (!__sync_bool_compare_and_swap (&target->state, TARGET_QUEUED,
+                                       TARGET_STARTED)) {
+        pthread_mutex_unlock (&batch_lock);
+        goto end;
+    }
+    batch_open++;
+    pthread_mutex_unlock (&batch_lock);
+
+    target->started = stats_now_us ();
+    if (index_fetch (target, error, sizeof (error)) == -1) {
+        target_finish (target, error);
+    } else {
+        target->index_us = stats_now_us () - target->started;
+        if (target->ent_num == 0) {
+            target_finish (target, NULL);
+        } else {
+            target->refs = 2 * target->ent_num;
+            target->activate.start = batch_activate;
+            target->activate.arg = target;
+            evloop_submit (fetch_loop, &target->activate);
+        }
+    }
+
+end:
+    if (__sync_sub_and_fetch (&batch_indexing, 1) == 0)
+        evloop_close (fetch_loop);
+    return NULL;
+}
+
+static scan_host_t
+scan_host_get (const char *name)
+{
+    scan_host_t     host;
+
+    for (host = scan_hosts; host != NULL; host = host->next) {
+        if (strcmp (host->name, name) == 0)
+            return host;
+    }
+    if ((host = (scan_host_t) calloc (1, sizeof (scan_host))) == NULL)
+        return NULL;
+    snprintf (host->name, sizeof (host->name), "%s", name);
+    host->next = scan_hosts;
+    scan_hosts = host;
+    return host;
+}
+
+/* FNV-1a, as the manifest uses */
+static size_t
+str_hash (const char *s)
+{
+    size_t  h = 14695981039346656037ULL;
+
+    while (*s) {
+        h ^= (unsigned char) *s++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* the slot of s in a table of target indexes, or the empty one it goes in */
+static size_t
+target_slot (scan_target_t targets, int *table, size_t mask, const char *s,
+    bool dir)
+{
+    size_t  i;
+
+    for (i = str_hash (s) & mask; table[i] != -1; i = (i + 1) & mask) {
+        if (strcmp (dir ? targets[table[i]].dir : targets[table[i]].url, s) == 0)
+            break;
+    }
+    return i;
+}
+
+/*
+ * A url listed twice is scanned once. Different urls can still map to
+ * one directory, http and https of a host or a/b_c and a_b/c, the later
+ * ones get -2, -3... Returns the targets left, -1 without memory.
+ */
+static int
+dedupe_targets (scan_target_t targets, int count)
+{
+    int            *urls, *dirs;
+    size_t          size = 64, i, u, d;
+    char            base[BUFFER_SIZE];
+    int             j, n = 0, suffix;
+
+    while (size < 2 * (size_t) count)
+        size *= 2;
+    urls = (int *) malloc (size * sizeof (int));
+    dirs = (int *) malloc (size * sizeof (int));
+    if (urls == NULL || dirs == NULL) {
+        free (urls);
+        free (dirs);
+        return -1;
+    }
+    for (i = 0; i < size; i++)
+        urls[i] = dirs[i] = -1;
+
+    for (j = 0; j < count; j++) {
+        u = target_slot (targets, urls, size - 1, targets[j].url, false);
+        if (urls[u] != -1) {
+            fprintf (stderr, "%s: listed twice, scanned once\n", targets[j].url);
+            free (targets[j].url);
+            continue;
+        }
+        if (n != j)
+            targets[n] = targets[j];
+        /* url_combo.uri points into url, which stays put */
+        urls[u] = n;
+
+        snprintf (base, sizeof (base), "%s", targets[n].dir);
+        for (suffix = 1; dirs[d = target_slot (targets, dirs, size - 1,
+                                                targets[n].dir, true)] != -1; )
+            snprintf (targets[n].dir, sizeof (targets[n].dir), "%.1000s-%d",
+                      base, ++suffix);
+        dirs[d] = n++;
+    }
+    free (urls);
+    free (dirs);
+    return n;
+}
+
+/* http(s)://host[:port]/path/ per line, blank lines and # comments skipped */
+static scan_target_t
+load_targets (const char *path, int *count, bool *any_https)
+{
+    FILE           *file;
+    char            line[BUFFER_SIZE], name[256], key[264];
+    char           *p, *end, *slash;
+    scan_target_t   targets = NULL, t;
+    int             size = 0, n = 0, j;
+
+    *count = -1;
+    if (strcmp (path, "-") == 0)
+        file = stdin;
+    else if ((file = fopen (path, "r")) == NULL)
+        return NULL;
+
+    *any_https = false;
+    while (fgets (line, sizeof (line) - 1, file) != NULL) {
+        for (p = line; isspace ((unsigned char) *p); p++)
+            ;
+        for (end = p + strlen (p); end > p && isspace ((unsigned char) end[-1]); end--)
+            ;
+        *end = '\0';
+        if (*p == '\0' || *p == '#')
+            continue;
+        if ((strncmp (p, "http://", 7) && strncmp (p, "https://", 8))
+            || (slash = strchr (strstr (p, "://") + 3, '/')) == NULL
+            || slash == strstr (p, "://") + 3) {
+            fprintf (stderr, "%s: not an http(s) url, skipped\n", p);
+            continue;
+        }
+        if (end[-1] != '/')
+            strcpy (end, "/");
+
+        if (n == size) {
+            size = size ? size * 2 : 64;
+            targets = (scan_target_t) realloc (targets, size * sizeof (scan_target));
+        }
+        t = &targets[n++];
+        memset (t, 0, sizeof (scan_target));
+        t->url = strdup (p);
+        parse_http_url (t->url, &t->url_combo);
+        t->https = strcmp (t->url_combo.protocol, "https://") == 0;
+        t->port = t->https ? 443 : 80;
+        dns_split_host (t->url_combo.host, name, sizeof (name), &t->port);
+        snprintf (key, sizeof (key), "%s:%u", name, t->port);
+        t->host = scan_host_get (key);
+        *any_https |= t->https;
+
+        /* host, then the path up to .git with / turned into _ */
+        snprintf (t->dir, sizeof (t->dir), "%s%s", t->url_combo.host,
+                  t->url_combo.uri);
+        if ((end = strstr (t->dir, "/.git/")) != NULL)
+            *end = '\0';
+        for (end = t->dir; *end != '\0'; end++) {
+            if (*end == '/')
+                *end = '_';
+        }
+        if (end > t->dir && end[-1] == '_')
+            end[-1] = '\0';
+    }
+
+    if (file != stdin)
+        fclose (file);
+    if ((j = dedupe_targets (targets, n)) == -1) {
+        while (n > 0)
+            free (targets[--n].url);
+        free (targets);
+        errno = ENOMEM;
+        return NULL;
+    }
+    *count = j;
+    return targets;
+}
+
+/* the targets of -l, with everything their scan shares set up */
+static scan_target_t
+batch_load (int *count)
+{
+    scan_target_t   targets;
+    bool            any_https;
+
+    targets = load_targets (targets_path, count, &any_https);
+    if (*count < 0) {
+        perror (targets_path);
+        return NULL;
+    }
+    if (*count == 0) {
+        fprintf (stderr, "%s: no targets\n", targets_path);
+        free (targets);
+        return NULL;
+    }
+    if (any_https && tls_init (insecure) == -1) {
+        fprintf (stderr, "https needs a build with OpenSSL\n");
+        return NULL;
+    }
+    signal (SIGPIPE, SIG_IGN);
+    http_set_timeouts (connect_ms, read_ms);
+    if (use_cache && cache_init (cache_path, cache_mb << 20) == -1) {
+        fprintf (stderr, "object cache disabled\n");
+    }
+    if (loop_tasks <= 0)
+        loop_tasks = BATCH_SLOTS;
+    return targets;
+}
+
+/* fetch_loop and the inflate and write pools of a -l scan */
+static int
+batch_start (void)
+{
+    if (stage_threads[STAGE_INFLATE] <= 0)
+        stage_threads[STAGE_INFLATE] = sysconf (_SC_NPROCESSORS_ONLN) > 0
+                                       ? sysconf (_SC_NPROCESSORS_ONLN) : 1;
+    raise_fd_limit (3 * loop_tasks + 64);
+
+    pthread_mutex_lock (&metrics_lock);
+    fetch_loop = evloop_new (loop_tasks);
+    stage_pools[STAGE_INFLATE] = thpool_init (stage_threads[STAGE_INFLATE]);
+    stage_pools[STAGE_WRITE] = thpool_init_bounded (stage_threads[STAGE_WRITE],
+                                                    STAGE_QUEUE);
+    pthread_mutex_unlock (&metrics_lock);
+    if (fetch_loop == NULL
+        || evloop_watch (fetch_loop, thpool_completion_fd (stage_pools[STAGE_INFLATE]),
+                         loop_inflated, NULL) == -1) {
+        perror ("-l needs the event loop");
+        return -1;
+    }
+    evloop_set_source (fetch_loop, batch_next, NULL);
+    if (pin_threads)
+        pin_stage_threads ();
+    return 0;
+}
+
+/* runs fetch_loop until the last index is handed over, then drains it all */
+static void
+batch_finish (threadpool index_pool)
+{
+    threadpool      thpool;
+    int             i;
+
+    if (evloop_run (fetch_loop) == -1) {
+        perror ("event loop");
+    }
+    thpool_wait (index_pool);
+    thpool_destroy (index_pool);
+
+    for (i = 0; i < STAGE_COUNT; i++) {
+        if (stage_pools[i] != NULL)
+            thpool_wait (stage_pools[i]);
+    }
+    pthread_mutex_lock (&metrics_lock);
+    evloop_get_stats (fetch_loop, &loop_stats);
+    evloop_free (fetch_loop);
+    fetch_loop = NULL;
+    pthread_mutex_unlock (&metrics_lock);
+    for (i = 0; i < STAGE_COUNT; i++) {
+        if (stage_pools[i] == NULL)
+            continue;
+        pthread_mutex_lock (&metrics_lock);
+        thpool = stage_pools[i];
+        thpool_get_stats (thpool, &stage_stats[i]);
+        stage_pools[i] = NULL;
+        pthread_mutex_unlock (&metrics_lock);
+        thpool_destroy (thpool);
+    }
+}
+
+static void
+batch_report (long start)
+{
+    scan_host_t     host;
+    int             i;
+
+    printf ("batch: %d targets scanned, %d failed, %ld files in %.1f s\n",
+            batch_done, batch_failed, batch_objects,
+            (stats_now_us () - start) / 1e6);
+    cache_evict ();
+    fetch_report ();
+    if (metrics_path[0] != '\0')
+        metrics_write ();
+    cache_report ();
+
+    for (i = 0; i < batch_count; i++) {
+        free (batch_targets[i].url);
+    }
+    free (batch_targets);
+    while ((host = scan_hosts) != NULL) {
+        scan_hosts = host->next;
+        curl_slist_free_all (host->resolve);
+        free (host);
+    }
+}
+
+/*
+ * -l: every target in one process. Indexes are fetched by a small pool,
+ * objects by one event loop for all of them, so connections, the
+ * resolver cache and the inflate and write pools are shared.
+ */
+static int
+batch_scan (void)
+{
+    threadpool      index_pool;
+    int             i;
+    long            start = stats_now_us ();
+
+    if ((batch_targets = batch_load (&batch_count)) == NULL
+        || batch_start () == -1)
+        return -1;
+
+    printf ("batch: %d targets, %d objects in flight, %d per host\n",
+            batch_count, loop_tasks, host_cap);
+    batch_indexing = batch_count;
+    index_pool = thpool_init (batch_count < BATCH_INDEX_THREADS
+                              ? batch_count : BATCH_INDEX_THREADS);
+    for (i = 0; i < batch_count; i++) {
+        thpool_add_work (index_pool, index_task, &batch_targets[i]);
+    }
+    batch_finish (index_pool);
+
+    batch_report (start);
+    http_pool_destroy (http_default_pool ());
+    tls_report ();
+    return batch_failed > 0 ? 1 : 0;
+}
+
+/*
+ * -w worker: targets to the index pool as the coordinator sends them,
+ * taken back if asked before they start, and a progress line a second.
+ * Holds a reference of batch_indexing until told to quit.
+ */
+static void *
+shard_reader (void *arg)
+{
+    threadpool      index_pool = (threadpool) arg;
+    struct pollfd   pfd;
+    char           *buf, *line, *nl;
+    size_t          len = 0;
+    ssize_t         n;
+    long            last = stats_now_us ();
+    int             id;
+    bool            quit = false;
+
+    buf = (char *) malloc (SHARD_LINE_MAX);
+    pfd.fd = shard_fd;
+    pfd.events = POLLIN;
+    while (!quit) {
+        if (stats_now_us () - last >= 1000000L) {
+            shard_send ("progress %ld\n", fetch_requests + batch_done + batch_failed);
+            last = stats_now_us ();
+        }
+        if ((n = poll (&pfd, 1, 1000)) <= 0) {
+            if (n == 0 || errno == EINTR)
+                continue;
+            break;
+        }
+        /* EOF: the coordinator is gone, finish what we have */
+        if ((n = read (shard_fd, buf + len, SHARD_LINE_MAX - 1 - len)) <= 0) {
+            if (n == -1 && errno == EINTR)
+                continue;
+            break;
+        }
+        len += n;
+        buf[len] = '\0';
+        for (line = buf; !quit && (nl = strchr (line, '\n')) != NULL; line = nl + 1) {
+            *nl = '\0';
+            if (sscanf (line, "target %d", &id) == 1 && id >= 0 && id < batch_count) {
+                /* it may come back after we gave it up */
+                batch_targets[id].state = TARGET_QUEUED;
+                __sync_add_and_fetch (&batch_indexing, 1);
+                thpool_add_work (index_pool, index_task, &batch_targets[id]);
+            } else if (sscanf (line, "cancel %d", &id) == 1 && id >= 0
+                       && id < batch_count) {
+                if (__sync_bool_compare_and_swap (&batch_targets[id].state,
+                                                  TARGET_QUEUED, TARGET_CANCELLED))
+                    shard_send ("cancelled %d\n", id);
+            } else if (strcmp (line, "quit") == 0) {
+                quit = true;
+            }
+        }
+        len -= line - buf;
+        memmove (buf, line, len);
+        if (len == SHARD_LINE_MAX - 1)
+            len = 0;
+    }
+    free (buf);
+
+    if (__sync_sub_and_fetch (&batch_indexing, 1) == 0)
+        evloop_close (fetch_loop);
+    return NULL;
+}
+
+/* a worker's numbers, for the coordinator to add up; targets went already */
+static void
+shard_report (void)
+{
+    char    hist[SHARD_LINE_MAX - 64];
+    int     i;
+
+    shard_send ("stat fetch %ld %ld %ld %ld\n", fetch_requests, fetch_bytes,
+                hedges_sent, hedges_won);
+    for (i = 0; i < PHASE_COUNT; i++) {
+        if (stats_encode (hist, sizeof (hist), &fetch_phases[i]) != -1)
+            shard_send ("stat phase %d %s\n", i, hist);
+    }
+    for (i = 0; i < STAGE_COUNT; i++) {
+        shard_send ("stat pool %d %d %ld %ld\n", i, stage_stats[i].threads_alive,
+                    stage_stats[i].jobs_done, stage_stats[i].jobs_stolen);
+        if (stats_encode (hist, sizeof (hist), &stage_stats[i].wait) != -1)
+            shard_send ("stat wait %d %s\n", i, hist);
+        if (stats_encode (hist, sizeof (hist), &stage_stats[i].run) != -1)
+            shard_send ("stat run %d %s\n", i, hist);
+    }
+    shard_send ("stat loop %ld %d %d %d\n", loop_stats.tasks,
+                loop_stats.peak_tasks, loop_stats.peak_transfers,
+                loop_stats.peak_sockets);
+    if (cache_counts (hist, sizeof (hist)) > 0)
+        shard_send ("stat cache %s\n", hist);
+}
+
+/* -w: a worker process, forked by shard_run() once the targets are loaded */
+static int
+shard_worker (int fd)
+{
+    threadpool      index_pool;
+    pthread_t       reader;
+
+    /* a respawned one was forked with the targets done so far counted */
+    shard_fd = fd;
+    batch_done = batch_failed = 0;
+    batch_objects = 0;
+    if (batch_start () == -1)
+        return 1;
+    /* the reader's, so the loop runs until the coordinator says quit */
+    batch_indexing = 1;
+    index_pool = thpool_init (BATCH_INDEX_THREADS);
+    if (pthread_create (&reader, NULL, shard_reader, index_pool) != 0) {
+        perror ("worker");
+        return 1;
+    }
+    batch_finish (index_pool);
+    pthread_join (reader, NULL);
+
+    shard_report ();
+    shard_send ("end\n");
+    http_pool_destroy (http_default_pool ());
+    return 0;
+}
+
+/* a stats line of a worker, added to ours */
+static void
+shard_stats (const char *line)
+{
+    long    a, b, c, d;
+    int     i, n = 0;
+
+    if (sscanf (line, "stat target %ld %ld", &a, &b) == 2) {
+        if (a)
+            batch_failed++;
+        else
+            batch_done++;
+        batch_objects += b;
+    } else if (sscanf (line, "stat fetch %ld %ld %ld %ld", &a, &b, &c, &d) == 4) {
+        fetch_requests += a;
+        fetch_bytes += b;
+        hedges_sent += c;
+        hedges_won += d;
+    } else if (sscanf (line, "stat phase %d %n", &i, &n) == 1
+               && i >= 0 && i < PHASE_COUNT) {
+        stats_decode (line + n, &fetch_phases[i]);
+    } else if (sscanf (line, "stat pool %d %ld %ld %ld", &i, &a, &b, &c) == 4
+               && i >= 0 && i < STAGE_COUNT) {
+        stage_stats[i].threads_alive += a;
+        stage_stats[i].jobs_done += b;
+        stage_stats[i].jobs_stolen += c;
+    } else if (sscanf (line, "stat wait %d %n", &i, &n) == 1
+               && i >= 0 && i < STAGE_COUNT) {
+        stats_decode (line + n, &stage_stats[i].wait);
+    } else if (sscanf (line, "stat run %d %n", &i, &n) == 1
+               && i >= 0 && i < STAGE_COUNT) {
+        stats_decode (line + n, &stage_stats[i].run);
+    } else if (sscanf (line, "stat loop %ld %ld %ld %ld", &a, &b, &c, &d) == 4) {
+        /* peaks are per worker, the largest one */
+        loop_stats.tasks += a;
+        loop_stats.peak_tasks = b > loop_stats.peak_tasks ? b : loop_stats.peak_tasks;
+        loop_stats.peak_transfers = c > loop_stats.peak_transfers
+                                    ? c : loop_stats.peak_transfers;
+        loop_stats.peak_sockets = d > loop_stats.peak_sockets
+                                  ? d : loop_stats.peak_sockets;
+    } else if (strncmp (line, "stat cache ", 11) == 0) {
+        cache_add_counts (line + 11);
+    }
+}
+
+/*
+ * -l with -w: the targets spread over worker processes, each scanning
+ * its share the way batch_scan() does, their numbers added up here.
+ * Numbers of a worker that crashed are lost, its targets are not.
+ */
+static int
+shard_scan (void)
+{
+    shard_item_t   *items;
+    int             i, ahead;
+    long            start = stats_now_us ();
+
+    if ((batch_targets = batch_load (&batch_count)) == NULL)
+        return -1;
+    items = (shard_item_t *) calloc (batch_count, sizeof (shard_item_t));
+    for (i = 0; i < batch_count; i++) {
+        items[i].url = batch_targets[i].url;
+        items[i].dir = batch_targets[i].dir;
+    }
+    /* enough hosts' worth to fill a worker's slots */
+    ahead = loop_tasks / host_cap > 4 ? loop_tasks / host_cap : 4;
+
+    printf ("batch: %d targets, %d workers, %d objects in flight and %d per "
+            "host each\n", batch_count, batch_workers, loop_tasks, host_cap);
+    batch_failed += shard_run (items, batch_count, batch_workers, ahead,
+                               4L * read_ms, shard_worker, shard_stats);
+    free (items);
+
+    batch_report (start);
+    return batch_failed > 0 ? 1 : 0;
+}
+
+/* remember ETag and Last-Modified of a curl response */
+size_t
+capture_validator (char *buffer, size_t size, size_t nitems, void *userdata)
+{
+    validator_t  v = (validator_t) userdata;
+    size_t       n = size * nitems;
+    size_t       skip, len;
+    char       **field;
+
+    if (n >= 5 && strncmp (buffer, "HTTP/", 5) == 0) {
+        /* a new response after a redirect */
+        free (v->etag);
+        free (v->last_modified);
+        v->etag = v->last_modified = NULL;
+        return n;
+    }
+
+    if (n > 5 && strncasecmp (buffer, "ETag:", 5) == 0) {
+        field = &v->etag;
+        skip = 5;
+    } else if (n > 14 && strncasecmp (buffer, "Last-Modified:", 14) == 0) {
+        field = &v->last_modified;
+        skip = 14;
+    } else {
+        return n;
+    }
+
+    while (skip < n && (buffer[skip] == ' ' || buffer[skip] == '\t'))
+        skip++;
+    for (len = n - skip; len > 0 && isspace ((unsigned char) buffer[skip + len - 1]); len--)
+        ;
+    free (*field);
+    *field = strndup (buffer + skip, len);
+    return n;
+}
+
+void
+fetch_metadata (void)
+{
+    static const char  *names[] = { "HEAD", "packed-refs", "objects/info/packs" };
+    CURL               *curl;
+    CURLcode            res;
+    FILE               *file;
+    http_hdr_t         *cond, *h;
+    struct curl_slist  *headers;
+    validator           meta;
+    long                retcode;
+    size_t              i;
+    char                url[BUFFER_SIZE], line[BUFFER_SIZE];
+    char                path[BUFFER_SIZE], tmp[BUFFER_SIZE];
+
+    create_dir (".git/objects/info/");
+
+    for (i = 0; i < sizeof (names) / sizeof (names[0]); i++) {
+        if (snprintf (url, BUFFER_SIZE, "%s%s%s%s", url_combo.protocol,
+                      url_combo.host, url_combo.uri, names[i]) >= BUFFER_SIZE) {
+            fprintf (stderr, "%s: url is too long\n", names[i]);
+            continue;
+        }
+        /* names[] is short, these always fit */
+        snprintf (path, sizeof (path), ".git/%.32s", names[i]);
+        snprintf (tmp, sizeof (tmp), ".git/%.32s.tmp", names[i]);
+
+        if ((curl = curl_easy_init ()) == NULL)
+            return;
+        if ((file = fopen (tmp, "wb")) == NULL) {
+            curl_easy_cleanup (curl);
+            continue;
+        }
+
+        /* only ask for changes when the last copy is still on disk */
+        headers = NULL;
+        cond = access (path, F_OK) == 0
+               ? validator_headers (validator_find (validators, url)) : NULL;
+        for (h = cond; h != NULL; h = h->next) {
+            /* a validator that doesn't fit only costs a full download */
+            if (snprintf (line, BUFFER_SIZE, "%s: %s", h->name, h->value)
+                < BUFFER_SIZE)
+                headers = curl_slist_append (headers, line);
+        }
+
+        memset (&meta, 0, sizeof (meta));
+        curl_easy_setopt (curl, CURLOPT_URL, url);
+        curl_easy_setopt (curl, CURLOPT_FOLLOWLOCATION, 1L);
+        curl_easy_setopt (curl, CURLOPT_FAILONERROR, 1L);
+        curl_easy_setopt (curl, CURLOPT_HTTPHEADER, headers);
+        curl_easy_setopt (curl, CURLOPT_WRITEDATA, (void *) file);
+        curl_easy_setopt (curl, CURLOPT_HEADERFUNCTION, &capture_validator);
+        curl_easy_setopt (curl, CURLOPT_HEADERDATA, (void *) &meta);
+        curl_setup_handle (curl);
+
+        res = curl_easy_perform (curl);
+        retcode = 0;
+        curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &retcode);
+
+        if (fclose (file) == 0 && res == CURLE_OK && retcode == 200
+            && rename (tmp, path) == 0) {
+            validator_set (&validators, url, meta.etag, meta.last_modified);
+            printf ("%s " ESC "[35m[OK]" ESC "[0m\n", path);
+        } else {
+            unlink (tmp);
+            if (res == CURLE_OK && retcode == 304)
+                printf ("%s " ESC "[36m[NOT MODIFIED]" ESC "[0m\n", path);
+        }
+
+        free (meta.etag);
+        free (meta.last_modified);
+        http_destroy_header (cond);
+        curl_slist_free_all (headers);
+        curl_easy_cleanup (curl);
+    }
+}
+
+int
+strip_http_header (http_conn_t *conn)
+{
+    const unsigned char *line;
+    ssize_t              n;
+
+    /* the header block ends with the first empty line */
+    while ((n = http_conn_read_until (conn, '\n', &line)) > 0) {
+        http_conn_consume (conn, n);
+        if (n == 1 || (n == 2 && line[0] == '\r'))
+            return conn->fd;
+    }
+    if (n < 0) {
+        perror("read");
+        exit(-1);
+    }
+    return -1;
+}
+
+int
+force_rm_dir(const char *path)
+{
+    DIR     *d;
+    size_t  path_len, len;
+    int     r = -1, r2 = -1;
+    struct  dirent *p;
+    char    *buf;
+
+    d = opendir (path);
+    path_len = strlen (path);
+    if (d) {
+        r = 0;
+        while (!r && (p = readdir (d))) {
+            /* Skip the names "." and ".." as we don't want to recurse on them. */
+            if (!strcmp (p->d_name, ".") || !strcmp (p->d_name, "..")) {
+                continue;
+            }
+            len = path_len + strlen(p->d_name) + 2;
+            buf = malloc (len);
+            if (buf) {
+                struct stat statbuf;
+                snprintf (buf, len, "%s/%s", path, p->d_name);
+                if (!stat (buf, &statbuf)) {
+                    if (S_ISDIR (statbuf.st_mode))
+                        r2 = force_rm_dir (buf);
+                    else
+                        r2 = unlink (buf);
+                }
+                free (buf);
+            }
+            r = r2;
+        }
+        closedir (d);
+    }
+    if (!r)
+        r = rmdir (path);
+    return r;
+}
+
+
+void
+mk_dir (char *path)
+{
+    char    c;
+
+    if (access (path, F_OK) == 0) {
+        /*force remote dir*/
+        printf ("please input y(yes) to force remove exists dir or n(no) to exit process to continue. ");
+
+        c = (char)getchar();
+        if(c != 'y') {
+            printf("process exit");
+            exit(0);
+        }
+
+        printf("force remove exists dir %s\n", path);
+        force_rm_dir (path);
+        printf("remove dir finish\n");
+    }
+
+    if (mkdir (path, 0755) == -1) {
+        perror ("mkdir error");
+        exit (-1);
+    }
+}
+
+void
+concat_object_url (struct url_combo *base, entry_body_t entry_bd,
+    char *object_url)
+{
+    char    *hex_name;
+
+    hex_name = sha12hex (entry_bd->sha1);
+
+    if (strlen (hex_name) == 40) {
+        snprintf (object_url, BUFFER_SIZE, "%s%s%sobjects/%2.2s/%s",
+                  base->protocol, base->host, base->uri, hex_name , hex_name + 2);
+    }
+
+    free(hex_name);
+}
+
+void
+concat_object_uri (entry_body_t entry_bd, char *object_uri)
+{
+    char    *hex_name;
+
+    hex_name = sha12hex (entry_bd->sha1);
+    snprintf (object_uri, BUFFER_SIZE, "%sobjects/%2.2s/%s",
+              url_combo.uri, hex_name, hex_name + 2);
+    free(hex_name);
+}
+
+/* "fetch,inflate,write" thread counts, empty fields keep the default */
+static int
+parse_threads (const char *arg)
+{
+    char    *end;
+    long     n;
+    int      i;
+
+    for (i = 0; i < STAGE_COUNT; i++) {
+        if (*arg != ',' && *arg != '\0') {
+            n = strtol (arg, &end, 10);
+            if (end == arg || n < 1 || n > 1024)
+                return -1;
+            stage_threads[i] = (int) n;
+            arg = end;
+        }
+        if (*arg == '\0')
+            return 0;
+        if (*arg++ != ',')
+            return -1;
+    }
+    return -1;
+}
+
+bool
+check_argv (int argc, char *argv[])
+{
+    int    opt;
+
+    if (argc < 2) {
+        goto end;
+    }
+
+    while ( (opt = getopt (argc, argv, ":u:l:w:P:p:Hc:C:nit:T:ks:d:m:j:ae:")) != -1) {
+        switch (opt) {
+            case 'u':
+                url = optarg;
+                break;
+            case 'l':
+                targets_path = optarg;
+                break;
+            case 'w':
+                batch_workers = atoi (optarg);
+                if (batch_workers < 1)
+                    goto end;
+                break;
+            case 'P':
+                host_cap = atoi (optarg);
+                if (host_cap < 1)
+                    goto end;
+                break;
+            case 'p':
+                port = validate_port (atoi (optarg));
+                break;
+            case 'H':
+                probe_head = true;
+                break;
+            case 'c':
+                cache_path = optarg;
+                break;
+            case 'C':
+                cache_mb = strtoul (optarg, NULL, 10);
+                break;
+            case 'n':
+                use_cache = false;
+                break;
+            case 'i':
+                incremental = true;
+                break;
+            case 't':
+                connect_ms = atoi (optarg);
+                break;
+            case 'T':
+                read_ms = atoi (optarg);
+                break;
+            case 'k':
+                insecure = true;
+                break;
+            case 's':
+                if (policy_parse (optarg, &policy) == -1)
+                    goto end;
+                break;
+            case 'd':
+                hedge_pct = atoi (optarg);
+                break;
+            case 'j':
+                if (parse_threads (optarg) == -1)
+                    goto end;
+                break;
+            case 'a':
+                pin_threads = true;
+                break;
+            case 'e':
+                loop_tasks = atoi (optarg);
+                if (loop_tasks < 1)
+                    goto end;
+                break;
+            case 'm':
+                /* we chdir into the output directory later */
+                if (optarg[0] == '/' || getcwd (metrics_path, BUFFER_SIZE / 2) == NULL)
+                    metrics_path[0] = '\0';
+                else
+                    strcat (metrics_path, "/");
+                strncat (metrics_path, optarg, BUFFER_SIZE - strlen (metrics_path) - 1);
+                break;
+            default:
+                goto end;
+        }
+    }
+
+    if (targets_path != NULL && url == NULL) {
+        /* both keep per-target state in the output directory */
+        if (!incremental && !probe_head) {
+            return true;
+        }
+        fprintf (stderr, "-i and -H work on a single -u target\n");
+    } else if (url != NULL && targets_path == NULL && batch_workers == 0) {
+        return true;
+    }
+end:
+    printf("Usage: %s <-u url | -l file [-w n]> [-P n] [-p port] [-H] [-c dir] [-C mb] [-n] [-i] "
+           "[-t ms] [-T ms] [-k] [-s order] [-d pct] [-m file]\n"
+           "       [-j fetch,inflate,write] [-a] [-e max]\n"
+           "  -l  scan every url in file (- for stdin) in one process, "
+           "into <host>_<path>\n"
+           "  -w  spread the -l targets over n worker processes\n"
+           "  -P  objects in flight per host under -l, in each worker "
+           "(default %d)\n"
+           "  -H  probe objects with pipelined HEAD requests before fetching\n"
+           "  -c  object cache directory (default ~/.cache/githack/objects)\n"
+           "  -C  object cache size cap in MB (default %d)\n"
+           "  -n  don't use the object cache\n"
+           "  -i  incremental, only fetch entries changed since the last run\n"
+           "  -t  connect timeout in ms (default %d)\n"
+           "  -T  read timeout in ms (default %d)\n"
+           "  -k  don't verify the server certificate\n"
+           "  -s  fetch order: index (default), interesting or largest\n"
+           "  -d  duplicate object requests slower than p95, at most pct%% "
+           "of requests (default %d, 0 disables)\n"
+           "  -m  write pool and fetch metrics as JSON to file at the end "
+           "and on SIGUSR2\n"
+           "  -j  threads per stage (default %d,<cpus>,%d), empty fields "
+           "keep the default\n"
+           "  -a  pin inflate and write threads to CPUs\n"
+           "  -e  fetch from one event loop thread, at most max objects "
+           "at once, instead of\n      the fetch threads (default %d under -l)\n",
+           argv[0], BATCH_HOST_CAP, CACHE_DEFAULT_MB, HTTP_CONNECT_TIMEOUT_MS,
+           HTTP_READ_TIMEOUT_MS, HEDGE_PCT, FETCH_THREADS, WRITE_THREADS,
+           BATCH_SLOTS);
+    return false;
+}
+
+int
+main (int argc, char *argv[])
+{
+    http_conn_t          *index_conn;
+    http_body_t           index_body;
+    char                  host_name[256];
+    const unsigned char  *rest;
+    int                   keep_alive;
+    char                  index_uri[2048];
+    char                  index_url[BUFFER_SIZE];
+    http_des_t            des;
+    http_res_t           *index_res;
+    pthread_t             metrics_thread;
+    char                 *index_etag, *index_modified;
+    const char           *known;
+    int                   missing;
+
+    if (check_argv (argc, argv) == false)
         exit(-1);
 
+    metrics_start = stats_now_us ();
+    /* workers are forked before any thread starts; numbers exist at the end */
+    if (targets_path != NULL && batch_workers > 0) {
+        signal (SIGUSR2, SIG_IGN);
+        return shard_scan () == 0 ? 0 : 1;
+    }
+
+    /* before any thread starts, so they all inherit SIGUSR2 blocked */
+    sigemptyset (&metrics_signals);
+    sigaddset (&metrics_signals, SIGUSR2);
+    pthread_sigmask (SIG_BLOCK, &metrics_signals, NULL);
+    if (pthread_create (&metrics_thread, NULL, metrics_signal_thread, NULL) == 0)
+        pthread_detach (metrics_thread);
+
+    if (targets_path != NULL) {
+        return batch_scan () == 0 ? 0 : 1;
+    }
+
     parse_http_url (url, &url_combo);
+    https = strcmp (url_combo.protocol, "https://") == 0;
+    /* -p wins over a port in the url, which wins over the scheme's */
+    if (port == 0) {
+        port = https ? 443 : DEFAULT_PORT;
+        dns_split_host (url_combo.host, host_name, sizeof (host_name), &port);
+    }
+    /* resolve while the output and cache directories are set up */
+    dns_split_host (url_combo.host, host_name, sizeof (host_name), NULL);
+    dns_prefetch (host_name);
+    if (https && tls_init (insecure) == -1) {
+        fprintf (stderr, "https needs a build with OpenSSL\n");
+        exit(-1);
+    }
+    /* probe connections may be closed under a pipelined write */
+    signal (SIGPIPE, SIG_IGN);
+    http_set_timeouts (connect_ms, read_ms);
 
-    mk_dir (url_combo.host);
-    assert (chdir (url_combo.host) == 0);
+    if (use_cache && cache_init (cache_path, cache_mb << 20) == -1) {
+        fprintf (stderr, "object cache disabled\n");
+    }
 
-    get_ip_from_host (ip, url_combo.host, 128);
+    /* an incremental re-scan keeps what the last run left behind */
+    if (!incremental || access (url_combo.host, F_OK) != 0) {
+        mk_dir (url_combo.host);
+    }
+    assert (chdir (url_combo.host) == 0);
+    if (incremental) {
+        previous = manifest_load (STATE_MANIFEST);
+    }
 
+    memset (&des, 0, sizeof (des));
     des.host_name = url_combo.host;
     des.host_port = port;
     snprintf (index_uri, 2048, "%s%s", url_combo.uri, "index");
     des.uri = index_uri;
+    des.keep_alive = 1;
+    des.tls = https;
+
+    if (snprintf (index_url, BUFFER_SIZE, "%s%s%sindex", url_combo.protocol,
+                  url_combo.host, url_combo.uri) >= BUFFER_SIZE) {
+        fprintf (stderr, "%s: url is too long\n", url);
+        exit(-1);
+    }
+    if (previous != NULL) {
+        /* polling: a 304 ends the scan after one small request */
+        validators = validators_load (STATE_VALIDATORS);
+        des.header = validator_headers (validator_find (validators, index_url));
+    }
 
-    index_sockfd = http_get (&des);
+    index_conn = http_get (&des);
+    if (index_conn == NULL
+        || http_parse_response_header (index_conn, &index_res) <= 0) {
+        fprintf (stderr, "cannot fetch %s\n", index_url);
+        exit(-1);
+    }
 
-    if (strip_http_header (index_sockfd) != index_sockfd) {
+    if (index_res->status_code == 304 && previous != NULL) {
+        printf ("index not modified since the last scan\n");
+        exit(0);
+    }
+    if (index_res->status_code != 200) {
+        fprintf (stderr, "%s: HTTP %d\n", index_url, index_res->status_code);
         exit(-1);
     }
-    parse_index_object (index_sockfd);
+    /* kept until we know every entry made it */
+    known = http_response_known (index_res, HTTP_HDR_ETAG);
+    index_etag = known != NULL ? strdup (known) : NULL;
+    known = http_response_known (index_res, HTTP_HDR_LAST_MODIFIED);
+    index_modified = known != NULL ? strdup (known) : NULL;
+    http_body_init (&index_body, index_conn, index_res);
+    keep_alive = http_response_keep_alive (index_res);
+    http_destroy_response (index_res);
+    http_destroy_header (des.header);
+
+    curl_pin_host ();
+    if (incremental) {
+        fetch_metadata ();
+    }
 
+    missing = parse_index_object (&index_body);
+    /* or the next -i run gets a 304 and never retries what failed */
+    if (missing > 0)
+        validator_set (&validators, index_url, NULL, NULL);
+    else
+        validator_set (&validators, index_url, index_etag, index_modified);
+    free (index_etag);
+    free (index_modified);
+    /* skip the index extensions so the connection can be pooled */
+    while (http_body_next (&index_body, &rest, (size_t) -1) > 0)
+        ;
+    http_conn_release (index_conn, keep_alive && index_body.done);
+
+    if (incremental && validators_save (STATE_VALIDATORS, validators) == -1) {
+        perror ("save " STATE_VALIDATORS);
+    }
+    validators_free (validators);
+
+    cache_evict ();
+    fetch_report ();
+    if (metrics_path[0] != '\0')
+        metrics_write ();
+    cache_report ();
+    manifest_free (previous);
+    curl_slist_free_all (resolve);
+    http_pool_destroy (http_default_pool ());
+    tls_report ();
 
     return 0;
 }
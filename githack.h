@@ -20,12 +20,23 @@
 #include <fcntl.h>
 #include <assert.h>
 #include <zlib.h>
+#include <curl/curl.h>
 #include <dirent.h>
 #include <errno.h>
 #include <sys/select.h>
 #include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <poll.h>
+#include <sys/resource.h>
 #include "http.h"
 #include "thpool.h"
+#include "sha1.h"
+#include "cache.h"
+#include "policy.h"
+#include "stats.h"
+#include "evloop.h"
+#include "shard.h"
 
 #ifndef bool
 #   define bool           unsigned char
@@ -45,11 +56,29 @@
 #define BLOB_MAX_LEN 100
 #define ESC          "\033"
 #define DEFAULT_PORT 80;
+#define INFLATE_CHUNK 16384
+#define INFLATE_STREAM_MIN (256 * 1024)  /* larger blobs inflate to a file */
+#define FETCH_TRIES  2
+#define PROBE_LANES  4
+#define PROBE_WINDOW 32
+#define PROBE_RETRIES 3
+#define FETCH_THREADS 20
+#define FETCH_QUEUE  256   /* pending fetch jobs before queuing blocks */
+#define STAGE_QUEUE  64    /* objects waiting for inflate or write */
+#define WRITE_THREADS 2
+#define HEDGE_PCT    5     /* duplicate requests, in percent of all requests */
+#define HEDGE_MIN_SAMPLES 20    /* finished fetches before p95 is trusted */
+#define HEDGE_MIN_DELAY_MS 20
+#define HEDGE_COLD_DELAY_MS 1000    /* used until HEDGE_MIN_SAMPLES are in */
+#define BATCH_SLOTS  256   /* objects in flight under -l without -e */
+#define BATCH_HOST_CAP 8   /* of them against one host */
+#define BATCH_INDEX_THREADS 8
 
 typedef struct
 {
     size_t         lenght;
     unsigned char *content;
+    size_t         cap;     /* allocated, collect_data() grows it */
 } body, *body_t;
 
 typedef struct
@@ -108,13 +137,141 @@ typedef struct {
 } __attribute__ ((packed)) entry_body, *entry_body_t;
 
 
+typedef enum
+{
+    BLOB_OK,
+    BLOB_CORRUPT,       /* not zlib, bad "blob <n>" header or wrong length */
+    BLOB_MISMATCH,      /* content does not hash to the index sha1 */
+    BLOB_IO_ERROR
+} blob_status;
+
+/* inflates a loose object as it arrives, hashing "blob <n>\0<content>" */
+typedef struct
+{
+    z_stream        zs;
+    sha1_ctx        sha1;
+    const char     *path;       /* NULL to inflate into data instead */
+    FILE           *file;
+    unsigned char  *data;
+    size_t          filesize;
+    size_t          written;
+    size_t          hdr_len;
+    bool            hdr_done;
+    char            hdr[BLOB_MAX_LEN + 1];
+    int             zret;
+    long            inflate_us;     /* time spent in inflate() and fwrite() */
+    long            write_us;
+} blob_inflater, *blob_inflater_t;
+
+/* second copy of a slow object request, on a connection of its own */
+typedef struct
+{
+    CURL           *curl;
+    body            raw;
+} hedge_fetch, *hedge_fetch_t;
+
+/* objects go through one pool per stage, linked by bounded queues */
+typedef enum
+{
+    STAGE_FETCH,        /* network bound */
+    STAGE_INFLATE,      /* CPU bound */
+    STAGE_WRITE,        /* disk bound */
+    STAGE_COUNT
+} stage_t;
+
+/* where the time of an object fetch goes, one histogram each */
+typedef enum
+{
+    PHASE_TOTAL,
+    PHASE_DNS,
+    PHASE_CONNECT,
+    PHASE_TLS,
+    PHASE_SERVER,       /* request sent to first byte back */
+    PHASE_TRANSFER,     /* first to last byte, inflate and write included */
+    PHASE_INFLATE,
+    PHASE_WRITE,
+    PHASE_COUNT
+} fetch_phase_t;
+
+/* a -l target handed to a worker, which the coordinator may ask back */
+typedef enum
+{
+    TARGET_QUEUED,
+    TARGET_STARTED,
+    TARGET_CANCELLED
+} target_state_t;
+
+struct scan_target;
+
 typedef struct
 {
     entry_body_t entry_body;
     int entry_len;
     char *name;
+    blob_status status;
+    thpool_job fetch;   /* queued without allocating a job per entry */
+    thpool_job stage;   /* the same for the inflate and write stages */
+    body raw;           /* compressed object, from fetch to inflate */
+    unsigned char *data;    /* its content, from inflate to write */
+    char *part;         /* or the file it was inflated to, renamed by write */
+    int fetches;
+    bool cached;        /* raw came from the object cache */
+    evloop_task_t task;     /* the fetch stage under -e, instead of fetch */
+    evloop_timer_t hedge_timer;
+    CURL *curl;
+    hedge_fetch hedge;
+    long started;
+    thpool_job inflate;     /* stage is reused for the write stage meanwhile */
+    struct scan_target *target;     /* under -l, NULL otherwise */
 } ce_body, *ce_body_t;
 
+/* a host of a -l scan; its targets take turns at its share of the slots */
+typedef struct scan_host
+{
+    char                name[BUFFER_SIZE];  /* host:port, with the scheme's port */
+    struct curl_slist  *resolve;        /* its CURLOPT_RESOLVE, once indexed */
+    int                 inflight;
+    bool                ready;          /* in the scheduler's ring */
+    struct scan_target *targets;        /* with entries left to hand out */
+    struct scan_target *targets_tail;
+    struct scan_host   *next;
+    struct scan_host   *next_ready;
+} scan_host, *scan_host_t;
+
+/* one repository of a -l scan */
+typedef struct scan_target
+{
+    char               *url;
+    struct url_combo    url_combo;
+    unsigned short      port;           /* of the index request */
+    bool                https;
+    char                dir[BUFFER_SIZE];   /* output, names are under it */
+    scan_host_t         host;
+    ce_body_t          *entries;
+    int                 ent_num;
+    int                 next_entry;     /* handed out to the loop so far */
+    volatile int        refs;           /* a slot and the pipeline per entry */
+    volatile int        ok;
+    volatile int        failed;
+    volatile int        state;          /* target_state_t */
+    long                started;
+    long                index_us;
+    evloop_task_t       activate;
+    struct scan_target *next;           /* in its host's turn */
+} scan_target, *scan_target_t;
+
+/* one keep-alive connection's share of the HEAD pre-pass */
+typedef struct
+{
+    ce_body_t      *entries;
+    int             first;
+    int             count;
+    unsigned char  *present;    /* shared bitmap, one bit per entry */
+    int             requests;
+    int             absent;
+    size_t          absent_bytes;
+} probe_lane, *probe_lane_t;
+
 int hex2dec (unsigned char *hex, int len);
 
 char* sha12hex (unsigned char *sha1);
@@ -123,15 +280,15 @@ bool signature_check (magic_hdr_t magic_hdr);
 
 bool version_check (magic_hdr_t magic_hdr);
 
-void init_check (int sockfd, magic_hdr_t  magic_hdr);
+bool init_check (http_body_t *body, magic_hdr_t  magic_hdr);
 
 int sed2bed (int value);
 
-void pad_entry (int sockfd, int entry_len);
+int pad_entry (http_body_t *body, int entry_len);
 
-char* get_name (int sockfd, size_t namelen, int *entry_len);
+char* get_name (http_body_t *body, size_t namelen, int *entry_len);
 
-void handle_version3orlater (int sockfd, int *entry_len);
+int handle_version3orlater (http_body_t *body, int *entry_len);
 
 void parse_http_url (char *http_url, struct url_combo *url_combo);
 
@@ -141,26 +298,54 @@ void setblocking(int sockfd);
 
 ssize_t writen(int fd, const void *vptr, size_t n);
 
-void touch_file_et(http_res_t *response, const char *filename, size_t filesize);
+void touch_file_et (http_conn_t *conn, http_res_t *response,
+    const char *filename, size_t filesize, const unsigned char *sha1);
+
+void blob_inflate_init (blob_inflater_t bi, const char *path, size_t filesize);
+
+int blob_inflate_update (blob_inflater_t bi, const unsigned char *data, size_t len);
+
+blob_status blob_inflate_finish (blob_inflater_t bi, const unsigned char *sha1);
+
+void print_blob_status (const char *filename, blob_status status);
 
 int create_dir (const char *sPathName);
 
-void create_all_path_dir(ce_body_t ce_body);
+int create_all_path_dir(ce_body_t ce_body);
 
 void mk_dir (char *path);
 
 int force_rm_dir(const char *path);
 
-void concat_object_url(entry_body_t entry_bd, char *object_url);
+void concat_object_url(struct url_combo *base, entry_body_t entry_bd,
+    char *object_url);
+
+void concat_object_uri(entry_body_t entry_bd, char *object_uri);
 
 bool check_argv(int argc, char *argv[]);
 
 ssize_t readn(int fd, void *vptr, size_t n);
 
-void parse_index_object (int sockfd);
+ce_body_t *read_index (http_body_t *body, const char *dir, int *num);
+
+int parse_index_object (http_body_t *body);
 
-int strip_http_header (int sockfd);
+void free_entry (ce_body_t ce_body);
+
+int strip_http_header (http_conn_t *conn);
 
 void task_func (void *arg);
 
+void inflate_task (void *arg);
+
+void write_task (void *arg);
+
+void probe_task (void *arg);
+
+void fetch_metadata (void);
+
+void *index_task (void *arg);
+
+unsigned char *probe_objects (ce_body_t *entries, int ent_num);
+
 #endif /* GITHACK_H */
@@ -6,43 +6,141 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <strings.h>
+#include <poll.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#include <immintrin.h>
+#define HTTP_HAVE_SSE2 1
+#endif
 
 #include "http.h"
 
-static void __die__ (const char* ret);
-static ssize_t __read_all__ (int fd, void *buf, size_t len);
-static ssize_t __write_all__ (int fd, void *data, size_t len);
-static ssize_t __read_until__ (int fd, int ch, unsigned char **data);
+#define HTTP_USER_AGENT "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 " \
+                        "(KHTML, like Gecko) Chrome/46.0.2490.80 Safari/537.36"
+
+/* first byte of [p, end) equal to a or b, end when there is none */
+typedef const char *(*http_scan_fn) (const char *p, const char *end,
+    int a, int b);
+
+struct http_pool_host
+{
+    http_pool_t            *pool;
+    char                   *scheme;
+    char                   *host;
+    unsigned short          port;
+    char                   *tmpl;       /* rendered Host and User-Agent lines */
+    size_t                  tmpl_len;
+    int                     open;       /* leased plus idle */
+    http_conn_t            *idle;
+    pthread_cond_t          freed;
+    struct http_pool_host  *next;
+};
+
+struct http_pool
+{
+    pthread_mutex_t         lock;
+    int                     per_host;
+    long                    opened;
+    long                    reused;
+    http_pool_host_t       *hosts;
+};
+
+/* http_parse_response's sink state */
+typedef struct {
+    http_res_t     *response;
+    size_t          cap;
+} http_buffer_t;
+
+static ssize_t __conn_recv__ (http_conn_t *conn, void *buf, size_t n);
+static ssize_t __conn_send__ (http_conn_t *conn, const void *buf, size_t n);
+static ssize_t __read_all__ (http_conn_t *conn, void *buf, size_t len);
+static ssize_t __write_all__ (http_conn_t *conn, void *data, size_t len);
+static ssize_t __writev_all__ (http_conn_t *conn, struct iovec *iov,
+    int cnt, int more);
+static int __render_template__ (char *buf, size_t size, const char *host,
+    unsigned short port);
+static int __iov_headers__ (struct iovec *iov, http_hdr_t *header);
+static ssize_t __read_until__ (http_conn_t *conn, int ch, unsigned char **data);
 
 static http_hdr_t *__http_header_find__ (http_hdr_t *header,
     const char *name);
-static ssize_t __http_method__ (int fd, http_des_t *dest,
+static ssize_t __http_method__ (http_conn_t *conn, http_des_t *dest,
     http_met_t method);
+static http_conn_t *__http_send__ (http_des_t *dest, http_met_t method);
 
 static http_met_t __http_string_to_method__ (const char *method, size_t n);
 static const char *__http_method_to_string__ (http_met_t method);
 
-static ssize_t __parse_header__ (int fd, http_hdr_t **header);
+static ssize_t __parse_header__ (http_conn_t *conn, http_hdr_t **header);
 
-void __dynamic_read_socket__ (int fd, http_res_t *response);
+static int __buffer_sink__ (void *ctx, const unsigned char *data,
+    size_t len);
+static int __hexval__ (unsigned char c);
 
 static http_req_t *__http_allocate_request__ (const char *uri);
 static http_res_t *__http_allocate_response__ (const char *status_message);
 static http_hdr_t *__http_alloc_header__ (const char *name,
     const char *value);
 
+static const char *__scan2_generic__ (const char *p, const char *end,
+    int a, int b);
+static void __scan_select__ (void);
+static int __known_header__ (const char *name, size_t len);
+static http_field_t *__overflow_slot__ (http_res_t *response, const char *base,
+    size_t name, size_t name_len);
+
+static http_scan_fn     __scan2__ = __scan2_generic__;
+static pthread_once_t   scan_once = PTHREAD_ONCE_INIT;
+
+static const char *const known_names[HTTP_HDR_KNOWN] = {
+    "Content-Length", "Transfer-Encoding", "Location", "ETag",
+    "Last-Modified", "Connection"
+};
+
+static long __now_ms__ (void);
+static int __happy_eyeballs__ (dns_addrs_t *addrs, int timeout_ms);
+
+static int __conn_stale__ (http_conn_t *conn, long now);
+static void __default_pool_init__ (void);
+
+static http_pool_t     *default_pool = NULL;
+static pthread_once_t   default_pool_once = PTHREAD_ONCE_INIT;
+static int              connect_timeout_ms = HTTP_CONNECT_TIMEOUT_MS;
+static int              read_timeout_ms = HTTP_READ_TIMEOUT_MS;
+
 static void __http_destroy_header__ (http_hdr_t *header);
-static ssize_t __http_write_header__ (int fd, http_hdr_t *header);
 static http_hdr_t *__http_header_find__ (http_hdr_t *header,
     const char *name);
 
 
+/* the transport: the socket itself or TLS on top of it */
+static ssize_t
+__conn_recv__ (http_conn_t *conn, void *buf, size_t n)
+{
+    if (conn->tls != NULL)
+        return tls_read (conn->tls, buf, n);
+    return read (conn->fd, buf, n);
+}
+
+static ssize_t
+__conn_send__ (http_conn_t *conn, const void *buf, size_t n)
+{
+    if (conn->tls != NULL)
+        return tls_write (conn->tls, buf, n);
+    return write (conn->fd, buf, n);
+}
+
 static ssize_t
-__read_all__ (int fd, void *vptr, size_t n)
+__read_all__ (http_conn_t *conn, void *vptr, size_t n)
 {
     char    *ptr;
     size_t   nleft;
@@ -52,7 +150,7 @@ __read_all__ (int fd, void *vptr, size_t n)
     nleft = n;
 
     while (nleft > 0) {
-        if ( (nread = read (fd, ptr, nleft)) < 0) {
+        if ( (nread = __conn_recv__ (conn, ptr, nleft)) < 0) {
             if (errno == EINTR) {
                 printf("nonblocking\n");
                 nread = 0; /*and call read() again*/
@@ -68,7 +166,7 @@ __read_all__ (int fd, void *vptr, size_t n)
 }
 
 static ssize_t
-__write_all__ (int fd, void *vptr, size_t n)
+__write_all__ (http_conn_t *conn, void *vptr, size_t n)
 {
     size_t         nleft;
     ssize_t        nwritten;
@@ -77,7 +175,7 @@ __write_all__ (int fd, void *vptr, size_t n)
     ptr = vptr;
     nleft = n;
     while (nleft > 0) {
-        if ( (nwritten = write (fd, ptr, nleft)) <= 0) {
+        if ( (nwritten = __conn_send__ (conn, ptr, nleft)) <= 0) {
             if (nwritten < 0 && errno == EINTR)
                 nwritten = 0; /*and call write() again*/
             else
@@ -90,232 +188,803 @@ __write_all__ (int fd, void *vptr, size_t n)
     return n;
 }
 
+/*
+ * Write out iov in full, as one sendmsg when the socket takes it. more
+ * tells the kernel another request follows at once (MSG_MORE), so a
+ * pipelined run of small requests leaves in full segments. TLS gets the
+ * pieces glued together, one record rather than one per piece.
+ */
 static ssize_t
-__http_method__ (int fd, http_des_t *dest, http_met_t method)
+__writev_all__ (http_conn_t *conn, struct iovec *iov, int cnt, int more)
 {
+    struct msghdr  msg;
+    size_t         total = 0, off;
     ssize_t        n;
-    char           str[1024];
-    http_req_t    *request;
+    char          *flat;
+    int            i;
 
-    request = http_create_request (method, dest->uri, 1, 1);
-    if (request == NULL)
-        return -1;
+    for (i = 0; i < cnt; i++)
+        total += iov[i].iov_len;
 
-    sprintf (str, "%s:%d", dest->host_name, dest->host_port);
-    http_add_header (&request->header, "Host", str);
-    http_add_header (&request->header,
-                     "User-Agent",
-                     "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 \
-                     (KHTML, like Gecko) Chrome/46.0.2490.80 Safari/537.36");
-    http_add_header (&request->header, "Connection", "close");
-    if (dest->content_len > 0 && dest->content != NULL) {
-        sprintf (str, "%ld", dest->content_len);
-        http_add_header (&request->header,
-                         "Content-Type",
-                         "application/x-www-form-urlencoded");
-        http_add_header (&request->header, "Content-Length", str);
+    if (conn->tls != NULL) {
+        if ((flat = malloc (total)) == NULL)
+            return -1;
+        for (i = 0, off = 0; i < cnt; off += iov[i++].iov_len)
+            memcpy (flat + off, iov[i].iov_base, iov[i].iov_len);
+        n = __write_all__ (conn, flat, total);
+        free (flat);
+        return n;
+    }
+
+    memset (&msg, 0, sizeof (msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = cnt;
+    off = total;
+    while (msg.msg_iovlen > 0) {
+        n = sendmsg (conn->fd, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        off -= n;
+        /* a short write, skip what went out and send the rest */
+        while (msg.msg_iovlen > 0 && (size_t) n >= msg.msg_iov->iov_len) {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+    return total - off;
+}
+
+/*
+ * The part of every request that only depends on the host. Returns what
+ * is in buf, even when a long host name cut it short.
+ */
+static int
+__render_template__ (char *buf, size_t size, const char *host,
+    unsigned short port)
+{
+    int     n;
+
+    n = snprintf (buf, size, "Host: %s:%d\r\nUser-Agent: "
+                  HTTP_USER_AGENT "\r\n", host, port);
+    if (n < 0)
+        return 0;
+    return (size_t) n < size ? n : (int) size - 1;
+}
+
+/* "name: value\r\n" of each header, four entries apiece */
+static int
+__iov_headers__ (struct iovec *iov, http_hdr_t *header)
+{
+    int     cnt = 0;
+
+    for (; header != NULL; header = header->next) {
+        iov[cnt].iov_base = (void *) header->name;
+        iov[cnt++].iov_len = strlen (header->name);
+        iov[cnt].iov_base = ": ";
+        iov[cnt++].iov_len = 2;
+        iov[cnt].iov_base = (void *) header->value;
+        iov[cnt++].iov_len = strlen (header->value);
+        iov[cnt].iov_base = "\r\n";
+        iov[cnt++].iov_len = 2;
+    }
+    return cnt;
+}
+
+/*
+ * Render and write the request in one go. The Host and User-Agent lines
+ * come from the connection's pool slot, rendered once per host; only
+ * the request line, Connection and dest's own headers are per request.
+ */
+static ssize_t
+__http_method__ (http_conn_t *conn, http_des_t *dest, http_met_t method)
+{
+    http_pool_host_t  *h = conn->slot;
+    http_hdr_t        *extra;
+    char               tmpl[1024], length[48];
+    int                cnt = 0, nextra = 0, len;
+    ssize_t            n;
+
+    for (extra = dest->header; extra != NULL; extra = extra->next)
+        nextra++;
+
+    struct iovec       iov[10 + 4 * nextra];
+
+    iov[cnt].iov_base = (void *) __http_method_to_string__ (method);
+    iov[cnt].iov_len = strlen (iov[cnt].iov_base);
+    cnt++;
+    iov[cnt].iov_base = " ";
+    iov[cnt++].iov_len = 1;
+    iov[cnt].iov_base = (void *) dest->uri;
+    iov[cnt++].iov_len = strlen (dest->uri);
+    iov[cnt].iov_base = " HTTP/1.1\r\n";
+    iov[cnt++].iov_len = 11;
+
+    if (h != NULL && h->port == dest->host_port
+        && strcmp (h->host, dest->host_name) == 0) {
+        iov[cnt].iov_base = h->tmpl;
+        iov[cnt++].iov_len = h->tmpl_len;
+    } else {
+        iov[cnt].iov_base = tmpl;
+        iov[cnt++].iov_len = __render_template__ (tmpl, sizeof (tmpl),
+                                                  dest->host_name,
+                                                  dest->host_port);
+    }
 
-        request->content_len = dest->content_len;
-        request->content = dest->content;
+    if (dest->keep_alive) {
+        iov[cnt].iov_base = "Connection: keep-alive\r\n";
+        iov[cnt++].iov_len = 24;
+    } else {
+        iov[cnt].iov_base = "Connection: close\r\n";
+        iov[cnt++].iov_len = 19;
+    }
+
+    cnt += __iov_headers__ (iov + cnt, dest->header);
+
+    if (dest->content_len > 0 && dest->content != NULL) {
+        iov[cnt].iov_base = "Content-Type: application/x-www-form-urlencoded\r\n";
+        iov[cnt].iov_len = strlen (iov[cnt].iov_base);
+        cnt++;
+        len = snprintf (length, sizeof (length), "Content-Length: %ld\r\n",
+                        dest->content_len);
+        iov[cnt].iov_base = length;
+        iov[cnt++].iov_len = len < (int) sizeof (length) ? len : sizeof (length) - 1;
     }
 
-    n = http_write_request (fd, request);
-    http_destroy_request (request);
+    iov[cnt].iov_base = "\r\n";
+    iov[cnt++].iov_len = 2;
+
+    if (dest->content_len > 0 && dest->content != NULL) {
+        iov[cnt].iov_base = dest->content;
+        iov[cnt++].iov_len = dest->content_len;
+    }
 
+    n = __writev_all__ (conn, iov, cnt, dest->more);
+    if (n == -1)
+        printf ("http_request: write error: %s\n", strerror (errno));
     return n;
 }
 
+/* send a request on an already connected socket, e.g. to pipeline */
 ssize_t
-http_get (http_des_t *dest)
+http_request (http_conn_t *conn, http_des_t *dest, http_met_t method)
 {
-    int  fd;
-
-    validate_port (dest->host_port);
-
-    fd = connect_to_server (dest->host_name, dest->host_port);
-    if (fd > 0) {
-        /*http get don't have content,so init it NULL'*/
+    if (method == HTTP_GET || method == HTTP_HEAD) {
         dest->content_len = 0;
         dest->content = NULL;
+    }
 
-        if (__http_method__ (fd, dest, HTTP_GET) > 0)
-            return fd;
-        else
-            return -1;
-    } else
-        return fd;
+    return __http_method__ (conn, dest, method);
 }
 
-ssize_t
-http_put (http_des_t *dest)
+/*
+ * Lease a connection to dest and write the request. A pooled connection
+ * the server closed in the meantime fails the write; that one gets one
+ * more try on a fresh connection.
+ */
+static http_conn_t *
+__http_send__ (http_des_t *dest, http_met_t method)
 {
-    int  fd;
+    http_conn_t  *conn;
+    int           tries;
 
     validate_port (dest->host_port);
 
-    fd = connect_to_server (dest->host_name, dest->host_port);
-    if (fd > 0) {
-        if (__http_method__ (fd, dest, HTTP_PUT) > 0)
-            return fd;
-        else
-            return -1;
-    } else
-        return 1;
+    for (tries = 0; tries < 2; tries++) {
+        conn = http_pool_lease (http_default_pool (),
+                                dest->tls ? "https" : "http",
+                                dest->host_name, dest->host_port);
+        if (conn == NULL)
+            return NULL;
+        if (__http_method__ (conn, dest, method) > 0)
+            return conn;
+        tries += !conn->reused;
+        http_conn_close (conn);
+    }
+    return NULL;
 }
 
-ssize_t
-http_post (http_des_t *dest)
+http_conn_t *
+http_get (http_des_t *dest)
 {
-    int  fd;
+    /*http get don't have content,so init it NULL'*/
+    dest->content_len = 0;
+    dest->content = NULL;
 
-    validate_port (dest->host_port);
+    return __http_send__ (dest, HTTP_GET);
+}
 
-    fd = connect_to_server (dest->host_name, dest->host_port);
-    if (fd > 0) {
-        if (__http_method__ (fd, dest, HTTP_POST) > 0)
-            return fd;
-        else
-            return -1;
-    } else
-        return -1;
+http_conn_t *
+http_put (http_des_t *dest)
+{
+    return __http_send__ (dest, HTTP_PUT);
 }
 
-ssize_t
+http_conn_t *
+http_post (http_des_t *dest)
+{
+    return __http_send__ (dest, HTTP_POST);
+}
+
+http_conn_t *
 http_trace (http_des_t *dest)
 {
-    int  fd;
+    return __http_send__ (dest, HTTP_TRACE);
+}
 
-    validate_port(dest->host_port);
+http_conn_t *
+http_delete (http_des_t *dest)
+{
+    /*http delete method don't have body,so init it NULL'*/
+    dest->content_len = 0;
+    dest->content = NULL;
 
-    fd = connect_to_server (dest->host_name, dest->host_port);
-    if (fd > 0) {
-        if (__http_method__ (fd, dest, HTTP_TRACE) > 0)
-            return fd;
-        else
-            return -1;
-    } else
-        return -1;
+    return __http_send__ (dest, HTTP_DELETE);
 }
 
-ssize_t
-http_delete (http_des_t *dest)
+http_conn_t *
+http_options (http_des_t *dest)
 {
-    int  fd;
+    /*http options method don't have body,so init it NULL'*/
+    dest->content_len = 0;
+    dest->content = NULL;
 
-    validate_port(dest->host_port);
+    return __http_send__ (dest, HTTP_OPTIONS);
+}
 
-    fd = connect_to_server (dest->host_name, dest->host_port);
-    if (fd > 0) {
-        /*http delete method don't have body,so init it NULL'*/
-        dest->content_len = 0;
-        dest->content = NULL;
+http_conn_t *
+http_head (http_des_t *dest)
+{
+    /*http head method don't have body,so init it NULL'*/
+    dest->content_len = 0;
+    dest->content = NULL;
 
-        if (__http_method__ (fd, dest, HTTP_DELETE) > 0)
-            return fd;
-        else
-            return -1;
-    } else
-        return -1;
+    return __http_send__ (dest, HTTP_HEAD);
 }
 
-ssize_t
-http_options (http_des_t *dest)
+/* a zero or negative value keeps the current one */
+void
+http_set_timeouts (int connect_ms, int read_ms)
 {
-    int  fd;
+    if (connect_ms > 0)
+        connect_timeout_ms = connect_ms;
+    if (read_ms > 0)
+        read_timeout_ms = read_ms;
+}
 
-    validate_port(dest->host_port);
+static long
+__now_ms__ (void)
+{
+    struct timespec ts;
 
-    fd = connect_to_server (dest->host_name, dest->host_port);
-    if (fd > 0) {
-        /*http options method don't have body,so init it NULL'*/
-        dest->content_len = 0;
-        dest->content = NULL;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
 
-        if (__http_method__ (fd, dest, HTTP_OPTIONS) > 0)
-            return fd;
-        else
-            return -1;
-    } else
-        return -1;
+/*
+ * Race non-blocking connects over the resolved addresses, alternating
+ * address families, starting one more attempt every
+ * HTTP_EYEBALLS_DELAY_MS or as soon as one fails (RFC 8305). Returns the
+ * first socket to connect, -1 when none did before the deadline.
+ */
+static int
+__happy_eyeballs__ (dns_addrs_t *addrs, int timeout_ms)
+{
+    dns_addr_t         *order[DNS_MAX_ADDRS], *a;
+    struct pollfd       pfd[DNS_MAX_ADDRS];
+    int                 naddr = 0, nfd = 0, next = 0;
+    int                 fd = -1, s, i, j, k, n, err;
+    long                now, deadline, next_start;
+    socklen_t           len;
+
+    /* first family, then the other one, interleaved */
+    for (i = 0, j = 0; naddr < addrs->count; ) {
+        for (; i < addrs->count
+               && addrs->addr[i].family != addrs->addr[0].family; i++)
+            ;
+        if (i < addrs->count)
+            order[naddr++] = &addrs->addr[i++];
+        for (; j < addrs->count
+               && addrs->addr[j].family == addrs->addr[0].family; j++)
+            ;
+        if (j < addrs->count)
+            order[naddr++] = &addrs->addr[j++];
+    }
+
+    now = __now_ms__ ();
+    deadline = now + timeout_ms;
+    next_start = now;
+
+    while (fd < 0 && (now = __now_ms__ ()) < deadline) {
+        if (next < naddr && (now >= next_start || nfd == 0)) {
+            a = order[next++];
+            s = socket (a->family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+            if (s < 0)
+                continue;
+            if (connect (s, (struct sockaddr *) &a->addr, a->len) == 0) {
+                fd = s;
+                break;
+            }
+            if (errno != EINPROGRESS) {
+                close (s);
+                continue;
+            }
+            pfd[nfd].fd = s;
+            pfd[nfd].events = POLLOUT;
+            nfd++;
+            next_start = now + HTTP_EYEBALLS_DELAY_MS;
+            continue;
+        }
+        if (nfd == 0)
+            break;
+
+        n = deadline - now;
+        if (next < naddr && next_start - now < n)
+            n = next_start - now;
+        if ((n = poll (pfd, nfd, n)) < 0 && errno != EINTR)
+            break;
+
+        for (k = 0; k < nfd && n > 0; k++) {
+            if (pfd[k].revents == 0)
+                continue;
+            len = sizeof (err);
+            if (getsockopt (pfd[k].fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0
+                && err == 0) {
+                fd = pfd[k].fd;
+            } else {
+                close (pfd[k].fd);
+                /* a refused attempt hands over at once */
+                next_start = now;
+            }
+            pfd[k--] = pfd[--nfd];
+            if (fd >= 0)
+                break;
+        }
+    }
+
+    for (k = 0; k < nfd; k++)
+        close (pfd[k].fd);
+    return fd;
 }
 
-ssize_t
-http_head (http_des_t *dest)
+int
+connect_to_server (const char *host, unsigned short port) {
+    int                 sockfd;
+    dns_addrs_t         addrs;
+    struct timeval      tv;
+    char                name[256];
+    int                 err, one = 1;
+
+    /* the Host header may carry a port, the lookup mustn't */
+    dns_split_host (host, name, sizeof (name), NULL);
+    if ((err = dns_resolve (name, port, &addrs)) != 0) {
+        fprintf (stderr, "%s: %s\n", name, gai_strerror (err));
+        return -2;
+    }
+    if ((sockfd = __happy_eyeballs__ (&addrs, connect_timeout_ms)) < 0)
+        return -2;
+
+    /* blocking again, but no read or write waits past the deadline */
+    fcntl (sockfd, F_SETFL, fcntl (sockfd, F_GETFL) & ~O_NONBLOCK);
+    tv.tv_sec = read_timeout_ms / 1000;
+    tv.tv_usec = (read_timeout_ms % 1000) * 1000;
+    setsockopt (sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+    setsockopt (sockfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+    /* requests go out in several writes, Nagle would hold back all but
+       the first on a reused connection until the peer's delayed ACK */
+    setsockopt (sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+
+    return sockfd;
+}
+
+http_conn_t *
+http_conn_new (int fd)
 {
-    int  fd;
+    http_conn_t  *conn;
 
-    validate_port(dest->host_port);
+    conn = malloc (sizeof (http_conn_t));
+    if (conn == NULL)
+        return NULL;
 
-    fd = connect_to_server (dest->host_name, dest->host_port);
-    if (fd > 0) {
-        /*http head method don't have body,so init it NULL'*/
-        dest->content_len = 0;
-        dest->content = NULL;
+    conn->buf = malloc (HTTP_CONN_BUFSIZE);
+    if (conn->buf == NULL) {
+        free (conn);
+        return NULL;
+    }
+    conn->fd = fd;
+    conn->tls = NULL;
+    conn->size = HTTP_CONN_BUFSIZE;
+    conn->start = 0;
+    conn->end = 0;
+    conn->slot = NULL;
+    conn->reused = 0;
+    conn->idle_since = 0;
+    conn->next = NULL;
+
+    return conn;
+}
 
-        if (__http_method__ (fd, dest, HTTP_HEAD) > 0)
-            return fd;
-        else
-            return -1;
-    } else
-        return -1;
+/* a plain http connection out of the default pool */
+http_conn_t *
+http_connect (const char *host, unsigned short port)
+{
+    return http_pool_lease (http_default_pool (), "http", host, port);
+}
+
+void
+http_conn_close (http_conn_t *conn)
+{
+    http_pool_host_t    *h;
+
+    if (conn == NULL)
+        return;
+    if ((h = conn->slot) != NULL) {
+        pthread_mutex_lock (&h->pool->lock);
+        h->open--;
+        pthread_cond_signal (&h->freed);
+        pthread_mutex_unlock (&h->pool->lock);
+    }
+    tls_close (conn->tls);
+    if (conn->fd >= 0)
+        close (conn->fd);
+    free (conn->buf);
+    free (conn);
+}
+
+/*
+ * Give conn back after a complete response. It's kept for the next
+ * lease when reusable says the server keeps it open, closed otherwise.
+ */
+void
+http_conn_release (http_conn_t *conn, int reusable)
+{
+    http_pool_host_t    *h;
+
+    if (conn == NULL)
+        return;
+    /* bytes nobody asked for mean we lost track of the framing */
+    if (!reusable || conn->slot == NULL || conn->start != conn->end) {
+        http_conn_close (conn);
+        return;
+    }
+
+    h = conn->slot;
+    pthread_mutex_lock (&h->pool->lock);
+    conn->idle_since = __now_ms__ ();
+    conn->reused = 1;
+    conn->next = h->idle;
+    h->idle = conn;
+    pthread_cond_signal (&h->freed);
+    pthread_mutex_unlock (&h->pool->lock);
+}
+
+http_pool_t *
+http_pool_new (int per_host)
+{
+    http_pool_t  *pool;
+
+    pool = calloc (1, sizeof (http_pool_t));
+    if (pool == NULL)
+        return NULL;
+    pthread_mutex_init (&pool->lock, NULL);
+    pool->per_host = per_host > 0 ? per_host : HTTP_POOL_PER_HOST;
+    return pool;
 }
 
 static void
-__die__ (const char* ret)
+__default_pool_init__ (void)
 {
-    fprintf(stderr, "%s\n", ret);
-    exit(-1);
+    default_pool = http_pool_new (HTTP_POOL_PER_HOST);
 }
 
-int
-get_ip_from_host (char *ipbuf, const char *host, int maxlen)
+http_pool_t *
+http_default_pool (void)
+{
+    pthread_once (&default_pool_once, __default_pool_init__);
+    return default_pool;
+}
+
+/* whether an idle connection can't carry another request */
+static int
+__conn_stale__ (http_conn_t *conn, long now)
+{
+    struct pollfd   pfd;
+    char            ch;
+
+    if (now - conn->idle_since > HTTP_POOL_IDLE_MS)
+        return 1;
+    if (conn->tls != NULL && tls_pending (conn->tls))
+        return 1;
+    /* readable while idle is either EOF or garbage, both unusable */
+    pfd.fd = conn->fd;
+    pfd.events = POLLIN;
+    if (poll (&pfd, 1, 0) == 0)
+        return 0;
+    /* except TLS records, a late session ticket is harmless */
+    return conn->tls == NULL
+           || recv (conn->fd, &ch, 1, MSG_PEEK | MSG_DONTWAIT) <= 0;
+}
+
+/*
+ * An idle connection to (scheme, host, port) when a live one is left,
+ * else a new one. Blocks while per_host connections to it are open.
+ */
+http_conn_t *
+http_pool_lease (http_pool_t *pool, const char *scheme, const char *host,
+    unsigned short port)
 {
-    struct sockaddr_in  sa;
-    struct hostent     *he;
+    http_pool_host_t    *h;
+    http_conn_t         *conn, *stale = NULL;
+    char                 name[256];
+    int                  fd;
+
+    pthread_mutex_lock (&pool->lock);
+    for (h = pool->hosts; h != NULL; h = h->next) {
+        if (h->port == port && strcmp (h->host, host) == 0
+            && strcmp (h->scheme, scheme) == 0)
+            break;
+    }
+    if (h == NULL) {
+        h = calloc (1, sizeof (http_pool_host_t));
+        if (h == NULL) {
+            pthread_mutex_unlock (&pool->lock);
+            return NULL;
+        }
+        h->pool = pool;
+        h->scheme = strdup (scheme);
+        h->host = strdup (host);
+        h->port = port;
+        h->tmpl = malloc (1024);
+        h->tmpl_len = __render_template__ (h->tmpl, 1024, host, port);
+        pthread_cond_init (&h->freed, NULL);
+        h->next = pool->hosts;
+        pool->hosts = h;
+    }
 
-    sa.sin_family = AF_INET;
-    if (inet_aton (host, &sa.sin_addr) == 0) {
-        he = gethostbyname (host);
-        if (he == NULL)
-            __die__("gethostbyname error.");
-        memcpy (&sa.sin_addr, he->h_addr, sizeof(struct in_addr));
+    for (;;) {
+        while ((conn = h->idle) != NULL) {
+            h->idle = conn->next;
+            if (!__conn_stale__ (conn, __now_ms__ ())) {
+                pool->reused++;
+                pthread_mutex_unlock (&pool->lock);
+                return conn;
+            }
+            h->open--;
+            conn->slot = NULL;
+            conn->next = stale;
+            stale = conn;
+        }
+        if (h->open < pool->per_host)
+            break;
+        pthread_cond_wait (&h->freed, &pool->lock);
     }
-    strncpy (ipbuf, inet_ntoa(sa.sin_addr), maxlen);
+    h->open++;
+    pool->opened++;
+    pthread_mutex_unlock (&pool->lock);
 
-    return 0;
+    for (; stale != NULL; stale = conn) {
+        conn = stale->next;
+        http_conn_close (stale);
+    }
+
+    conn = NULL;
+    if ((fd = connect_to_server (host, port)) >= 0
+        && (conn = http_conn_new (fd)) != NULL
+        && strcmp (scheme, "https") == 0) {
+        dns_split_host (host, name, sizeof (name), NULL);
+        if ((conn->tls = tls_connect (fd, name, port)) == NULL) {
+            http_conn_close (conn);
+            conn = NULL;
+            fd = -1;
+        }
+    }
+    if (conn == NULL) {
+        if (fd >= 0)
+            close (fd);
+        pthread_mutex_lock (&pool->lock);
+        h->open--;
+        pthread_cond_signal (&h->freed);
+        pthread_mutex_unlock (&pool->lock);
+        return NULL;
+    }
+    conn->slot = h;
+    return conn;
 }
 
-int
-connect_to_server (const char *host, unsigned short port) {
-    int                 sockfd;
-    struct sockaddr_in  address;
-    int                 conn_ret;
-    char                ipBuf[128] = {0};
-    int                 i = 2;
+void
+http_pool_stats (http_pool_t *pool, long *opened, long *reused)
+{
+    pthread_mutex_lock (&pool->lock);
+    *opened = pool->opened;
+    *reused = pool->reused;
+    pthread_mutex_unlock (&pool->lock);
+}
+
+/* every leased connection must have been closed or released before */
+void
+http_pool_destroy (http_pool_t *pool)
+{
+    http_pool_host_t    *h, *hnext;
+    http_conn_t         *conn, *next;
+
+    if (pool == NULL)
+        return;
+    for (h = pool->hosts; h != NULL; h = hnext) {
+        hnext = h->next;
+        for (conn = h->idle; conn != NULL; conn = next) {
+            next = conn->next;
+            conn->slot = NULL;
+            http_conn_close (conn);
+        }
+        pthread_cond_destroy (&h->freed);
+        free (h->scheme);
+        free (h->host);
+        free (h->tmpl);
+        free (h);
+    }
+    pthread_mutex_destroy (&pool->lock);
+    if (pool == default_pool)
+        default_pool = NULL;
+    free (pool);
+}
+
+/*
+ * Read whatever the socket has into the free tail of the buffer, moving
+ * the unconsumed bytes to the front first when the tail is full.
+ * Returns the bytes read, 0 on EOF and -1 on error.
+ */
+ssize_t
+http_conn_fill (http_conn_t *conn)
+{
+    ssize_t  n;
+
+    if (conn->start == conn->end) {
+        conn->start = conn->end = 0;
+    } else if (conn->end == conn->size && conn->start > 0) {
+        memmove (conn->buf, conn->buf + conn->start, conn->end - conn->start);
+        conn->end -= conn->start;
+        conn->start = 0;
+    }
+    if (conn->end == conn->size)
+        return -1;
 
     do {
-        if ((sockfd = socket (AF_INET, SOCK_STREAM, 0)) > 0)
+        n = __conn_recv__ (conn, conn->buf + conn->end, conn->size - conn->end);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0)
+        conn->end += n;
+    return n;
+}
+
+/*
+ * Make at least n bytes available without consuming them. Returns fewer
+ * than n only when the peer closed the connection first.
+ */
+ssize_t
+http_conn_peek (http_conn_t *conn, size_t n, const unsigned char **data)
+{
+    unsigned char  *buf;
+    ssize_t         m;
+
+    if (n > conn->size) {
+        buf = realloc (conn->buf, n);
+        if (buf == NULL)
+            return -1;
+        conn->buf = buf;
+        conn->size = n;
+    }
+    if (conn->start + n > conn->size) {
+        memmove (conn->buf, conn->buf + conn->start, conn->end - conn->start);
+        conn->end -= conn->start;
+        conn->start = 0;
+    }
+
+    while (conn->end - conn->start < n) {
+        if ((m = http_conn_fill (conn)) < 0)
+            return -1;
+        if (m == 0)
             break;
-    } while (i--);
-    i = 2;
+    }
 
-    address.sin_family = AF_INET;
-    if (ip[0] != '\0') {
-        address.sin_addr.s_addr = inet_addr(ip);
-    } else {
-        if (get_ip_from_host (ipBuf, host, 128) != 0) {
-             __die__("unknown error.");
+    *data = conn->buf + conn->start;
+    return conn->end - conn->start < n ? conn->end - conn->start : n;
+}
+
+void
+http_conn_consume (http_conn_t *conn, size_t n)
+{
+    if (n > conn->end - conn->start)
+        n = conn->end - conn->start;
+    conn->start += n;
+    if (conn->start == conn->end)
+        conn->start = conn->end = 0;
+}
+
+/*
+ * Like read(2) looped until n bytes or EOF, serving buffered bytes first.
+ * Large remainders go straight from the socket into buf.
+ */
+ssize_t
+http_conn_read (http_conn_t *conn, void *buf, size_t n)
+{
+    unsigned char  *ptr = buf;
+    size_t          avail, got = 0;
+    ssize_t         m;
+
+    avail = conn->end - conn->start;
+    if (avail > 0) {
+        got = avail < n ? avail : n;
+        memcpy (ptr, conn->buf + conn->start, got);
+        http_conn_consume (conn, got);
+    }
+
+    while (got < n) {
+        if (n - got >= conn->size) {
+            m = __read_all__ (conn, ptr + got, n - got);
+            if (m < 0)
+                return got > 0 ? (ssize_t) got : -1;
+            got += m;
+            break;
         }
-        address.sin_addr.s_addr = inet_addr(ipBuf);
+        if ((m = http_conn_fill (conn)) < 0)
+            return got > 0 ? (ssize_t) got : -1;
+        if (m == 0)
+            break;
+        avail = conn->end - conn->start;
+        m = avail < n - got ? avail : n - got;
+        memcpy (ptr + got, conn->buf + conn->start, m);
+        http_conn_consume (conn, m);
+        got += m;
     }
-    address.sin_port = htons(port);
 
-    do {
-        conn_ret = connect (sockfd, (struct sockaddr *)&address, sizeof(address));
-        if (conn_ret == 0) return sockfd;
-    } while (i--);
+    return got;
+}
 
-    return -2;
+/*
+ * Find ch in the stream and point line at the bytes up to and including
+ * it, inside the buffer. Nothing is consumed; the line stays valid until
+ * the next call on conn. Lines longer than HTTP_LINE_MAX are an error.
+ */
+ssize_t
+http_conn_read_until (http_conn_t *conn, int ch, const unsigned char **line)
+{
+    unsigned char  *p, *buf;
+    size_t          scanned = 0;
+    ssize_t         m;
+
+    *line = NULL;
+
+    for (;;) {
+        p = memchr (conn->buf + conn->start + scanned, ch,
+                    conn->end - conn->start - scanned);
+        if (p != NULL) {
+            *line = conn->buf + conn->start;
+            return p - *line + 1;
+        }
+        scanned = conn->end - conn->start;
+
+        /* a full buffer holding one unfinished line has to grow */
+        if (conn->end == conn->size && conn->start == 0) {
+            if (conn->size >= HTTP_LINE_MAX) {
+                errno = EMSGSIZE;
+                return -1;
+            }
+            buf = realloc (conn->buf, conn->size * 2);
+            if (buf == NULL)
+                return -1;
+            conn->buf = buf;
+            conn->size *= 2;
+        }
+        if ((m = http_conn_fill (conn)) <= 0)
+            return m;
+    }
 }
 
 int
@@ -422,35 +1091,15 @@ __http_method_to_string__ (http_met_t method)
 }
 
 static ssize_t
-__read_until__ (int fd, int ch, unsigned char **data)
+__read_until__ (http_conn_t *conn, int ch, unsigned char **data)
 {
-    unsigned char *buf, *buf2;
-    ssize_t        n, len, buf_size;
+    const unsigned char *line;
+    ssize_t              n;
 
     *data = NULL;
 
-    buf_size = 100;
-    buf = malloc (buf_size);
-    if (buf == NULL) {
-        return -1;
-    }
-
-    len = 0;
-    while ((n = __read_all__ (fd, buf + len, 1)) == 1) {
-        if (buf[len++] == ch)
-            break;
-        if (len + 1 == buf_size) {
-            buf_size *= 2;
-            buf2 = realloc (buf, buf_size);
-            if (buf2 == NULL) {
-                free (buf);
-                return -1;
-            }
-            buf = buf2;
-        }
-    }
+    n = http_conn_read_until (conn, ch, &line);
     if (n <= 0) {
-        free (buf);
         if (n == 0)
             printf ("read_until: closed\n");
         else
@@ -458,15 +1107,14 @@ __read_until__ (int fd, int ch, unsigned char **data)
         return n;
     }
 
-    /* Shrink to minimum size + 1 in case someone wants to add a NUL. */
-    buf2 = realloc (buf, len + 1);
-    if (buf2 == NULL)
-        printf ("read_until: realloc: shrink failed\n"); /* not fatal */
-    else
-        buf = buf2;
+    /* one spare byte in case someone wants to add a NUL */
+    *data = malloc (n + 1);
+    if (*data == NULL)
+        return -1;
+    memcpy (*data, line, n);
+    http_conn_consume (conn, n);
 
-    *data = buf;
-    return len;
+    return n;
 }
 
 static http_hdr_t *
@@ -514,9 +1162,9 @@ http_add_header (http_hdr_t **header, const char *name,
 }
 
 static ssize_t
-__parse_header__ (int fd, http_hdr_t **header)
+__parse_header__ (http_conn_t *conn, http_hdr_t **header)
 {
-    ssize_t        n;
+    ssize_t        n, i;
     http_hdr_t    *h;
     size_t         len;
     unsigned char *data;
@@ -524,7 +1172,7 @@ __parse_header__ (int fd, http_hdr_t **header)
 
     *header = NULL;
 
-    n = __read_all__ (fd, buf, 2);
+    n = http_conn_read (conn, buf, 2);
     if (n <= 0)
         return n;
     if (buf[0] == '\r' && buf[1] == '\n')
@@ -540,7 +1188,7 @@ __parse_header__ (int fd, http_hdr_t **header)
     h->name = NULL;
     h->value = NULL;
 
-    n = __read_until__ (fd, ':', &data);
+    n = __read_until__ (conn, ':', &data);
     if (n <= 0)
         return n;
     data = realloc (data, n + 2);
@@ -556,14 +1204,18 @@ __parse_header__ (int fd, http_hdr_t **header)
     h->name = data;
     len = n;
 
-    n = __read_until__ (fd, '\r', &data);
+    n = __read_until__ (conn, '\r', &data);
     if (n <= 0)
         return n;
     data[n - 1] = 0;
+    /* drop the optional whitespace after the colon */
+    for (i = 0; data[i] == ' ' || data[i] == '\t'; i++)
+        ;
+    memmove (data, data + i, n - i);
     h->value = data;
     len += n;
 
-    n = __read_until__ (fd, '\n', &data);
+    n = __read_until__ (conn, '\n', &data);
     if (n <= 0)
         return n;
     free (data);
@@ -574,7 +1226,7 @@ __parse_header__ (int fd, http_hdr_t **header)
     len += n;
 
 
-    n = __parse_header__ (fd, &h->next);
+    n = __parse_header__ (conn, &h->next);
     if (n <= 0)
         return n;
     len += n;
@@ -582,42 +1234,6 @@ __parse_header__ (int fd, http_hdr_t **header)
     return len;
 }
 
-static ssize_t
-__http_write_header__ (int fd, http_hdr_t *header)
-{
-    ssize_t  n = 0, m;
-
-    if (header == NULL)
-        return __write_all__ (fd, "\r\n", 2);
-
-    m = __write_all__ (fd, (void *)header->name, strlen (header->name));
-    if (m == -1)
-        return -1;
-    n += m;
-
-    m = __write_all__ (fd, ": ", 2);
-    if (m == -1)
-        return -1;
-    n += m;
-
-    m = __write_all__ (fd, (void *)header->value, strlen (header->value));
-    if (m == -1)
-        return -1;
-    n += m;
-
-    m = __write_all__ (fd, "\r\n", 2);
-    if (m == -1)
-        return -1;
-    n += m;
-
-    m = __http_write_header__ (fd, header->next);
-    if (m == -1)
-        return -1;
-    n += m;
-
-    return n;
-}
-
 unsigned short
 validate_port(unsigned short port) {
     if (port <= 0 || port > 0xffff) {
@@ -643,20 +1259,38 @@ __http_destroy_header__ (http_hdr_t *header)
     free (header);
 }
 
+void
+http_destroy_header (http_hdr_t *header)
+{
+    __http_destroy_header__ (header);
+}
+
 static http_res_t *
 __http_allocate_response__ (const char *status_message)
 {
     http_res_t  *response;
+    int          i;
 
     response = malloc (sizeof (http_res_t));
     if (response == NULL)
         return NULL;
 
-    response->status_message = strdup(status_message);
-    if (response->status_message == NULL) {
-        free (response);
-        return NULL;
+    response->head = NULL;
+    response->head_len = 0;
+    response->header_count = 0;
+    for (i = 0; i < HTTP_HDR_KNOWN; i++)
+        response->known[i] = -1;
+    response->content_len = 0;
+    response->content = NULL;
+
+    if (status_message != NULL) {
+        response->head = strdup (status_message);
+        if (response->head == NULL) {
+            free (response);
+            return NULL;
+        }
     }
+    response->status_message = response->head;
 
     return response;
 }
@@ -674,176 +1308,648 @@ http_create_response (int major_version,
     response->major_version = major_version;
     response->minor_version = minor_version;
     response->status_code = status_code;
-    response->header = NULL;
 
     return response;
 }
 
+static const char *
+__scan2_generic__ (const char *p, const char *end, int a, int b)
+{
+    for (; p < end; p++) {
+        if (*p == (char) a || *p == (char) b)
+            break;
+    }
+    return p;
+}
+
+#ifdef HTTP_HAVE_SSE2
+static const char *
+__scan2_sse2__ (const char *p, const char *end, int a, int b)
+{
+    __m128i     va = _mm_set1_epi8 ((char) a);
+    __m128i     vb = _mm_set1_epi8 ((char) b);
+    __m128i     v;
+    int         mask;
+
+    for (; end - p >= 16; p += 16) {
+        v = _mm_loadu_si128 ((const __m128i *) p);
+        mask = _mm_movemask_epi8 (_mm_or_si128 (_mm_cmpeq_epi8 (v, va),
+                                                _mm_cmpeq_epi8 (v, vb)));
+        if (mask != 0)
+            return p + __builtin_ctz (mask);
+    }
+    return __scan2_generic__ (p, end, a, b);
+}
+
+__attribute__ ((target ("avx2")))
+static const char *
+__scan2_avx2__ (const char *p, const char *end, int a, int b)
+{
+    __m256i     va = _mm256_set1_epi8 ((char) a);
+    __m256i     vb = _mm256_set1_epi8 ((char) b);
+    __m256i     v;
+    unsigned    mask;
+
+    for (; end - p >= 32; p += 32) {
+        v = _mm256_loadu_si256 ((const __m256i *) p);
+        mask = _mm256_movemask_epi8 (_mm256_or_si256 (
+                   _mm256_cmpeq_epi8 (v, va), _mm256_cmpeq_epi8 (v, vb)));
+        if (mask != 0)
+            return p + __builtin_ctz (mask);
+    }
+    return __scan2_sse2__ (p, end, a, b);
+}
+#endif
+
+static void
+__scan_select__ (void)
+{
+#ifdef HTTP_HAVE_SSE2
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("avx2"))
+        __scan2__ = __scan2_avx2__;
+    else
+        __scan2__ = __scan2_sse2__;
+#endif
+}
+
+static int
+__known_header__ (const char *name, size_t len)
+{
+    int     i;
+
+    for (i = 0; i < HTTP_HDR_KNOWN; i++) {
+        if (strlen (known_names[i]) == len
+            && strncasecmp (known_names[i], name, len) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/*
+ * Where a header past HTTP_MAX_HEADERS goes: framing and keep-alive
+ * depend on the known ones, so one of those takes the slot of the last
+ * unknown header, unless it is already there. NULL drops it.
+ */
+static http_field_t *
+__overflow_slot__ (http_res_t *response, const char *base, size_t name,
+    size_t name_len)
+{
+    http_field_t   *f, *slot = NULL;
+    int             m, id;
+
+    if ((m = __known_header__ (base + name, name_len)) < 0)
+        return NULL;
+    for (id = response->header_count - 1; id >= 0; id--) {
+        f = &response->headers[id];
+        if (__known_header__ (base + f->name, f->name_len) == m)
+            return NULL;
+        if (slot == NULL && __known_header__ (base + f->name, f->name_len) < 0)
+            slot = f;
+    }
+    return slot;
+}
+
+/*
+ * Find the end of the response head with one pass over the receive
+ * buffer, noting where every header line and its colon are. The head is
+ * then copied once and split in place: names and values are offsets into
+ * that copy, so no header costs an allocation.
+ */
 ssize_t
-http_parse_response (int fd, http_res_t **response_)
+http_parse_response_header (http_conn_t *conn, http_res_t **response_)
 {
-    ssize_t         n;
-    unsigned char   ch;
-    size_t          len;
-    unsigned char  *data;
     http_res_t     *response;
-    int             readn;
-    unsigned char  *content;
-    int             malloc_size = 1024;
-    int             effiv_addr  = 0;
+    http_field_t   *f;
+    const char     *base, *hit;
+    char           *head, *p;
+    unsigned char  *buf;
+    size_t          pos = 0, line = 0, colon = 0, status_end = 0;
+    size_t          avail, end;
+    ssize_t         m;
+    int             id;
 
     *response_ = NULL;
+    pthread_once (&scan_once, __scan_select__);
 
-    response = malloc (sizeof (http_res_t));
+    response = __http_allocate_response__ (NULL);
     if (response == NULL) {
         printf ("http_parse_response: out of memory\n");
         return -1;
     }
-
     response->major_version = -1;
     response->minor_version = -1;
     response->status_code = -1;
-    response->status_message = NULL;
-    response->header = NULL;
 
-    n = __read_until__ (fd, '/', &data);
-    if (n <= 0) {
-        free (response);
-        return n;
-    } else if (n != 5 || memcmp (data, "HTTP", 4) != 0) {
+    for (;;) {
+        base = (const char *) conn->buf + conn->start;
+        avail = conn->end - conn->start;
+        hit = __scan2__ (base + pos, base + avail, ':', '\n');
+        pos = hit - base;
+
+        if (pos == avail) {
+            /* the head must fit in the buffer, grow it like a long line */
+            if (conn->end == conn->size && conn->start == 0) {
+                if (conn->size >= HTTP_LINE_MAX
+                    || (buf = realloc (conn->buf, conn->size * 2)) == NULL) {
+                    printf ("http_parse_response: header too large\n");
+                    http_destroy_response (response);
+                    return -1;
+                }
+                conn->buf = buf;
+                conn->size *= 2;
+            }
+            if ((m = http_conn_fill (conn)) <= 0) {
+                http_destroy_response (response);
+                return m;
+            }
+            continue;
+        }
+
+        if (*hit == ':') {
+            if (line > 0 && colon == 0)
+                colon = pos;
+            pos++;
+            continue;
+        }
+
+        /* end of a line */
+        end = pos++;
+        if (line == 0) {
+            status_end = end;
+        } else if (end == line || (end == line + 1 && base[line] == '\r')) {
+            break;
+        } else if (colon != 0) {
+            if (response->header_count < HTTP_MAX_HEADERS)
+                f = &response->headers[response->header_count++];
+            else
+                f = __overflow_slot__ (response, base, line, colon - line);
+            if (f != NULL) {
+                f->name = line;
+                f->name_len = colon - line;
+                f->value = colon + 1;
+                f->value_len = end - colon - 1;
+            }
+        }
+        line = pos;
+        colon = 0;
+    }
+
+    head = malloc (pos + 1);
+    if (head == NULL) {
+        http_destroy_response (response);
+        return -1;
+    }
+    memcpy (head, conn->buf + conn->start, pos);
+    head[pos] = '\0';
+    http_conn_consume (conn, pos);
+    response->head = head;
+    response->head_len = pos;
+
+    /* "HTTP/<major>.<minor> <status> <message>" */
+    if (status_end > 0 && head[status_end - 1] == '\r')
+        status_end--;
+    head[status_end] = '\0';
+    if (memcmp (head, "HTTP/", 5) != 0) {
         printf ("http_parse_response: expected \"HTTP\"\n");
-        free (data);
-        free (response);
+        http_destroy_response (response);
         return -1;
     }
-    free (data);
-    len = n;
-
-    n = __read_until__ (fd, '.', &data);
-    if (n <= 0) {
-        free (response);
-        return n;
+    response->major_version = (int) strtol (head + 5, &p, 10);
+    if (*p == '.')
+        response->minor_version = (int) strtol (p + 1, &p, 10);
+    response->status_code = (int) strtol (p, &p, 10);
+    while (*p == ' ')
+        p++;
+    response->status_message = p;
+
+    for (id = 0; id < response->header_count; id++) {
+        f = &response->headers[id];
+        head[f->name + f->name_len] = '\0';
+        while (f->value_len > 0 && (head[f->value] == ' '
+                                    || head[f->value] == '\t')) {
+            f->value++;
+            f->value_len--;
+        }
+        while (f->value_len > 0
+               && (head[f->value + f->value_len - 1] == '\r'
+                   || head[f->value + f->value_len - 1] == ' '
+                   || head[f->value + f->value_len - 1] == '\t'))
+            f->value_len--;
+        head[f->value + f->value_len] = '\0';
+
+        m = __known_header__ (head + f->name, f->name_len);
+        if (m >= 0 && response->known[m] == -1)
+            response->known[m] = id;
     }
-    data[n - 1] = 0;
-    response->major_version = atoi (data);
-    free (data);
-    len += n;
 
-    n = __read_until__ (fd, ' ', &data);
-    if (n <= 0) {
-        free (response);
-        return n;
+    *response_ = response;
+    return pos;
+}
+
+const char *
+http_response_known (http_res_t *response, http_hdr_id_t id)
+{
+    if (response->known[id] < 0)
+        return NULL;
+    return response->head + response->headers[response->known[id]].value;
+}
+
+const char *
+http_response_header (http_res_t *response, const char *name)
+{
+    http_field_t   *f;
+    size_t          len;
+    int             i;
+
+    if ((i = __known_header__ (name, strlen (name))) >= 0)
+        return http_response_known (response, i);
+
+    len = strlen (name);
+    for (i = 0; i < response->header_count; i++) {
+        f = &response->headers[i];
+        if (f->name_len == len
+            && strcasecmp (response->head + f->name, name) == 0)
+            return response->head + f->value;
     }
-    data[n - 1] = 0;
-    response->minor_version = atoi (data);
-    free (data);
-    len += n;
+    return NULL;
+}
 
-    n = __read_until__ (fd, ' ', &data);
-    if (n <= 0) {
-        free (response);
-        return n;
+void
+http_body_init (http_body_t *body, http_conn_t *conn, http_res_t *response)
+{
+    const char  *value;
+    size_t       len;
+
+    body->conn = conn;
+    body->mode = HTTP_BODY_EOF;
+    body->left = 0;
+    body->done = 0;
+    http_chunked_init (&body->chunked);
+
+    /* the caller knows better for HEAD, these never have one */
+    if (response->status_code / 100 == 1 || response->status_code == 204
+        || response->status_code == 304) {
+        body->mode = HTTP_BODY_NONE;
+        body->done = 1;
+        return;
     }
-    data[n - 1] = 0;
-    response->status_code = atoi (data);
-    free (data);
-    len += n;
 
-    n = __read_until__ (fd, '\r', &data);
-    if (n <= 0) {
-        free (response);
-        return n;
+    if ((value = http_response_known (response,
+                                      HTTP_HDR_TRANSFER_ENCODING)) != NULL) {
+        /* chunked has to be the last coding applied */
+        len = strlen (value);
+        if (len >= 7 && strncasecmp (value + len - 7, "chunked", 7) == 0) {
+            body->mode = HTTP_BODY_CHUNKED;
+            return;
+        }
+    } else if ((value = http_response_known (response,
+                                             HTTP_HDR_CONTENT_LENGTH)) != NULL) {
+        body->mode = HTTP_BODY_LENGTH;
+        body->left = strtoul (value, NULL, 10);
+        body->done = body->left == 0;
     }
-    data[n - 1] = 0;
-    response->status_message = data;
-    len += n;
+}
 
-    n = __read_until__ (fd, '\n', &data);
-    if (n <= 0) {
-        http_destroy_response (response);
-        return n;
+void
+http_chunked_init (http_chunked_t *dec)
+{
+    dec->state = HTTP_CHUNK_SIZE;
+    dec->left = 0;
+    dec->digits = 0;
+    dec->line = 0;
+}
+
+static int
+__hexval__ (unsigned char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/*
+ * Walk in[0, len) until a piece of chunk payload turns up, which is
+ * returned in *data and *n, pointing into in. Returns the bytes of in
+ * used up, payload included; *n is 0 when in only held framing or the
+ * body ended (state HTTP_CHUNK_DONE, anything after belongs to the next
+ * response). Returns -1 on malformed input, the decoder stays failed.
+ * Bare LFs are accepted where CRLF is due.
+ */
+ssize_t
+http_chunked_step (http_chunked_t *dec, const unsigned char *in, size_t len,
+    const unsigned char **data, size_t *n)
+{
+    size_t  i = 0, take;
+    int     v;
+
+    *data = NULL;
+    *n = 0;
+
+    while (i < len) {
+        switch (dec->state) {
+        case HTTP_CHUNK_SIZE:
+            if ((v = __hexval__ (in[i])) >= 0) {
+                /* 16 hex digits already fill 64 bits */
+                if (++dec->digits > 16)
+                    goto fail;
+                dec->left = dec->left << 4 | v;
+                i++;
+                break;
+            }
+            if (dec->digits == 0)
+                goto fail;
+            if (in[i] == ';' || in[i] == ' ' || in[i] == '\t') {
+                dec->state = HTTP_CHUNK_EXT;
+                dec->line = 0;
+            } else if (in[i] == '\r') {
+                dec->state = HTTP_CHUNK_SIZE_LF;
+                i++;
+            } else if (in[i] == '\n') {
+                dec->state = HTTP_CHUNK_SIZE_LF;
+            } else {
+                goto fail;
+            }
+            break;
+
+        case HTTP_CHUNK_EXT:
+            if (in[i] == '\r' || in[i] == '\n') {
+                dec->state = HTTP_CHUNK_SIZE;
+                break;
+            }
+            if (++dec->line > HTTP_LINE_MAX)
+                goto fail;
+            i++;
+            break;
+
+        case HTTP_CHUNK_SIZE_LF:
+            if (in[i++] != '\n')
+                goto fail;
+            dec->digits = 0;
+            dec->line = 0;
+            dec->state = dec->left ? HTTP_CHUNK_DATA : HTTP_CHUNK_TRAILER;
+            break;
+
+        case HTTP_CHUNK_DATA:
+            take = len - i;
+            if (take > dec->left)
+                take = dec->left;
+            dec->left -= take;
+            if (dec->left == 0)
+                dec->state = HTTP_CHUNK_DATA_CR;
+            *data = in + i;
+            *n = take;
+            return i + take;
+
+        case HTTP_CHUNK_DATA_CR:
+            if (in[i] == '\r')
+                i++;
+            else if (in[i] != '\n')
+                goto fail;
+            dec->state = HTTP_CHUNK_DATA_LF;
+            break;
+
+        case HTTP_CHUNK_DATA_LF:
+            if (in[i++] != '\n')
+                goto fail;
+            dec->state = HTTP_CHUNK_SIZE;
+            break;
+
+        case HTTP_CHUNK_TRAILER:
+            if (in[i] == '\r') {
+                dec->state = HTTP_CHUNK_TRAILER_LF;
+                i++;
+            } else if (in[i] == '\n') {
+                dec->state = HTTP_CHUNK_TRAILER_LF;
+            } else if (++dec->line > HTTP_LINE_MAX) {
+                goto fail;
+            } else {
+                i++;
+            }
+            break;
+
+        case HTTP_CHUNK_TRAILER_LF:
+            if (in[i++] != '\n')
+                goto fail;
+            if (dec->line == 0) {
+                dec->state = HTTP_CHUNK_DONE;
+                return i;
+            }
+            dec->line = 0;
+            dec->state = HTTP_CHUNK_TRAILER;
+            break;
+
+        case HTTP_CHUNK_DONE:
+            return i;
+
+        case HTTP_CHUNK_ERROR:
+            return -1;
+        }
     }
-    free (data);
-    if (n != 1) {
-        printf ("http_parse_response: invalid line ending\n");
-        http_destroy_response (response);
-        return -1;
+    return i;
+
+fail:
+    dec->state = HTTP_CHUNK_ERROR;
+    return -1;
+}
+
+/*
+ * Decode all of in[0, len) into sink. Returns the bytes used, fewer than
+ * len only once the body ended; -1 on malformed input or when the sink
+ * asked to stop.
+ */
+ssize_t
+http_chunked_feed (http_chunked_t *dec, const unsigned char *in, size_t len,
+    http_body_sink sink, void *ctx)
+{
+    const unsigned char *data;
+    size_t               used = 0, n;
+    ssize_t              m;
+
+    while (used < len && dec->state != HTTP_CHUNK_DONE) {
+        if ((m = http_chunked_step (dec, in + used, len - used, &data, &n)) < 0)
+            return -1;
+        used += m;
+        if (n > 0 && sink (ctx, data, n) != 0) {
+            errno = ECANCELED;
+            return -1;
+        }
     }
-    len += n;
+    return used;
+}
 
-    n =__parse_header__ (fd, &response->header);
-    if (n <= 0) {
-        http_destroy_response (response);
+/*
+ * Point data at up to max body bytes straight in the receive buffer and
+ * consume them. They stay valid until the next call on the connection.
+ * Returns 0 at the end of the body, -1 on errors and short bodies.
+ */
+ssize_t
+http_body_next (http_body_t *body, const unsigned char **data, size_t max)
+{
+    http_conn_t          *conn = body->conn;
+    size_t                n;
+    ssize_t               m;
+
+    *data = NULL;
+    while (!body->done) {
+        if (conn->start == conn->end) {
+            if ((m = http_conn_fill (conn)) < 0)
+                return -1;
+            if (m == 0) {
+                if (body->mode == HTTP_BODY_EOF) {
+                    body->done = 1;
+                    return 0;
+                }
+                printf ("http_body: connection closed mid-body\n");
+                return -1;
+            }
+        }
+
+        n = conn->end - conn->start;
+        if (n > max)
+            n = max;
+
+        if (body->mode == HTTP_BODY_CHUNKED) {
+            m = http_chunked_step (&body->chunked, conn->buf + conn->start,
+                                   n, data, &n);
+            if (m < 0) {
+                printf ("http_body: malformed chunked encoding\n");
+                return -1;
+            }
+            http_conn_consume (conn, m);
+            body->done = body->chunked.state == HTTP_CHUNK_DONE;
+            if (n > 0)
+                return n;
+            continue;
+        }
+
+        if (body->mode == HTTP_BODY_LENGTH && n > body->left)
+            n = body->left;
+        *data = conn->buf + conn->start;
+        http_conn_consume (conn, n);
+        if (body->mode == HTTP_BODY_LENGTH) {
+            body->left -= n;
+            body->done = body->left == 0;
+        }
         return n;
     }
-    len += n;
+    return 0;
+}
 
-    response->content_len = 0;
-    
-    content = (unsigned char *) malloc(malloc_size);
-    /*parse chunked data*/
-    if (http_header_get (response->header, "Transfer-Encoding")) {
-        while ((n = __read_until__ (fd, '\n', &data)) > 0) {
-            data[n - 2] = '\0';
-
-            if ((readn = (int) strtol (data, NULL, 16)) > 0) {
-                malloc_size += readn;
-                content = (unsigned char *) realloc ((void*)content, malloc_size);
-                __read_all__(fd, content + effiv_addr, readn);
-                effiv_addr += readn;
-
-                /*unused CLRF*/
-                read (fd, &ch, 1);
-                assert (ch == '\r');
-                read (fd, &ch, 1);
-                assert (ch == '\n');
-            } else {
-                /* chunk size is 0 */
-                /*unused CLRF*/
-                read (fd, &ch, 1);
-                assert (ch == '\r');
-                read (fd, &ch, 1);
-                assert (ch == '\n');
-                break;
-            }
+/* copy the next n body bytes, fewer only at the end of the body */
+ssize_t
+http_body_read (http_body_t *body, void *buf, size_t n)
+{
+    const unsigned char *data;
+    size_t               got = 0;
+    ssize_t              m;
+
+    while (got < n) {
+        if ((m = http_body_next (body, &data, n - got)) <= 0) {
+            if (m < 0 && got == 0)
+                return -1;
+            break;
+        }
+        memcpy ((unsigned char *) buf + got, data, m);
+        got += m;
+    }
+    return got;
+}
+
+/*
+ * Stream the body of response to sink as it arrives. Returns the payload
+ * size, or -1 on errors and when the sink asked to stop.
+ */
+ssize_t
+http_read_body (http_conn_t *conn, http_res_t *response, http_body_sink sink,
+    void *ctx)
+{
+    http_body_t          body;
+    const unsigned char *data;
+    size_t               total = 0;
+    ssize_t              n;
+
+    http_body_init (&body, conn, response);
+    while ((n = http_body_next (&body, &data, (size_t) -1)) > 0) {
+        if (sink (ctx, data, n) != 0) {
+            errno = ECANCELED;
+            return -1;
         }
-        content[effiv_addr] = '\0';
-        response->content_len = effiv_addr;
+        total += n;
+    }
+    return n < 0 ? -1 : (ssize_t) total;
+}
+
+static int
+__buffer_sink__ (void *ctx, const unsigned char *data, size_t len)
+{
+    http_buffer_t  *b = ctx;
+    http_res_t     *response = b->response;
+    unsigned char  *content;
+    size_t          cap;
+
+    /* doubling keeps the copying linear in the body size */
+    if (response->content_len + len + 1 > b->cap) {
+        for (cap = b->cap ? b->cap : 1024;
+             cap < response->content_len + len + 1; cap *= 2)
+            ;
+        content = realloc (response->content, cap);
+        if (content == NULL)
+            return -1;
         response->content = content;
-    } else {
-        __dynamic_read_socket__ (fd, response);
+        b->cap = cap;
     }
+    memcpy (response->content + response->content_len, data, len);
+    response->content_len += len;
+    response->content[response->content_len] = '\0';
+    return 0;
+}
 
-    *response_ = response;
+/* header and whole body, for responses small enough to keep in memory */
+ssize_t
+http_parse_response (http_conn_t *conn, http_res_t **response_)
+{
+    ssize_t         len;
+    http_res_t     *response;
+    http_buffer_t   buffer;
+
+    len = http_parse_response_header (conn, response_);
+    if (len <= 0)
+        return len;
+    response = *response_;
+
+    buffer.response = response;
+    buffer.cap = 0;
+    if (http_read_body (conn, response, __buffer_sink__, &buffer) < 0) {
+        http_destroy_response (response);
+        *response_ = NULL;
+        return -1;
+    }
     return len;
 }
 
-void 
-__dynamic_read_socket__ (int fd, http_res_t* response)
+/* whether the server leaves the connection open after this response */
+int
+http_response_keep_alive (http_res_t *response)
 {
-    int             readn;
-    unsigned char  *body;
-    int             malloc_size = 1024;
-    int             block_size  = 1024;
-    int             effiv_addr  = 0;
+    const char  *value;
 
-    body = (unsigned char*) malloc (malloc_size);
-    while ((readn = __read_all__ (fd, body + effiv_addr, block_size)) > 0) {
-        effiv_addr += readn;
-        malloc_size += block_size;
-        body = (unsigned char*) realloc ((void*)body, malloc_size);
-    }
-    
-    response->content = body;
-    response->content_len = effiv_addr;
+    value = http_response_known (response, HTTP_HDR_CONNECTION);
+    if (value != NULL && strncasecmp (value, "close", 5) == 0)
+        return 0;
+    if (response->major_version == 1 && response->minor_version == 0)
+        return value != NULL && strncasecmp (value, "keep-alive", 10) == 0;
+    return response->major_version >= 1;
 }
 
 void
 http_destroy_response (http_res_t *response)
 {
-    if (response->status_message)
-        free ((char *)response->status_message);
-    __http_destroy_header__ (response->header);
+    free (response->head);
     free(response->content);
     free (response);
 }
@@ -880,12 +1986,14 @@ http_create_request (http_met_t method,
     request->major_version = major_version;
     request->minor_version = minor_version;
     request->header = NULL;
+    request->content_len = 0;
+    request->content = NULL;
 
     return request;
 }
 
 ssize_t
-http_parse_request (int fd, http_req_t **request_)
+http_parse_request (http_conn_t *conn, http_req_t **request_)
 {
     ssize_t        n;
     size_t         len;
@@ -905,7 +2013,7 @@ http_parse_request (int fd, http_req_t **request_)
     request->minor_version = -1;
     request->header = NULL;
 
-    n = __read_until__ (fd, ' ', &data);
+    n = __read_until__ (conn, ' ', &data);
     if (n <= 0) {
         free (request);
         return n;
@@ -920,7 +2028,7 @@ http_parse_request (int fd, http_req_t **request_)
     free (data);
     len = n;
 
-    n = __read_until__ (fd, ' ', &data);
+    n = __read_until__ (conn, ' ', &data);
     if (n <= 0) {
         free (request);
         return n;
@@ -929,7 +2037,7 @@ http_parse_request (int fd, http_req_t **request_)
     request->uri = data;
     len += n;
 
-    n = __read_until__ (fd, '/', &data);
+    n = __read_until__ (conn, '/', &data);
     if (n <= 0) {
         http_destroy_request (request);
         return n;
@@ -941,7 +2049,7 @@ http_parse_request (int fd, http_req_t **request_)
     free (data);
     len = n;
 
-    n = __read_until__ (fd, '.', &data);
+    n = __read_until__ (conn, '.', &data);
     if (n <= 0) {
         http_destroy_request (request);
         return n;
@@ -951,7 +2059,7 @@ http_parse_request (int fd, http_req_t **request_)
     free (data);
     len += n;
 
-    n = __read_until__ (fd, '\r', &data);
+    n = __read_until__ (conn, '\r', &data);
     if (n <= 0) {
         http_destroy_request (request);
         return n;
@@ -960,7 +2068,7 @@ http_parse_request (int fd, http_req_t **request_)
     request->minor_version = atoi (data);
     free (data);
     len += n;
-    n = __read_until__ (fd, '\n', &data);
+    n = __read_until__ (conn, '\n', &data);
     if (n <= 0) {
         http_destroy_request (request);
         return n;
@@ -972,7 +2080,7 @@ http_parse_request (int fd, http_req_t **request_)
     }
     len += n;
 
-    n = __parse_header__ (fd, &request->header);
+    n = __parse_header__ (conn, &request->header);
     if (n <= 0) {
         http_destroy_request (request);
         return n;
@@ -984,37 +2092,41 @@ http_parse_request (int fd, http_req_t **request_)
 }
 
 ssize_t
-http_write_request (int fd, http_req_t *request)
-{
-    ssize_t  m;
-    ssize_t  n = 0;
-    char     str[1024];
-
-    m = snprintf (str, 1024, "%s %s HTTP/%d.%d\r\n",
-                  __http_method_to_string__ (request->method),
-                  request->uri,
-                  request->major_version,
-                  request->minor_version);
-    m = __write_all__ (fd, str, m);
-    /*printf ("http_write_request: %s", str);*/
-    if (m == -1) {
-        printf ("http_write_request: write error: %s\n", strerror (errno));
-        return -1;
-    }
-    n += m;
-
-    m = __http_write_header__ (fd, request->header);
-    if (m == -1)
-        return -1;
-    n += m;
+http_write_request (http_conn_t *conn, http_req_t *request)
+{
+    http_hdr_t    *h;
+    char           version[32];
+    int            cnt = 0, nheader = 0;
+    ssize_t        n;
 
+    for (h = request->header; h != NULL; h = h->next)
+        nheader++;
+
+    struct iovec   iov[6 + 4 * nheader];
+
+    iov[cnt].iov_base = (void *) __http_method_to_string__ (request->method);
+    iov[cnt].iov_len = strlen (iov[cnt].iov_base);
+    cnt++;
+    iov[cnt].iov_base = " ";
+    iov[cnt++].iov_len = 1;
+    iov[cnt].iov_base = (void *) request->uri;
+    iov[cnt++].iov_len = strlen (request->uri);
+    iov[cnt].iov_base = version;
+    iov[cnt++].iov_len = snprintf (version, sizeof (version),
+                                   " HTTP/%d.%d\r\n",
+                                   request->major_version,
+                                   request->minor_version);
+    cnt += __iov_headers__ (iov + cnt, request->header);
+    iov[cnt].iov_base = "\r\n";
+    iov[cnt++].iov_len = 2;
     if (request->content != NULL && request->content_len > 0) {
-        m = __write_all__(fd, request->content, request->content_len);
-        if (m == -1)
-            return -1;
-        n += m;
+        iov[cnt].iov_base = request->content;
+        iov[cnt++].iov_len = request->content_len;
     }
 
+    n = __writev_all__ (conn, iov, cnt, 0);
+    if (n == -1)
+        printf ("http_write_request: write error: %s\n", strerror (errno));
     return n;
 }
 
@@ -1033,7 +2145,7 @@ __http_header_find__ (http_hdr_t *header, const char *name)
     if (header == NULL)
         return NULL;
 
-    if (strcmp (header->name, name) == 0)
+    if (strcasecmp (header->name, name) == 0)
         return header;
 
     return __http_header_find__ (header->next, name);
@@ -1,7 +1,40 @@
 #include <sys/types.h>
+#include <stdint.h>
 #include <assert.h>
 
-extern char  ip[128];
+#include "dns.h"
+#include "tls.h"
+
+#define HTTP_CONN_BUFSIZE   16384
+#define HTTP_LINE_MAX       65536
+#define HTTP_MAX_HEADERS    64      /* response headers kept, past it only known ones */
+
+#define HTTP_CONNECT_TIMEOUT_MS 5000
+#define HTTP_READ_TIMEOUT_MS    15000
+#define HTTP_EYEBALLS_DELAY_MS  250     /* RFC 8305 connection attempt delay */
+
+#define HTTP_POOL_PER_HOST  8       /* open connections per (scheme, host, port) */
+#define HTTP_POOL_IDLE_MS   30000   /* idle connections older than this are dropped */
+
+typedef struct http_pool http_pool_t;
+typedef struct http_pool_host http_pool_host_t;
+
+/*
+ * A socket plus its receive buffer. All parsing goes through the buffer,
+ * so a status line or a header costs one read() instead of one per byte.
+ */
+typedef struct http_conn {
+    int                    fd;
+    tls_conn_t            *tls;         /* NULL for plain http */
+    unsigned char         *buf;
+    size_t                 size;
+    size_t                 start;       /* first unconsumed byte */
+    size_t                 end;         /* one past the last buffered byte */
+    http_pool_host_t      *slot;        /* pool entry it counts against, or NULL */
+    int                    reused;      /* served a request before */
+    long                   idle_since;
+    struct http_conn      *next;        /* idle list */
+} http_conn_t;
 
 typedef enum
 {
@@ -32,42 +65,157 @@ typedef struct {
     char                  *content;
 } http_req_t;
 
+/* response headers looked up often enough to be indexed while parsing */
+typedef enum
+{
+    HTTP_HDR_CONTENT_LENGTH,
+    HTTP_HDR_TRANSFER_ENCODING,
+    HTTP_HDR_LOCATION,
+    HTTP_HDR_ETAG,
+    HTTP_HDR_LAST_MODIFIED,
+    HTTP_HDR_CONNECTION,
+    HTTP_HDR_KNOWN
+} http_hdr_id_t;
+
+/* one response header, as offsets into http_res_t.head */
+typedef struct {
+    uint32_t               name;
+    uint32_t               name_len;
+    uint32_t               value;
+    uint32_t               value_len;
+} http_field_t;
+
 typedef struct {
     int                   major_version;
     int                   minor_version;
     int                   status_code;
-    const char           *status_message;
-    http_hdr_t           *header;
+    const char           *status_message;   /* points into head */
+    char                 *head;             /* status line and headers, NUL separated */
+    size_t                head_len;
+    int                   header_count;
+    http_field_t          headers[HTTP_MAX_HEADERS];
+    short                 known[HTTP_HDR_KNOWN];  /* index in headers or -1 */
     size_t                content_len;
     unsigned char        *content;
 } http_res_t;
 
+/*
+ * Resumable decoder of the chunked transfer coding. It is fed whatever
+ * bytes are at hand and never blocks or reads on its own, so it works
+ * the same under a blocking socket, an event loop or a curl callback.
+ */
+typedef enum
+{
+    HTTP_CHUNK_SIZE,        /* hex digits of the chunk size */
+    HTTP_CHUNK_EXT,         /* ";name=value" extensions, skipped */
+    HTTP_CHUNK_SIZE_LF,
+    HTTP_CHUNK_DATA,
+    HTTP_CHUNK_DATA_CR,
+    HTTP_CHUNK_DATA_LF,
+    HTTP_CHUNK_TRAILER,     /* header lines after the last chunk, skipped */
+    HTTP_CHUNK_TRAILER_LF,
+    HTTP_CHUNK_DONE,
+    HTTP_CHUNK_ERROR
+} http_chunk_state_t;
+
+typedef struct {
+    http_chunk_state_t     state;
+    uint64_t               left;        /* of the current chunk */
+    int                    digits;
+    size_t                 line;        /* length of the extension or trailer line */
+} http_chunked_t;
+
+/*
+ * Incremental reader of a response body. Framing (Content-Length,
+ * chunked or until close) is undone here, callers only see payload.
+ */
+typedef enum
+{
+    HTTP_BODY_NONE,
+    HTTP_BODY_LENGTH,
+    HTTP_BODY_CHUNKED,
+    HTTP_BODY_EOF
+} http_body_mode_t;
+
+typedef struct {
+    http_conn_t           *conn;
+    http_body_mode_t       mode;
+    size_t                 left;        /* of a Content-Length body */
+    http_chunked_t         chunked;
+    int                    done;
+} http_body_t;
+
+/* gets body bytes in order; a non-zero return stops the transfer */
+typedef int (*http_body_sink) (void *ctx, const unsigned char *data,
+    size_t len);
+
 typedef struct {
     const char            *uri;
     const char            *host_name;
     unsigned short         host_port;
     size_t                 content_len;
     char                  *content;
+    int                    keep_alive;
+    int                    tls;         /* https */
+    int                    more;        /* another request follows right away */
+    http_hdr_t            *header;      /* extra request headers, may be NULL */
 } http_des_t;
 
-ssize_t http_get (http_des_t *dest);
-ssize_t http_post (http_des_t *dest); 
-ssize_t http_put (http_des_t *dest);
-ssize_t http_options (http_des_t *dest);
-ssize_t http_head (http_des_t *dest);
-ssize_t http_delete (http_des_t *dest);
-ssize_t http_trace (http_des_t *dest);
+http_conn_t *http_get (http_des_t *dest);
+http_conn_t *http_post (http_des_t *dest);
+http_conn_t *http_put (http_des_t *dest);
+http_conn_t *http_options (http_des_t *dest);
+http_conn_t *http_head (http_des_t *dest);
+http_conn_t *http_delete (http_des_t *dest);
+http_conn_t *http_trace (http_des_t *dest);
+ssize_t http_request (http_conn_t *conn, http_des_t *dest, http_met_t method);
+
+http_conn_t *http_conn_new (int fd);
+http_conn_t *http_connect (const char *host, unsigned short port);
+void http_conn_close (http_conn_t *conn);
+void http_conn_release (http_conn_t *conn, int reusable);
+
+http_pool_t *http_pool_new (int per_host);
+http_pool_t *http_default_pool (void);
+http_conn_t *http_pool_lease (http_pool_t *pool, const char *scheme,
+    const char *host, unsigned short port);
+void http_pool_stats (http_pool_t *pool, long *opened, long *reused);
+void http_pool_destroy (http_pool_t *pool);
+ssize_t http_conn_fill (http_conn_t *conn);
+ssize_t http_conn_peek (http_conn_t *conn, size_t n,
+    const unsigned char **data);
+void http_conn_consume (http_conn_t *conn, size_t n);
+ssize_t http_conn_read (http_conn_t *conn, void *buf, size_t n);
+ssize_t http_conn_read_until (http_conn_t *conn, int ch,
+    const unsigned char **line);
 
 unsigned short validate_port (unsigned short port);
+void http_set_timeouts (int connect_ms, int read_ms);
 int connect_to_server (const char *host, unsigned short port);
-int get_ip_from_host (char *ipbuf, const char *host, int maxlen);
 
 
 const char *http_header_get (http_hdr_t *header, const char *name);
 
 http_res_t *http_create_response (int major_version,
     int minor_version, int status_code, const char *status_message);
-ssize_t http_parse_response (int fd, http_res_t **response);
+ssize_t http_parse_response (http_conn_t *conn, http_res_t **response);
+ssize_t http_parse_response_header (http_conn_t *conn,
+    http_res_t **response);
+const char *http_response_header (http_res_t *response, const char *name);
+void http_chunked_init (http_chunked_t *dec);
+ssize_t http_chunked_step (http_chunked_t *dec, const unsigned char *in,
+    size_t len, const unsigned char **data, size_t *n);
+ssize_t http_chunked_feed (http_chunked_t *dec, const unsigned char *in,
+    size_t len, http_body_sink sink, void *ctx);
+void http_body_init (http_body_t *body, http_conn_t *conn,
+    http_res_t *response);
+ssize_t http_body_next (http_body_t *body, const unsigned char **data,
+    size_t max);
+ssize_t http_body_read (http_body_t *body, void *buf, size_t n);
+ssize_t http_read_body (http_conn_t *conn, http_res_t *response,
+    http_body_sink sink, void *ctx);
+const char *http_response_known (http_res_t *response, http_hdr_id_t id);
+int http_response_keep_alive (http_res_t *response);
 int http_error_to_errno (int err);
 void http_destroy_response (http_res_t *response);
 
@@ -76,7 +224,8 @@ http_req_t *http_create_request (http_met_t method,
     const char *uri, int major_version, int minor_version);
 http_hdr_t *http_add_header (http_hdr_t **header,
 	const char *name, const char *value);
-ssize_t http_write_request (int fd, http_req_t *request);
+void http_destroy_header (http_hdr_t *header);
+ssize_t http_write_request (http_conn_t *conn, http_req_t *request);
 void http_destroy_request (http_req_t *resquest);
-ssize_t http_parse_request (int fd, http_req_t **request);
+ssize_t http_parse_request (http_conn_t *conn, http_req_t **request);
 
@@ -0,0 +1,214 @@
+#include <string.h>
+#include <strings.h>
+
+#include "policy.h"
+
+typedef struct
+{
+    const char     *pattern;
+    int             weight;
+} policy_rule_t;
+
+static int __match_name__ (const char *base);
+static int __match_ext__ (const char *base);
+static int __match_dirs__ (const char *path);
+
+static const char *const policy_names[] = {
+    "index", "interesting", "largest"
+};
+
+/* whole file names, a leading '*' matches by prefix instead */
+static const policy_rule_t name_rules[] = {
+    { ".env*",              100 },
+    { ".git-credentials",   100 },
+    { ".htpasswd",          100 },
+    { "id_rsa",             100 },
+    { "id_dsa",             100 },
+    { "id_ecdsa",           100 },
+    { "id_ed25519",         100 },
+    { "wp-config.php",      90 },
+    { "database.yml",       90 },
+    { "secrets.yml",        90 },
+    { "credentials",        90 },
+    { "credentials.json",   90 },
+    { "master.key",         90 },
+    { ".netrc",             80 },
+    { ".npmrc",             80 },
+    { ".pypirc",            80 },
+    { "local_settings.py",  80 },
+    { "settings.py",        70 },
+    { "config.php",         70 },
+    { "application.properties", 70 },
+    { "appsettings.json",   70 },
+    { "web.config",         60 },
+    { "docker-compose.yml", 60 },
+    { ".htaccess",          50 },
+    { NULL,                 0 }
+};
+
+/* extensions, the first match counts so longer ones go first */
+static const policy_rule_t ext_rules[] = {
+    { ".min.js",    -30 },
+    { ".pem",       90 },
+    { ".key",       90 },
+    { ".p12",       90 },
+    { ".pfx",       90 },
+    { ".kdbx",      90 },
+    { ".sql",       70 },
+    { ".bak",       60 },
+    { ".old",       50 },
+    { ".ini",       50 },
+    { ".conf",      50 },
+    { ".cfg",       50 },
+    { ".properties", 50 },
+    { ".yml",       40 },
+    { ".yaml",      40 },
+    { ".swp",       40 },
+    { ".sh",        20 },
+    { ".php",       20 },
+    { ".json",      20 },
+    { ".xml",       15 },
+    { ".py",        15 },
+    { ".rb",        15 },
+    { ".js",        10 },
+    { ".pdf",       -20 },
+    { ".css",       -30 },
+    { ".svg",       -40 },
+    { ".map",       -40 },
+    { ".png",       -50 },
+    { ".jpg",       -50 },
+    { ".jpeg",      -50 },
+    { ".gif",       -50 },
+    { ".ico",       -50 },
+    { ".webp",      -50 },
+    { ".woff",      -50 },
+    { ".woff2",     -50 },
+    { ".ttf",       -50 },
+    { ".eot",       -50 },
+    { ".mp3",       -60 },
+    { ".mp4",       -60 },
+    { NULL,         0 }
+};
+
+/* directories anywhere on the path, each one that matches counts */
+static const policy_rule_t dir_rules[] = {
+    { ".ssh",           80 },
+    { "secrets",        60 },
+    { "config",         30 },
+    { "conf",           30 },
+    { "private",        30 },
+    { "deploy",         20 },
+    { "test",           -10 },
+    { "tests",          -10 },
+    { "public",         -10 },
+    { "assets",         -20 },
+    { "static",         -20 },
+    { "images",         -30 },
+    { "img",            -30 },
+    { "fonts",          -30 },
+    { "dist",           -30 },
+    { "vendor",         -40 },
+    { "node_modules",   -60 },
+    { NULL,             0 }
+};
+
+static int
+__match_name__ (const char *base)
+{
+    const policy_rule_t  *r;
+    size_t                n;
+
+    for (r = name_rules; r->pattern != NULL; r++) {
+        n = strlen (r->pattern);
+        if (r->pattern[n - 1] == '*') {
+            if (strncasecmp (base, r->pattern, n - 1) == 0)
+                return r->weight;
+        } else if (strcasecmp (base, r->pattern) == 0) {
+            return r->weight;
+        }
+    }
+    return 0;
+}
+
+static int
+__match_ext__ (const char *base)
+{
+    const policy_rule_t  *r;
+    size_t                len = strlen (base), n;
+
+    for (r = ext_rules; r->pattern != NULL; r++) {
+        n = strlen (r->pattern);
+        if (len > n && strcasecmp (base + len - n, r->pattern) == 0)
+            return r->weight;
+    }
+    return 0;
+}
+
+static int
+__match_dirs__ (const char *path)
+{
+    const policy_rule_t  *r;
+    const char           *p, *slash;
+    size_t                n;
+    int                   weight = 0;
+
+    for (p = path; (slash = strchr (p, '/')) != NULL; p = slash + 1) {
+        n = slash - p;
+        for (r = dir_rules; r->pattern != NULL; r++) {
+            if (strlen (r->pattern) == n && strncasecmp (p, r->pattern, n) == 0) {
+                weight += r->weight;
+                break;
+            }
+        }
+    }
+    return weight;
+}
+
+int
+policy_parse (const char *name, policy_t *policy)
+{
+    size_t  i;
+
+    for (i = 0; i < sizeof (policy_names) / sizeof (policy_names[0]); i++) {
+        if (strcmp (name, policy_names[i]) == 0) {
+            *policy = (policy_t) i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *
+policy_name (policy_t policy)
+{
+    return policy_names[policy];
+}
+
+/*
+ * Higher runs first. Interesting ranks by what the path looks like and
+ * then by size, smallest first, for the earliest first find. Largest is
+ * longest-processing-time-first: with the big blobs started early the
+ * small ones fill in around them and the run ends sooner.
+ */
+long
+policy_priority (policy_t policy, const char *path, size_t size)
+{
+    const char  *base;
+    long         score;
+
+    if (size > 0xffffffffUL)
+        size = 0xffffffffUL;
+
+    switch (policy) {
+    case POLICY_INTERESTING:
+        base = strrchr (path, '/');
+        base = base ? base + 1 : path;
+        score = __match_name__ (base) + __match_ext__ (base)
+                + __match_dirs__ (path);
+        return score * 0x100000000L - (long) size;
+    case POLICY_LARGEST:
+        return (long) size;
+    default:
+        return 0;
+    }
+}
@@ -0,0 +1,24 @@
+#ifndef POLICY_H
+#define POLICY_H
+
+#include <sys/types.h>
+
+/*
+ * Order in which index entries are fetched. Each entry gets a priority
+ * and the fetch pool runs the highest first, ties in index order.
+ */
+
+typedef enum
+{
+    POLICY_INDEX,           /* index order, i.e. by path */
+    POLICY_INTERESTING,     /* likely secrets and config first, small ones first */
+    POLICY_LARGEST          /* largest first, keeps a big blob off the tail */
+} policy_t;
+
+int policy_parse (const char *name, policy_t *policy);
+
+const char *policy_name (policy_t policy);
+
+long policy_priority (policy_t policy, const char *path, size_t size);
+
+#endif /* POLICY_H */
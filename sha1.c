@@ -0,0 +1,275 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA1_HAVE_X86 1
+#endif
+
+#include "sha1.h"
+
+typedef void (*sha1_blocks_fn) (uint32_t state[5],
+    const unsigned char *data, size_t nblocks);
+
+static void __sha1_blocks_generic__ (uint32_t state[5],
+    const unsigned char *data, size_t nblocks);
+static void __sha1_select__ (void);
+
+static sha1_blocks_fn   sha1_blocks = __sha1_blocks_generic__;
+static const char      *sha1_name = "generic";
+static pthread_once_t   sha1_once = PTHREAD_ONCE_INIT;
+
+#define ROL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void
+__sha1_blocks_generic__ (uint32_t state[5], const unsigned char *data,
+    size_t nblocks)
+{
+    uint32_t    w[80];
+    uint32_t    a, b, c, d, e, t;
+    int         i;
+
+    while (nblocks--) {
+        for (i = 0; i < 16; i++) {
+            w[i] = (uint32_t)data[i * 4] << 24
+                | (uint32_t)data[i * 4 + 1] << 16
+                | (uint32_t)data[i * 4 + 2] << 8
+                | (uint32_t)data[i * 4 + 3];
+        }
+        for (i = 16; i < 80; i++) {
+            w[i] = ROL32 (w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+
+        a = state[0];
+        b = state[1];
+        c = state[2];
+        d = state[3];
+        e = state[4];
+
+#define SHA1_STEP(f, k)                                 \
+        do {                                            \
+            t = ROL32 (a, 5) + (f) + e + (k) + w[i];    \
+            e = d;                                      \
+            d = c;                                      \
+            c = ROL32 (b, 30);                          \
+            b = a;                                      \
+            a = t;                                      \
+        } while (0)
+
+        for (i = 0; i < 20; i++)
+            SHA1_STEP (d ^ (b & (c ^ d)), 0x5A827999);
+        for (; i < 40; i++)
+            SHA1_STEP (b ^ c ^ d, 0x6ED9EBA1);
+        for (; i < 60; i++)
+            SHA1_STEP ((b & c) | (d & (b | c)), 0x8F1BBCDC);
+        for (; i < 80; i++)
+            SHA1_STEP (b ^ c ^ d, 0xCA62C1D6);
+
+#undef SHA1_STEP
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+
+        data += 64;
+    }
+}
+
+#ifdef SHA1_HAVE_X86
+
+/*
+ * Four rounds of the SHA-NI schedule. Group i consumes message word m0 and
+ * advances the schedule of the following groups; updates of words that are
+ * never read again in the last groups are harmless.
+ */
+#define SHA1NI_ROUND4(f, en, eo, m0, m1, m2, m3)    \
+    do {                                            \
+        en = _mm_sha1nexte_epu32 (en, m0);          \
+        eo = abcd;                                  \
+        m1 = _mm_sha1msg2_epu32 (m1, m0);           \
+        abcd = _mm_sha1rnds4_epu32 (abcd, en, f);   \
+        m3 = _mm_sha1msg1_epu32 (m3, m0);           \
+        m2 = _mm_xor_si128 (m2, m0);                \
+    } while (0)
+
+__attribute__ ((target ("sha,sse4.1")))
+static void
+__sha1_blocks_shani__ (uint32_t state[5], const unsigned char *data,
+    size_t nblocks)
+{
+    __m128i     abcd, abcd_save, e0, e0_save, e1;
+    __m128i     m0, m1, m2, m3;
+    const __m128i mask = _mm_set_epi64x (0x0001020304050607ULL,
+                                         0x08090a0b0c0d0e0fULL);
+
+    abcd = _mm_loadu_si128 ((const __m128i *) state);
+    abcd = _mm_shuffle_epi32 (abcd, 0x1B);
+    e0 = _mm_set_epi32 ((int) state[4], 0, 0, 0);
+
+    while (nblocks--) {
+        abcd_save = abcd;
+        e0_save = e0;
+
+        /* rounds 0-3 */
+        m0 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) data), mask);
+        e0 = _mm_add_epi32 (e0, m0);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32 (abcd, e0, 0);
+
+        /* rounds 4-7 */
+        m1 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) (data + 16)),
+                               mask);
+        e1 = _mm_sha1nexte_epu32 (e1, m1);
+        e0 = abcd;
+        abcd = _mm_sha1rnds4_epu32 (abcd, e1, 0);
+        m0 = _mm_sha1msg1_epu32 (m0, m1);
+
+        /* rounds 8-11 */
+        m2 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) (data + 32)),
+                               mask);
+        e0 = _mm_sha1nexte_epu32 (e0, m2);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32 (abcd, e0, 0);
+        m1 = _mm_sha1msg1_epu32 (m1, m2);
+        m0 = _mm_xor_si128 (m0, m2);
+
+        /* rounds 12-15 */
+        m3 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) (data + 48)),
+                               mask);
+        e1 = _mm_sha1nexte_epu32 (e1, m3);
+        e0 = abcd;
+        m0 = _mm_sha1msg2_epu32 (m0, m3);
+        abcd = _mm_sha1rnds4_epu32 (abcd, e1, 0);
+        m2 = _mm_sha1msg1_epu32 (m2, m3);
+        m1 = _mm_xor_si128 (m1, m3);
+
+        /* rounds 16-79 */
+        SHA1NI_ROUND4 (0, e0, e1, m0, m1, m2, m3);
+        SHA1NI_ROUND4 (1, e1, e0, m1, m2, m3, m0);
+        SHA1NI_ROUND4 (1, e0, e1, m2, m3, m0, m1);
+        SHA1NI_ROUND4 (1, e1, e0, m3, m0, m1, m2);
+        SHA1NI_ROUND4 (1, e0, e1, m0, m1, m2, m3);
+        SHA1NI_ROUND4 (1, e1, e0, m1, m2, m3, m0);
+        SHA1NI_ROUND4 (2, e0, e1, m2, m3, m0, m1);
+        SHA1NI_ROUND4 (2, e1, e0, m3, m0, m1, m2);
+        SHA1NI_ROUND4 (2, e0, e1, m0, m1, m2, m3);
+        SHA1NI_ROUND4 (2, e1, e0, m1, m2, m3, m0);
+        SHA1NI_ROUND4 (2, e0, e1, m2, m3, m0, m1);
+        SHA1NI_ROUND4 (3, e1, e0, m3, m0, m1, m2);
+        SHA1NI_ROUND4 (3, e0, e1, m0, m1, m2, m3);
+        SHA1NI_ROUND4 (3, e1, e0, m1, m2, m3, m0);
+        SHA1NI_ROUND4 (3, e0, e1, m2, m3, m0, m1);
+        SHA1NI_ROUND4 (3, e1, e0, m3, m0, m1, m2);
+
+        e0 = _mm_sha1nexte_epu32 (e0, e0_save);
+        abcd = _mm_add_epi32 (abcd, abcd_save);
+
+        data += 64;
+    }
+
+    abcd = _mm_shuffle_epi32 (abcd, 0x1B);
+    _mm_storeu_si128 ((__m128i *) state, abcd);
+    state[4] = (uint32_t) _mm_extract_epi32 (e0, 3);
+}
+
+#endif /* SHA1_HAVE_X86 */
+
+static void
+__sha1_select__ (void)
+{
+#ifdef SHA1_HAVE_X86
+    unsigned int    eax, ebx, ecx, edx;
+    int             sse41 = 0, sha = 0;
+
+    if (__get_cpuid (1, &eax, &ebx, &ecx, &edx))
+        sse41 = (ecx & bit_SSE4_1) != 0;
+    if (__get_cpuid_count (7, 0, &eax, &ebx, &ecx, &edx))
+        sha = (ebx & bit_SHA) != 0;
+
+    if (sse41 && sha && getenv ("GITHACK_NO_SHANI") == NULL) {
+        sha1_blocks = __sha1_blocks_shani__;
+        sha1_name = "sha-ni";
+    }
+#endif
+}
+
+const char *
+sha1_impl (void)
+{
+    pthread_once (&sha1_once, __sha1_select__);
+    return sha1_name;
+}
+
+void
+sha1_init (sha1_ctx *ctx)
+{
+    pthread_once (&sha1_once, __sha1_select__);
+
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xEFCDAB89;
+    ctx->state[2] = 0x98BADCFE;
+    ctx->state[3] = 0x10325476;
+    ctx->state[4] = 0xC3D2E1F0;
+    ctx->count = 0;
+}
+
+void
+sha1_update (sha1_ctx *ctx, const void *vdata, size_t len)
+{
+    const unsigned char *data = vdata;
+    size_t               used, fill;
+
+    used = (size_t) (ctx->count & 63);
+    ctx->count += len;
+
+    if (used) {
+        fill = 64 - used;
+        if (len < fill) {
+            memcpy (ctx->buffer + used, data, len);
+            return;
+        }
+        memcpy (ctx->buffer + used, data, fill);
+        sha1_blocks (ctx->state, ctx->buffer, 1);
+        data += fill;
+        len -= fill;
+    }
+
+    if (len >= 64) {
+        sha1_blocks (ctx->state, data, len / 64);
+        data += len & ~(size_t) 63;
+        len &= 63;
+    }
+
+    if (len)
+        memcpy (ctx->buffer, data, len);
+}
+
+void
+sha1_final (sha1_ctx *ctx, unsigned char digest[SHA1_DIGEST_LEN])
+{
+    unsigned char   pad[72];
+    uint64_t        bits;
+    size_t          used, padlen;
+    int             i;
+
+    bits = ctx->count << 3;
+    used = (size_t) (ctx->count & 63);
+    padlen = used < 56 ? 56 - used : 120 - used;
+
+    memset (pad, 0, sizeof (pad));
+    pad[0] = 0x80;
+    for (i = 0; i < 8; i++)
+        pad[padlen + i] = (unsigned char) (bits >> (56 - 8 * i));
+    sha1_update (ctx, pad, padlen + 8);
+
+    for (i = 0; i < 5; i++) {
+        digest[i * 4]     = (unsigned char) (ctx->state[i] >> 24);
+        digest[i * 4 + 1] = (unsigned char) (ctx->state[i] >> 16);
+        digest[i * 4 + 2] = (unsigned char) (ctx->state[i] >> 8);
+        digest[i * 4 + 3] = (unsigned char) ctx->state[i];
+    }
+}
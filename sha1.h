@@ -0,0 +1,25 @@
+#ifndef SHA1_H
+#define SHA1_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA1_DIGEST_LEN 20
+
+typedef struct
+{
+    uint32_t        state[5];
+    uint64_t        count;          /* total bytes hashed */
+    unsigned char   buffer[64];
+} sha1_ctx;
+
+void sha1_init (sha1_ctx *ctx);
+
+void sha1_update (sha1_ctx *ctx, const void *data, size_t len);
+
+void sha1_final (sha1_ctx *ctx, unsigned char digest[SHA1_DIGEST_LEN]);
+
+/* name of the block function picked for this cpu, "sha-ni" or "generic" */
+const char *sha1_impl (void);
+
+#endif /* SHA1_H */
@@ -0,0 +1,382 @@
+#include "githack.h"
+#include "shard.h"
+
+typedef enum
+{
+    SHARD_QUEUED,
+    SHARD_ASSIGNED,
+    SHARD_DONE
+} shard_state_t;
+
+typedef struct
+{
+    pid_t           pid;        /* 0 once reaped */
+    int             fd;
+    char           *buf;        /* partial line read so far */
+    size_t          len;
+    int             assigned;
+    int             cancelling; /* item asked back, -1 if none */
+    long            progress;
+    long            progress_at;
+    bool            quit_sent;
+    bool            ended;      /* sent "end", its exit is no crash */
+    bool            killed;
+} shard_worker_t;
+
+typedef struct
+{
+    shard_item_t       *items;
+    int                 count;
+    int                *queue;      /* item ids to hand out, taken from the end */
+    int                 queued;
+    int                 next;       /* items below were queued once already */
+    int                 finished;
+    int                 failed;
+    long                seq;
+    shard_worker_t     *workers;
+    int                 nworkers;
+    shard_worker_fn     worker_fn;
+    shard_stats_fn      stats_fn;
+} shard_t;
+
+static int __shard_spawn__ (shard_t *sh, int w);
+static void __shard_send__ (shard_worker_t *worker, const char *fmt, ...);
+static int __shard_take__ (shard_t *sh);
+static void __shard_dispatch__ (shard_t *sh, long ahead);
+static void __shard_steal__ (shard_t *sh);
+static void __shard_line__ (shard_t *sh, int w, char *line);
+static void __shard_reap__ (shard_t *sh, int w);
+
+/* forks worker w; the child only keeps its own end of its socket */
+static int
+__shard_spawn__ (shard_t *sh, int w)
+{
+    shard_worker_t *worker = &sh->workers[w];
+    int             sv[2], i;
+    pid_t           pid;
+
+    if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1)
+        return -1;
+    /* or the child prints what is buffered once more */
+    fflush (stdout);
+    fflush (stderr);
+
+    if ((pid = fork ()) == -1) {
+        close (sv[0]);
+        close (sv[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close (sv[0]);
+        for (i = 0; i < sh->nworkers; i++) {
+            if (i != w && sh->workers[i].pid != 0)
+                close (sh->workers[i].fd);
+        }
+        exit (sh->worker_fn (sv[1]));
+    }
+
+    close (sv[1]);
+    worker->pid = pid;
+    worker->fd = sv[0];
+    worker->len = 0;
+    worker->assigned = 0;
+    worker->cancelling = -1;
+    worker->progress = 0;
+    worker->progress_at = stats_now_us ();
+    worker->quit_sent = false;
+    worker->ended = false;
+    worker->killed = false;
+    return 0;
+}
+
+/* a dead worker shows up as EOF on its socket, not as an error here */
+static void
+__shard_send__ (shard_worker_t *worker, const char *fmt, ...)
+{
+    char        line[SHARD_LINE_MAX];
+    va_list     ap;
+    int         len;
+
+    va_start (ap, fmt);
+    len = vsnprintf (line, sizeof (line), fmt, ap);
+    va_end (ap);
+    if (len > 0 && len < (int) sizeof (line))
+        writen (worker->fd, line, len);
+}
+
+/* next item to hand out, -1 if none; items given back go first */
+static int
+__shard_take__ (shard_t *sh)
+{
+    if (sh->queued > 0)
+        return sh->queue[--sh->queued];
+    if (sh->next < sh->count)
+        return sh->next++;
+    return -1;
+}
+
+/* one target per worker in turn, so a short list is shared evenly */
+static void
+__shard_dispatch__ (shard_t *sh, long ahead)
+{
+    shard_worker_t *worker;
+    shard_item_t   *item;
+    int             w, id;
+    bool            sent;
+
+    do {
+        sent = false;
+        for (w = 0; w < sh->nworkers; w++) {
+            worker = &sh->workers[w];
+            if (worker->pid == 0 || worker->quit_sent || worker->assigned >= ahead)
+                continue;
+            if ((id = __shard_take__ (sh)) == -1)
+                return;
+            item = &sh->items[id];
+            item->state = SHARD_ASSIGNED;
+            item->worker = w;
+            item->seq = sh->seq++;
+            worker->assigned++;
+            __shard_send__ (worker, "target %d %s\n", id, item->url);
+            sent = true;
+        }
+    } while (sent);
+}
+
+/*
+ * With nothing left to hand out, an idle worker takes over the newest
+ * target of the busiest one, if that one hasn't started on it yet.
+ */
+static void
+__shard_steal__ (shard_t *sh)
+{
+    shard_worker_t *victim = NULL;
+    shard_item_t   *item;
+    int             w, id, best = -1;
+    bool            idle = false;
+
+    if (sh->queued > 0 || sh->next < sh->count)
+        return;
+    for (w = 0; w < sh->nworkers; w++) {
+        if (sh->workers[w].pid == 0 || sh->workers[w].quit_sent)
+            continue;
+        if (sh->workers[w].assigned == 0)
+            idle = true;
+        /* the one target it has is most likely running */
+        if (sh->workers[w].assigned > 1 && sh->workers[w].cancelling == -1
+            && (victim == NULL || sh->workers[w].assigned > victim->assigned))
+            victim = &sh->workers[w];
+    }
+    if (!idle || victim == NULL)
+        return;
+
+    for (id = 0; id < sh->count; id++) {
+        item = &sh->items[id];
+        if (item->state == SHARD_ASSIGNED && &sh->workers[item->worker] == victim
+            && !item->cancel_tried && (best == -1 || item->seq > sh->items[best].seq))
+            best = id;
+    }
+    if (best == -1)
+        return;
+    sh->items[best].cancel_tried = true;
+    victim->cancelling = best;
+    __shard_send__ (victim, "cancel %d\n", best);
+}
+
+static void
+__shard_line__ (shard_t *sh, int w, char *line)
+{
+    shard_worker_t *worker = &sh->workers[w];
+    shard_item_t   *item;
+    long            n;
+    int             id;
+
+    if (sscanf (line, "done %d", &id) == 1 || sscanf (line, "cancelled %d", &id) == 1) {
+        if (id < 0 || id >= sh->count || sh->items[id].state != SHARD_ASSIGNED
+            || sh->items[id].worker != w)
+            return;
+        item = &sh->items[id];
+        worker->assigned--;
+        if (worker->cancelling == id)
+            worker->cancelling = -1;
+        if (line[0] == 'd') {
+            item->state = SHARD_DONE;
+            sh->finished++;
+        } else {
+            item->state = SHARD_QUEUED;
+            sh->queue[sh->queued++] = id;
+        }
+        worker->progress_at = stats_now_us ();
+    } else if (sscanf (line, "created %d", &id) == 1) {
+        if (id >= 0 && id < sh->count && sh->items[id].worker == w)
+            sh->items[id].created = true;
+    } else if (sscanf (line, "progress %ld", &n) == 1) {
+        if (n != worker->progress) {
+            worker->progress = n;
+            worker->progress_at = stats_now_us ();
+        }
+    } else if (strcmp (line, "end") == 0) {
+        worker->ended = true;
+    } else {
+        sh->stats_fn (line);
+    }
+}
+
+/* worker w is gone; what it held goes back to the queue or fails */
+static void
+__shard_reap__ (shard_t *sh, int w)
+{
+    shard_worker_t *worker = &sh->workers[w];
+    shard_item_t   *item;
+    int             status = 0, id;
+
+    close (worker->fd);
+    waitpid (worker->pid, &status, 0);
+    worker->pid = 0;
+    if (worker->ended && WIFEXITED (status))
+        return;
+
+    fprintf (stderr, "worker %d %s, taking back its %d targets\n", w,
+             worker->killed ? "stalled and was killed" : "died",
+             worker->assigned);
+    for (id = 0; id < sh->count; id++) {
+        item = &sh->items[id];
+        if (item->state != SHARD_ASSIGNED || item->worker != w)
+            continue;
+        /* half written; never one that was there before */
+        if (item->created)
+            force_rm_dir (item->dir);
+        item->created = false;
+        if (++item->tries >= SHARD_TRIES) {
+            printf ("scan: %s error=\"worker crashed\"\n", item->url);
+            item->state = SHARD_DONE;
+            sh->finished++;
+            sh->failed++;
+        } else {
+            item->state = SHARD_QUEUED;
+            item->cancel_tried = false;
+            sh->queue[sh->queued++] = id;
+        }
+    }
+    fflush (stdout);
+    worker->assigned = 0;
+
+    if ((sh->queued > 0 || sh->next < sh->count) && __shard_spawn__ (sh, w) == -1)
+        perror ("respawn worker");
+}
+
+/*
+ * Scans items with a number of forked worker processes, each handed up
+ * to ahead targets at a time. Call it before any thread is started. Returns the
+ * number of targets that failed for want of a worker that survives them.
+ */
+int
+shard_run (shard_item_t *items, int count, int workers, int ahead,
+    long stall_ms, shard_worker_fn worker_fn, shard_stats_fn stats_fn)
+{
+    shard_t          sh;
+    shard_worker_t  *worker;
+    struct pollfd   *fds;
+    int             *owner;
+    char            *nl, *line;
+    ssize_t          n;
+    long             now;
+    int              w, i, nfds, alive;
+
+    memset (&sh, 0, sizeof (sh));
+    sh.items = items;
+    sh.count = count;
+    sh.queue = (int *) malloc (count * sizeof (int));
+    sh.nworkers = workers;
+    sh.workers = (shard_worker_t *) calloc (workers, sizeof (shard_worker_t));
+    sh.worker_fn = worker_fn;
+    sh.stats_fn = stats_fn;
+    fds = (struct pollfd *) malloc (workers * sizeof (struct pollfd));
+    owner = (int *) malloc (workers * sizeof (int));
+    for (i = 0; i < count; i++) {
+        items[i].state = SHARD_QUEUED;
+        items[i].tries = 0;
+        items[i].cancel_tried = false;
+        items[i].created = false;
+    }
+    /* a worker that died lets go of the socket, it must not kill us */
+    signal (SIGPIPE, SIG_IGN);
+
+    for (w = 0; w < workers; w++) {
+        sh.workers[w].buf = (char *) malloc (SHARD_LINE_MAX);
+        if (__shard_spawn__ (&sh, w) == -1)
+            perror ("fork worker");
+    }
+
+    for (;;) {
+        __shard_dispatch__ (&sh, ahead);
+        __shard_steal__ (&sh);
+
+        nfds = alive = 0;
+        now = stats_now_us ();
+        for (w = 0; w < workers; w++) {
+            worker = &sh.workers[w];
+            if (worker->pid == 0)
+                continue;
+            alive++;
+            if (sh.finished == count && !worker->quit_sent) {
+                __shard_send__ (worker, "quit\n");
+                worker->quit_sent = true;
+            }
+            if (worker->assigned > 0 && !worker->killed
+                && now - worker->progress_at > stall_ms * 1000L) {
+                kill (worker->pid, SIGKILL);
+                worker->killed = true;
+            }
+            fds[nfds].fd = worker->fd;
+            fds[nfds].events = POLLIN;
+            owner[nfds++] = w;
+        }
+        if (alive == 0)
+            break;
+
+        if (poll (fds, nfds, 1000) == -1 && errno != EINTR)
+            break;
+        for (i = 0; i < nfds; i++) {
+            if (fds[i].revents == 0)
+                continue;
+            worker = &sh.workers[owner[i]];
+            n = read (worker->fd, worker->buf + worker->len,
+                      SHARD_LINE_MAX - 1 - worker->len);
+            if (n <= 0) {
+                if (n == -1 && errno == EINTR)
+                    continue;
+                __shard_reap__ (&sh, owner[i]);
+                continue;
+            }
+            worker->len += n;
+            worker->buf[worker->len] = '\0';
+            line = worker->buf;
+            while ((nl = strchr (line, '\n')) != NULL) {
+                *nl = '\0';
+                __shard_line__ (&sh, owner[i], line);
+                line = nl + 1;
+            }
+            worker->len -= line - worker->buf;
+            memmove (worker->buf, line, worker->len);
+            /* a line that long is garbage, drop it */
+            if (worker->len == SHARD_LINE_MAX - 1)
+                worker->len = 0;
+        }
+    }
+
+    /* what no worker was left to scan */
+    for (i = 0; i < count; i++) {
+        if (items[i].state != SHARD_DONE) {
+            printf ("scan: %s error=\"no worker left\"\n", items[i].url);
+            sh.failed++;
+        }
+    }
+    for (w = 0; w < workers; w++)
+        free (sh.workers[w].buf);
+    free (sh.workers);
+    free (sh.queue);
+    free (fds);
+    free (owner);
+    return sh.failed;
+}
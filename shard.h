@@ -0,0 +1,51 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <sys/types.h>
+
+/*
+ * Coordinator of a scan spread over forked worker processes. Each worker
+ * gets one end of a Unix socketpair and targets a few at a time, more as
+ * it reports them done, so a slow worker is simply handed less. Lines go
+ * back and forth:
+ *
+ *   to a worker     target <id> <url>   scan it
+ *                   cancel <id>         give it back unless it started
+ *                   quit                finish what you have and exit
+ *   to the parent   created <id>        made its output directory
+ *                   done <id>
+ *                   cancelled <id>
+ *                   progress <n>        every second, n entries finished
+ *                   end                 after the last stats line
+ *
+ * Anything else a worker sends is stats, handed to the caller as is. A
+ * worker that dies, or makes no progress for stall_ms while it holds
+ * targets, is killed and its targets are handed out again, each up to
+ * SHARD_TRIES times; a directory a crashed worker created is removed
+ * first. Idle workers take targets a busy one hasn't started.
+ */
+
+#define SHARD_TRIES     2
+#define SHARD_LINE_MAX  65536
+
+typedef struct
+{
+    const char     *url;
+    const char     *dir;        /* output, removed before a retry */
+    int             state;      /* used by the coordinator */
+    int             worker;     /* used by the coordinator */
+    int             tries;      /* used by the coordinator */
+    int             cancel_tried;   /* used by the coordinator */
+    int             created;    /* used by the coordinator */
+    long            seq;        /* used by the coordinator */
+} shard_item_t;
+
+/* runs in the forked child on its end of the socket, returns the exit code */
+typedef int (*shard_worker_fn) (int fd);
+
+typedef void (*shard_stats_fn) (const char *line);
+
+int shard_run (shard_item_t *items, int count, int workers, int ahead,
+    long stall_ms, shard_worker_fn worker, shard_stats_fn stats);
+
+#endif /* SHARD_H */
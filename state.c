@@ -0,0 +1,304 @@
+#include "state.h"
+
+static size_t __hash_path__ (const char *path);
+static void __manifest_insert__ (manifest_t mf, char *path,
+    const unsigned char *sha1, size_t size);
+static int __unhex__ (const char *hex, unsigned char *out, int len);
+
+/* FNV-1a */
+static size_t
+__hash_path__ (const char *path)
+{
+    size_t  h = 14695981039346656037ULL;
+
+    while (*path) {
+        h ^= (unsigned char) *path++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static int
+__unhex__ (const char *hex, unsigned char *out, int len)
+{
+    int     i, hi, lo;
+
+    for (i = 0; i < len; i++) {
+        hi = isdigit (hex[2 * i]) ? hex[2 * i] - '0' : tolower (hex[2 * i]) - 'a' + 10;
+        lo = isdigit (hex[2 * i + 1]) ? hex[2 * i + 1] - '0' : tolower (hex[2 * i + 1]) - 'a' + 10;
+        if (hi < 0 || hi > 15 || lo < 0 || lo > 15)
+            return -1;
+        out[i] = (unsigned char) (hi << 4 | lo);
+    }
+    return 0;
+}
+
+static void
+__manifest_insert__ (manifest_t mf, char *path, const unsigned char *sha1,
+    size_t size)
+{
+    manifest_entry  *old;
+    size_t           i, oldmask;
+
+    /* keep the load factor under one half */
+    if ((mf->count + 1) * 2 > mf->mask + 1) {
+        old = mf->slots;
+        oldmask = mf->mask;
+        mf->mask = mf->slots ? mf->mask * 2 + 1 : 1023;
+        mf->slots = (manifest_entry *) calloc (mf->mask + 1, sizeof (manifest_entry));
+        mf->count = 0;
+        if (old) {
+            for (i = 0; i <= oldmask; i++) {
+                if (old[i].path)
+                    __manifest_insert__ (mf, old[i].path, old[i].sha1, old[i].size);
+            }
+            free (old);
+        }
+    }
+
+    for (i = __hash_path__ (path) & mf->mask; mf->slots[i].path;
+         i = (i + 1) & mf->mask) {
+        if (strcmp (mf->slots[i].path, path) == 0) {
+            free (mf->slots[i].path);
+            break;
+        }
+    }
+    if (mf->slots[i].path == NULL)
+        mf->count++;
+    mf->slots[i].path = path;
+    memcpy (mf->slots[i].sha1, sha1, 20);
+    mf->slots[i].size = size;
+    mf->slots[i].seen = false;
+}
+
+manifest_t
+manifest_load (const char *filename)
+{
+    FILE            *file;
+    manifest_t       mf;
+    unsigned char    sha1[20];
+    char             line[BUFFER_SIZE * 10];
+    char            *size_end;
+    size_t           len, size;
+
+    if ((file = fopen (filename, "r")) == NULL)
+        return NULL;
+
+    mf = (manifest_t) calloc (1, sizeof (manifest));
+
+    /* "<sha1 hex> <size> <path>\n" */
+    while (fgets (line, sizeof (line), file) != NULL) {
+        len = strlen (line);
+        if (len < 44 || line[len - 1] != '\n' || line[40] != ' ')
+            continue;
+        line[len - 1] = '\0';
+        if (__unhex__ (line, sha1, 20) == -1)
+            continue;
+        size = strtoul (line + 41, &size_end, 10);
+        if (*size_end != ' ' || size_end[1] == '\0')
+            continue;
+        __manifest_insert__ (mf, strdup (size_end + 1), sha1, size);
+    }
+
+    fclose (file);
+    return mf;
+}
+
+manifest_entry_t
+manifest_find (manifest_t mf, const char *path)
+{
+    size_t  i;
+
+    if (mf == NULL || mf->slots == NULL)
+        return NULL;
+
+    for (i = __hash_path__ (path) & mf->mask; mf->slots[i].path;
+         i = (i + 1) & mf->mask) {
+        if (strcmp (mf->slots[i].path, path) == 0)
+            return &mf->slots[i];
+    }
+    return NULL;
+}
+
+/* record every entry that is now on disk and verified */
+int
+manifest_save (const char *filename, ce_body_t *entries, int ent_num)
+{
+    FILE    *file;
+    char    *hex_name;
+    char     tmp[BUFFER_SIZE];
+    int      j, ret = 0;
+
+    if (create_dir (STATE_DIR) == -1)
+        return -1;
+
+    snprintf (tmp, BUFFER_SIZE, "%s.tmp", filename);
+    if ((file = fopen (tmp, "w")) == NULL)
+        return -1;
+
+    for (j = 0; j < ent_num; j++) {
+        if (entries[j]->status != BLOB_OK)
+            continue;
+        hex_name = sha12hex (entries[j]->entry_body->sha1);
+        fprintf (file, "%s %d %s\n", hex_name,
+                 hex2dec (entries[j]->entry_body->size, 4), entries[j]->name);
+        free (hex_name);
+    }
+
+    if (fclose (file) != 0 || rename (tmp, filename) == -1) {
+        unlink (tmp);
+        ret = -1;
+    }
+    return ret;
+}
+
+/* delete files of the previous run that left the index */
+int
+manifest_remove_unseen (manifest_t mf)
+{
+    size_t  i;
+    int     removed = 0;
+
+    if (mf == NULL || mf->slots == NULL)
+        return 0;
+
+    for (i = 0; i <= mf->mask; i++) {
+        if (mf->slots[i].path == NULL || mf->slots[i].seen)
+            continue;
+        if (unlink (mf->slots[i].path) == 0 || errno == ENOENT) {
+            printf ("%s " ESC "[36m[DELETED]" ESC "[0m\n", mf->slots[i].path);
+            removed++;
+        }
+    }
+    return removed;
+}
+
+void
+manifest_free (manifest_t mf)
+{
+    size_t  i;
+
+    if (mf == NULL)
+        return;
+
+    if (mf->slots) {
+        for (i = 0; i <= mf->mask; i++)
+            free (mf->slots[i].path);
+        free (mf->slots);
+    }
+    free (mf);
+}
+
+validator_t
+validators_load (const char *filename)
+{
+    FILE        *file;
+    validator_t  list = NULL;
+    char         line[BUFFER_SIZE * 4];
+    char        *url, *etag, *last_modified;
+
+    if ((file = fopen (filename, "r")) == NULL)
+        return NULL;
+
+    /* "<url>\t<etag>\t<last-modified>\n", "-" when absent */
+    while (fgets (line, sizeof (line), file) != NULL) {
+        line[strcspn (line, "\n")] = '\0';
+        url = strtok (line, "\t");
+        etag = strtok (NULL, "\t");
+        last_modified = strtok (NULL, "\t");
+        if (url == NULL || etag == NULL || last_modified == NULL)
+            continue;
+        validator_set (&list, url,
+                       strcmp (etag, "-") ? etag : NULL,
+                       strcmp (last_modified, "-") ? last_modified : NULL);
+    }
+
+    fclose (file);
+    return list;
+}
+
+validator_t
+validator_find (validator_t list, const char *url)
+{
+    for (; list != NULL; list = list->next) {
+        if (strcmp (list->url, url) == 0)
+            return list;
+    }
+    return NULL;
+}
+
+void
+validator_set (validator_t *list, const char *url, const char *etag,
+    const char *last_modified)
+{
+    validator_t  v;
+
+    if ((v = validator_find (*list, url)) == NULL) {
+        v = (validator_t) calloc (1, sizeof (validator));
+        v->url = strdup (url);
+        v->next = *list;
+        *list = v;
+    }
+
+    free (v->etag);
+    free (v->last_modified);
+    v->etag = etag ? strdup (etag) : NULL;
+    v->last_modified = last_modified ? strdup (last_modified) : NULL;
+}
+
+/* request headers for a conditional GET, NULL when nothing is known */
+http_hdr_t *
+validator_headers (validator_t v)
+{
+    http_hdr_t  *header = NULL;
+
+    if (v == NULL)
+        return NULL;
+    if (v->etag)
+        http_add_header (&header, "If-None-Match", v->etag);
+    if (v->last_modified)
+        http_add_header (&header, "If-Modified-Since", v->last_modified);
+    return header;
+}
+
+int
+validators_save (const char *filename, validator_t list)
+{
+    FILE    *file;
+    char     tmp[BUFFER_SIZE];
+
+    if (create_dir (STATE_DIR) == -1)
+        return -1;
+
+    snprintf (tmp, BUFFER_SIZE, "%s.tmp", filename);
+    if ((file = fopen (tmp, "w")) == NULL)
+        return -1;
+
+    for (; list != NULL; list = list->next) {
+        if (list->etag == NULL && list->last_modified == NULL)
+            continue;
+        fprintf (file, "%s\t%s\t%s\n", list->url,
+                 list->etag ? list->etag : "-",
+                 list->last_modified ? list->last_modified : "-");
+    }
+
+    if (fclose (file) != 0 || rename (tmp, filename) == -1) {
+        unlink (tmp);
+        return -1;
+    }
+    return 0;
+}
+
+void
+validators_free (validator_t list)
+{
+    validator_t  next;
+
+    for (; list != NULL; list = next) {
+        next = list->next;
+        free (list->url);
+        free (list->etag);
+        free (list->last_modified);
+        free (list);
+    }
+}
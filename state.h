@@ -0,0 +1,62 @@
+#ifndef STATE_H
+#define STATE_H
+
+#include "githack.h"
+
+/*
+ * What the previous run left on disk, kept in <output>/.githack/ so that a
+ * re-scan only fetches what changed.
+ */
+
+#define STATE_DIR       ".githack"
+#define STATE_MANIFEST  STATE_DIR "/manifest"
+#define STATE_VALIDATORS STATE_DIR "/validators"
+
+typedef struct
+{
+    char           *path;
+    unsigned char   sha1[20];
+    size_t          size;
+    bool            seen;
+} manifest_entry, *manifest_entry_t;
+
+typedef struct
+{
+    manifest_entry *slots;
+    size_t          mask;       /* slot count - 1, a power of two */
+    size_t          count;
+} manifest, *manifest_t;
+
+/* cache validators of a metadata url, for conditional requests */
+typedef struct validator
+{
+    char               *url;
+    char               *etag;
+    char               *last_modified;
+    struct validator   *next;
+} validator, *validator_t;
+
+manifest_t manifest_load (const char *filename);
+
+manifest_entry_t manifest_find (manifest_t mf, const char *path);
+
+int manifest_save (const char *filename, ce_body_t *entries, int ent_num);
+
+int manifest_remove_unseen (manifest_t mf);
+
+void manifest_free (manifest_t mf);
+
+validator_t validators_load (const char *filename);
+
+validator_t validator_find (validator_t list, const char *url);
+
+void validator_set (validator_t *list, const char *url, const char *etag,
+    const char *last_modified);
+
+http_hdr_t *validator_headers (validator_t v);
+
+int validators_save (const char *filename, validator_t list);
+
+void validators_free (validator_t list);
+
+#endif /* STATE_H */
@@ -0,0 +1,194 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+static int __bucket_of__ (long value);
+static long __bucket_top__ (int bucket);
+
+static int
+__bucket_of__ (long value)
+{
+    int     shift;
+
+    if (value < STATS_SUB_BUCKETS)
+        return value < 0 ? 0 : (int) value;
+
+    shift = 63 - __builtin_clzl ((unsigned long) value) - STATS_SUB_BITS;
+    return (shift + 1) * STATS_SUB_BUCKETS
+           + (int) ((value >> shift) & (STATS_SUB_BUCKETS - 1));
+}
+
+/* largest value that lands in the bucket */
+static long
+__bucket_top__ (int bucket)
+{
+    int     shift;
+    long    sub;
+
+    if (bucket < STATS_SUB_BUCKETS)
+        return bucket;
+
+    shift = bucket / STATS_SUB_BUCKETS - 1;
+    sub = bucket % STATS_SUB_BUCKETS;
+    return ((STATS_SUB_BUCKETS + sub) << shift) + (1L << shift) - 1;
+}
+
+long
+stats_now_us (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+void
+stats_record (stats_hist_t *hist, long value)
+{
+    long    max;
+
+    __sync_fetch_and_add (&hist->counts[__bucket_of__ (value)], 1);
+    __sync_fetch_and_add (&hist->count, 1);
+    __sync_fetch_and_add (&hist->sum, value);
+    while ((max = hist->max) < value
+           && !__sync_bool_compare_and_swap (&hist->max, max, value))
+        ;
+}
+
+/* for a histogram no other thread writes to */
+void
+stats_record_local (stats_hist_t *hist, long value)
+{
+    hist->counts[__bucket_of__ (value)]++;
+    hist->count++;
+    hist->sum += value;
+    if (hist->max < value)
+        hist->max = value;
+}
+
+/* add hist into into, which nobody else may be writing */
+void
+stats_merge (stats_hist_t *into, stats_hist_t *hist)
+{
+    int     i;
+
+    for (i = 0; i < STATS_BUCKETS; i++)
+        into->counts[i] += hist->counts[i];
+    into->count += hist->count;
+    into->sum += hist->sum;
+    if (into->max < hist->max)
+        into->max = hist->max;
+}
+
+long
+stats_count (stats_hist_t *hist)
+{
+    return hist->count;
+}
+
+/* upper bound of the bucket holding the pct-th percentile, 0 when empty */
+long
+stats_percentile (stats_hist_t *hist, double pct)
+{
+    long    total = 0, rank, seen = 0;
+    int     i;
+
+    /* counts may move under us, rank against what is actually summed */
+    for (i = 0; i < STATS_BUCKETS; i++)
+        total += hist->counts[i];
+    if (total == 0)
+        return 0;
+
+    rank = (long) (pct / 100.0 * total + 0.5);
+    if (rank < 1)
+        rank = 1;
+    for (i = 0; i < STATS_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= rank)
+            break;
+    }
+    if (i == STATS_BUCKETS)
+        i--;
+    return __bucket_top__ (i) < hist->max ? __bucket_top__ (i) : hist->max;
+}
+
+long
+stats_max (stats_hist_t *hist)
+{
+    return hist->max;
+}
+
+/* {"count": .., "mean": .., "p50": .., "p90": .., "p99": .., "p999": .., "max": ..} */
+void
+stats_json (FILE *out, stats_hist_t *hist)
+{
+    long    count = hist->count;
+
+    fprintf (out, "{\"count\": %ld, \"mean\": %ld, \"p50\": %ld, \"p90\": %ld, "
+             "\"p99\": %ld, \"p999\": %ld, \"max\": %ld}",
+             count, count ? hist->sum / count : 0,
+             stats_percentile (hist, 50.0), stats_percentile (hist, 90.0),
+             stats_percentile (hist, 99.0), stats_percentile (hist, 99.9),
+             stats_max (hist));
+}
+
+/*
+ * "count sum max bucket:n ..." with the buckets in use, for a histogram
+ * to cross a process boundary. Returns the length, -1 if buf is short.
+ */
+int
+stats_encode (char *buf, size_t len, stats_hist_t *hist)
+{
+    size_t  used;
+    int     i, n;
+
+    n = snprintf (buf, len, "%ld %ld %ld", hist->count, hist->sum, hist->max);
+    if (n < 0 || (size_t) n >= len)
+        return -1;
+    used = n;
+    for (i = 0; i < STATS_BUCKETS; i++) {
+        if (hist->counts[i] == 0)
+            continue;
+        n = snprintf (buf + used, len - used, " %d:%ld", i, hist->counts[i]);
+        if (n < 0 || (size_t) n >= len - used)
+            return -1;
+        used += n;
+    }
+    return (int) used;
+}
+
+/* adds what stats_encode() wrote into into, like stats_merge() */
+int
+stats_decode (const char *buf, stats_hist_t *into)
+{
+    stats_hist_t    hist;
+    char           *end;
+    long            n, count, sum, max;
+    int             i;
+
+    memset (&hist, 0, sizeof (hist));
+    if (sscanf (buf, "%ld %ld %ld", &count, &sum, &max) != 3)
+        return -1;
+    hist.count = count;
+    hist.sum = sum;
+    hist.max = max;
+    for (i = 0; i < 3; i++) {
+        while (*buf == ' ')
+            buf++;
+        buf += strcspn (buf, " ");
+    }
+    while (*buf == ' ') {
+        i = (int) strtol (buf, &end, 10);
+        if (*end != ':' || i < 0 || i >= STATS_BUCKETS)
+            return -1;
+        n = strtol (end + 1, &end, 10);
+        hist.counts[i] = n;
+        buf = end;
+    }
+    if (*buf != '\0')
+        return -1;
+    stats_merge (into, &hist);
+    return 0;
+}
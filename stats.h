@@ -0,0 +1,47 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+/*
+ * Latency histograms the worker threads update without a lock. Buckets
+ * are log-linear: every power of two is split in STATS_SUB_BUCKETS, so a
+ * percentile read back is within 1/STATS_SUB_BUCKETS of the real value.
+ * A histogram only one thread writes can use stats_record_local(), which
+ * skips the atomics; readers merge such per-thread histograms.
+ */
+
+#define STATS_SUB_BITS      3
+#define STATS_SUB_BUCKETS   (1 << STATS_SUB_BITS)
+#define STATS_BUCKETS       (64 * STATS_SUB_BUCKETS)
+
+typedef struct
+{
+    volatile long   counts[STATS_BUCKETS];
+    volatile long   count;
+    volatile long   sum;
+    volatile long   max;
+} stats_hist_t;
+
+long stats_now_us (void);
+
+void stats_record (stats_hist_t *hist, long value);
+
+void stats_record_local (stats_hist_t *hist, long value);
+
+void stats_merge (stats_hist_t *into, stats_hist_t *hist);
+
+long stats_count (stats_hist_t *hist);
+
+long stats_percentile (stats_hist_t *hist, double pct);
+
+long stats_max (stats_hist_t *hist);
+
+void stats_json (FILE *out, stats_hist_t *hist);
+
+int stats_encode (char *buf, size_t len, stats_hist_t *hist);
+
+int stats_decode (const char *buf, stats_hist_t *into);
+
+#endif /* STATS_H */
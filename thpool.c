@@ -8,15 +8,26 @@
  * 
  ********************************/
 
+#if defined(__linux__)
+/* for pthread_setaffinity_np() */
+#define _GNU_SOURCE
+#endif
 #include <unistd.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <sched.h>
 #include <errno.h>
+#include <string.h>
 #include <time.h> 
+#include <limits.h>
+#include <stdint.h>
 #if defined(__linux__)
 #include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/futex.h>
 #endif
 #include "thpool.h"
 
@@ -26,59 +37,131 @@
 #define THPOOL_DEBUG 0
 #endif
 
-static volatile int threads_keepalive;
-static volatile int threads_on_hold;
+#define DEQUE_INITIAL_SIZE 64   /* slots in a fresh worker deque, power of two */
+#define INJECT_BATCH       32   /* most jobs moved from the shared queue at once */
+#define STEAL_ATTEMPTS      2   /* rounds over random victims before sleeping */
+#define JOB_SLAB          256   /* job nodes allocated at once */
+#define JOB_CACHE          64   /* recycled nodes a thread keeps before returning them */
 
 
 
 /* ========================== STRUCTURES ============================ */
 
 
-/* Binary semaphore */
-typedef struct bsem {
-	pthread_mutex_t mutex;
-	pthread_cond_t   cond;
-	int v;
-} bsem;
+/* Job, see thpool_job in thpool.h */
+typedef struct thpool_job job;
+
 
+/* Block of job nodes, carved up onto the freelist */
+typedef struct job_slab{
+	struct job_slab* next;
+	job jobs[JOB_SLAB];
+} job_slab;
 
-/* Job */
-typedef struct job{
-	struct job*  prev;                   /* pointer to previous job   */
-	void*  (*function)(void* arg);       /* function pointer          */
-	void*  arg;                          /* function's argument       */
-} job;
+
+/* Slot of the bounded job ring */
+typedef struct ring_cell{
+	volatile unsigned long seq;          /* lap the slot is ready for */
+	job* job_p;
+} ring_cell;
 
 
-/* Job queue */
+/* Bounded multi-producer multi-consumer ring (Vyukov)
+ *
+ * A slot is claimed with one CAS on the enqueue or dequeue position,
+ * its sequence number says whether it is full or empty for that lap.
+ */
+typedef struct jobring{
+	ring_cell* cells;
+	unsigned long mask;                  /* slots - 1, a power of two */
+	volatile unsigned long enqueue_pos;
+	char pad1[64 - sizeof(long)];
+	volatile unsigned long dequeue_pos;
+	char pad2[64 - sizeof(long)];
+	pthread_mutex_t room_lock;
+	pthread_cond_t  has_room;            /* wakes blocked producers   */
+	volatile int num_producers_waiting;
+} jobring;
+
+
+/* Job queue, where jobs added from outside the pool land */
 typedef struct jobqueue{
 	pthread_mutex_t rwmutex;             /* used for queue r/w access */
 	job  *front;                         /* pointer to front of queue */
 	job  *rear;                          /* pointer to rear  of queue */
-	bsem *has_jobs;                      /* flag as binary semaphore  */
-	int   len;                           /* number of jobs in queue   */
+	volatile int len;                    /* number of jobs in queue   */
+	jobring* ring;                       /* used instead of the list when bounded */
+	job** heap;                          /* used instead of the list on a priority pool */
+	int   heap_size;                     /* slots allocated in heap   */
+	unsigned long seq;                   /* arrival order, breaks priority ties */
 } jobqueue;
 
 
+/* Ring buffer behind a deque, replaced by one twice the size when full */
+typedef struct deque_array{
+	long size;                           /* slots, a power of two     */
+	struct deque_array* retired;         /* smaller arrays it replaced */
+	job* buf[];
+} deque_array;
+
+
+/* Chase-Lev work-stealing deque
+ *
+ * The owning thread pushes and takes at the bottom without locking,
+ * other threads steal from the top with one compare-and-swap.
+ */
+typedef struct deque{
+	volatile long top;                   /* next job to steal         */
+	char pad[64 - sizeof(long)];         /* keep thieves off bottom's line */
+	volatile long bottom;                /* next free slot            */
+	deque_array* volatile array;
+} deque;
+
+
 /* Thread */
 typedef struct thread{
 	int       id;                        /* friendly id               */
 	pthread_t pthread;                   /* pointer to actual thread  */
 	struct thpool_* thpool_p;            /* access to thpool          */
+	deque     jobs;                      /* jobs this thread runs or gives away */
+	unsigned int seed;                   /* for picking steal victims */
+	job*      free_jobs;                 /* recycled nodes, linked by prev */
+	int       num_free_jobs;
+	volatile int busy;                   /* running a job             */
+	volatile long jobs_done;             /* statistics, only this thread writes them */
+	volatile long jobs_stolen;
+	stats_hist_t wait;
+	stats_hist_t run;
 } thread;
 
 
 /* Threadpool */
 typedef struct thpool_{
 	thread**   threads;                  /* pointer to threads        */
+	int        num_threads;              /* threads created           */
 	volatile int num_threads_alive;      /* threads currently alive   */
-	volatile int num_threads_working;    /* threads currently working */
+	volatile int num_threads_sleeping;   /* threads parked in thread_sleep */
+	volatile int num_threads_searching;  /* threads awake and looking for a job */
+	volatile long num_jobs_pending;      /* added and not yet finished */
+	volatile int threads_keepalive;
+	volatile int threads_on_hold;
 	pthread_mutex_t  thcount_lock;       /* used for thread count etc */
-	pthread_cond_t  threads_all_idle;    /* signal to thpool_wait     */
+	volatile int wake_seq;               /* bumped to wake sleeping threads */
+	volatile int wake_pending;           /* a woken thread has yet to get up */
+	volatile int idle_seq;               /* bumped when the last pending job finished */
+	volatile int num_waiting;            /* callers in thpool_wait    */
+	int        completion_fd;            /* eventfd, -1 until asked for */
+	job* volatile completed;             /* finished notify jobs, newest first */
 	jobqueue*  jobqueue_p;               /* pointer to the job queue  */    
+	pthread_mutex_t  free_lock;          /* used for the freelist     */
+	job*       free_jobs;                /* recycled nodes, linked by prev */
+	job_slab*  slabs;                    /* memory of every pooled node */
 } thpool_;
 
 
+/* the pool thread running on this thread, NULL elsewhere */
+static __thread struct thread* thread_self;
+
 
 
 
@@ -87,20 +170,51 @@ typedef struct thpool_{
 
 static int  thread_init(thpool_* thpool_p, struct thread** thread_p, int id);
 static void* thread_do(struct thread* thread_p);
-static void  thread_hold();
+static void  thread_hold(int sig_id);
+static job* thread_next_job(struct thread* thread_p);
+static void  thread_sleep(struct thread* thread_p);
 static void  thread_destroy(struct thread* thread_p);
 
-static int   jobqueue_init(thpool_* thpool_p);
+static int   jobqueue_init(thpool_* thpool_p, int queue_size, int priority);
 static void  jobqueue_clear(thpool_* thpool_p);
-static void  jobqueue_push(thpool_* thpool_p, struct job* newjob_p);
-static struct job* jobqueue_pull(thpool_* thpool_p);
+static void  jobqueue_push(thpool_* thpool_p, job* newjob_p);
+static job* jobqueue_pull(thpool_* thpool_p);
+static int   jobqueue_put(thpool_* thpool_p, job* first_p, int count, int block);
+static int   jobqueue_take(thpool_* thpool_p, job** batch, int max);
+static long  jobqueue_len(thpool_* thpool_p);
 static void  jobqueue_destroy(thpool_* thpool_p);
 
-static void  bsem_init(struct bsem *bsem_p, int value);
-static void  bsem_reset(struct bsem *bsem_p);
-static void  bsem_post(struct bsem *bsem_p);
-static void  bsem_post_all(struct bsem *bsem_p);
-static void  bsem_wait(struct bsem *bsem_p);
+static int   jobheap_before(job* a, job* b);
+static void  jobheap_push(jobqueue* jobqueue_p, job* newjob_p);
+static job*  jobheap_pull(jobqueue* jobqueue_p);
+
+static int   jobring_init(jobqueue* jobqueue_p, int queue_size);
+static int   jobring_push(jobring* jobring_p, job* newjob_p);
+static job* jobring_pull(jobring* jobring_p);
+static void  jobring_destroy(jobring* jobring_p);
+
+static int   deque_init(deque* deque_p);
+static void  deque_push(deque* deque_p, job* job_p);
+static job* deque_take(deque* deque_p);
+static job* deque_steal(deque* deque_p);
+static int   deque_empty(deque* deque_p);
+static void  deque_destroy(deque* deque_p);
+
+static struct thpool_* thpool_create(int num_threads, int queue_size, int priority);
+static int   thpool_add(thpool_* thpool_p, void *(*function_p)(void*), void* arg_p, long priority, int block);
+static int   thpool_enqueue(thpool_* thpool_p, job* first_p, int count, int block);
+static void  thpool_wake_all(thpool_* thpool_p);
+
+static job*  job_alloc(thpool_* thpool_p, int count);
+static void  job_release(thpool_* thpool_p, job* job_p);
+static void  job_slabs_free(thpool_* thpool_p);
+static void  thpool_job_done(thpool_* thpool_p);
+static int   thpool_has_jobs(thpool_* thpool_p);
+static void  thpool_notify(thpool_* thpool_p, job* job_p);
+
+static void  park_wait(volatile int* addr, int val);
+static void  park_wake(volatile int* addr, int count);
+static void  thpool_wake(thpool_* thpool_p);
 
 
 
@@ -111,9 +225,23 @@ static void  bsem_wait(struct bsem *bsem_p);
 
 /* Initialise thread pool */
 struct thpool_* thpool_init(int num_threads){
+	return thpool_create(num_threads, 0, 0);
+}
+
+
+/* Initialise thread pool with a bounded job queue */
+struct thpool_* thpool_init_bounded(int num_threads, int queue_size){
+	return thpool_create(num_threads, queue_size, 0);
+}
+
+
+/* Initialise thread pool running queued jobs by priority */
+struct thpool_* thpool_init_priority(int num_threads){
+	return thpool_create(num_threads, 0, 1);
+}
+
 
-	threads_on_hold   = 0;
-	threads_keepalive = 1;
+static struct thpool_* thpool_create(int num_threads, int queue_size, int priority){
 
 	if (num_threads < 0){
 		num_threads = 0;
@@ -126,18 +254,32 @@ struct thpool_* thpool_init(int num_threads){
 		fprintf(stderr, "thpool_init(): Could not allocate memory for thread pool\n");
 		return NULL;
 	}
-	thpool_p->num_threads_alive   = 0;
-	thpool_p->num_threads_working = 0;
+	thpool_p->num_threads          = num_threads;
+	thpool_p->num_threads_alive    = 0;
+	thpool_p->num_threads_sleeping = 0;
+	thpool_p->num_threads_searching = 0;
+	thpool_p->num_jobs_pending     = 0;
+	thpool_p->threads_keepalive    = 1;
+	thpool_p->threads_on_hold      = 0;
+	thpool_p->free_jobs            = NULL;
+	thpool_p->slabs                = NULL;
+	thpool_p->wake_seq             = 0;
+	thpool_p->wake_pending         = 0;
+	thpool_p->idle_seq             = 0;
+	thpool_p->num_waiting          = 0;
+	thpool_p->completion_fd        = -1;
+	thpool_p->completed            = NULL;
+	pthread_mutex_init(&thpool_p->free_lock, NULL);
 
 	/* Initialise the job queue */
-	if (jobqueue_init(thpool_p) == -1){
+	if (jobqueue_init(thpool_p, queue_size, priority) == -1){
 		fprintf(stderr, "thpool_init(): Could not allocate memory for job queue\n");
 		free(thpool_p);
 		return NULL;
 	}
 
-	/* Make threads in pool */
-	thpool_p->threads = (struct thread**)malloc(num_threads * sizeof(struct thread *));
+	/* Make threads in pool; thieves skip slots still NULL */
+	thpool_p->threads = (struct thread**)calloc(num_threads ? num_threads : 1, sizeof(struct thread *));
 	if (thpool_p->threads == NULL){
 		fprintf(stderr, "thpool_init(): Could not allocate memory for threads\n");
 		jobqueue_destroy(thpool_p);
@@ -147,7 +289,6 @@ struct thpool_* thpool_init(int num_threads){
 	}
 
 	pthread_mutex_init(&(thpool_p->thcount_lock), NULL);
-	pthread_cond_init(&thpool_p->threads_all_idle, NULL);
 	
 	/* Thread init */
 	int n;
@@ -164,12 +305,85 @@ struct thpool_* thpool_init(int num_threads){
 }
 
 
-/* Add work to the thread pool */
+/* Add work to the thread pool, waiting for room in a bounded queue */
 int thpool_add_work(thpool_* thpool_p, void *(*function_p)(void*), void* arg_p){
+	return thpool_add(thpool_p, function_p, arg_p, 0, 1);
+}
+
+
+/* Add work to the thread pool, failing with EAGAIN when the queue is full */
+int thpool_try_add_work(thpool_* thpool_p, void *(*function_p)(void*), void* arg_p){
+	return thpool_add(thpool_p, function_p, arg_p, 0, 0);
+}
+
+
+/* Add work to the thread pool with a priority */
+int thpool_add_work_priority(thpool_* thpool_p, void *(*function_p)(void*), void* arg_p, long priority){
+	return thpool_add(thpool_p, function_p, arg_p, priority, 1);
+}
+
+
+/* Add work with a node the caller owns, waiting for room in a bounded queue */
+int thpool_add_job(thpool_* thpool_p, job* job_p){
+	job_p->pooled = 0;
+	job_p->notify = 0;
+	return thpool_enqueue(thpool_p, job_p, 1, 1);
+}
+
+
+/* Like thpool_add_job(), the node comes back through thpool_completed() */
+int thpool_add_job_notify(thpool_* thpool_p, job* job_p){
+	job_p->pooled = 0;
+	job_p->notify = 1;
+	return thpool_enqueue(thpool_p, job_p, 1, 1);
+}
+
+
+/* Add count jobs with nodes the caller owns, in one go like thpool_add_work_batch() */
+int thpool_add_job_batch(thpool_* thpool_p, job** jobs, int count){
+	int n;
+
+	if (count <= 0)
+		return 0;
+	for (n = 0; n < count; n++){
+		jobs[n]->pooled = 0;
+		jobs[n]->notify = 0;
+		jobs[n]->prev = n + 1 < count ? jobs[n + 1] : NULL;
+	}
+	return thpool_enqueue(thpool_p, jobs[0], count, 1);
+}
+
+
+/* Add count jobs running function_p on arg_p[0..count-1]
+ *
+ * Nodes come off the freelist in one go, go on the list under one lock
+ * and sleeping threads are woken with one broadcast.
+ */
+int thpool_add_work_batch(thpool_* thpool_p, void *(*function_p)(void*), void** arg_p, int count){
+	job* first;
+	job* job_p;
+	int n;
+
+	if (count <= 0)
+		return 0;
+	if ((first = job_alloc(thpool_p, count)) == NULL){
+		fprintf(stderr, "thpool_add_work_batch(): Could not allocate memory for new jobs\n");
+		return -1;
+	}
+	for (n = 0, job_p = first; n < count; n++, job_p = job_p->prev){
+		job_p->function = function_p;
+		job_p->arg      = arg_p[n];
+		job_p->priority = 0;
+	}
+	return thpool_enqueue(thpool_p, first, count, 1);
+}
+
+
+/* Queue a job on a pooled node */
+static int thpool_add(thpool_* thpool_p, void *(*function_p)(void*), void* arg_p, long priority, int block){
 	job* newjob;
 
-	newjob=(struct job*)malloc(sizeof(struct job));
-	if (newjob==NULL){
+	if ((newjob = job_alloc(thpool_p, 1)) == NULL){
 		fprintf(stderr, "thpool_add_work(): Could not allocate memory for new job\n");
 		return -1;
 	}
@@ -177,23 +391,181 @@ int thpool_add_work(thpool_* thpool_p, void *(*function_p)(void*), void* arg_p){
 	/* add function and argument */
 	newjob->function=function_p;
 	newjob->arg=arg_p;
+	newjob->priority=priority;
+
+	return thpool_enqueue(thpool_p, newjob, 1, block);
+}
+
+
+/* Queue count jobs linked by prev
+ *
+ * A pool thread adding work keeps it in its own deque, where idle
+ * threads can steal it; that one never blocks, or a full queue could
+ * wait on itself. Anyone else goes through the shared job queue.
+ * Only a single job may be added without blocking.
+ */
+static int thpool_enqueue(thpool_* thpool_p, job* first, int count, int block){
+
+	/* counted first, a worker may finish them before we return */
+	__atomic_add_fetch(&thpool_p->num_jobs_pending, count, __ATOMIC_SEQ_CST);
 
-	/* add job to queue */
-	pthread_mutex_lock(&thpool_p->jobqueue_p->rwmutex);
-	jobqueue_push(thpool_p, newjob);
-	pthread_mutex_unlock(&thpool_p->jobqueue_p->rwmutex);
+	long now = stats_now_us();
+	job* job_p = first;
+	int n;
+	for (n = 0; n < count; n++, job_p = job_p->prev)
+		job_p->queued_at = now;
+
+	/* add jobs to queue */
+	if (thread_self != NULL && thread_self->thpool_p == thpool_p){
+		job* next;
+		for (; count > 0; count--, first = next){
+			next = first->prev;
+			deque_push(&thread_self->jobs, first);
+		}
+		thpool_wake_all(thpool_p);
+		return 0;
+	}
+	if (jobqueue_put(thpool_p, first, count, block) == -1){
+		if (first->pooled)
+			job_release(thpool_p, first);
+		thpool_job_done(thpool_p);
+		errno = EAGAIN;
+		return -1;
+	}
 
+	if (count == 1)
+		thpool_wake(thpool_p);
+	else
+		thpool_wake_all(thpool_p);
 	return 0;
 }
 
 
+/* Count a job as finished, waking thpool_wait() after the last one
+ *
+ * Seq-cst on both sides, like thread_sleep() and thpool_wake(): either
+ * a waiter sees no jobs pending or we see the waiter.
+ */
+static void thpool_job_done(thpool_* thpool_p){
+	if (__atomic_sub_fetch(&thpool_p->num_jobs_pending, 1, __ATOMIC_SEQ_CST) == 0
+	    && __atomic_load_n(&thpool_p->num_waiting, __ATOMIC_SEQ_CST)){
+		__atomic_add_fetch(&thpool_p->idle_seq, 1, __ATOMIC_SEQ_CST);
+		park_wake(&thpool_p->idle_seq, INT_MAX);
+	}
+}
+
+
 /* Wait until all jobs have finished */
 void thpool_wait(thpool_* thpool_p){
-	pthread_mutex_lock(&thpool_p->thcount_lock);
-	while (thpool_p->jobqueue_p->len || thpool_p->num_threads_working) {
-		pthread_cond_wait(&thpool_p->threads_all_idle, &thpool_p->thcount_lock);
+	__atomic_add_fetch(&thpool_p->num_waiting, 1, __ATOMIC_SEQ_CST);
+	for (;;){
+		int seq = __atomic_load_n(&thpool_p->idle_seq, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&thpool_p->num_jobs_pending, __ATOMIC_SEQ_CST) == 0)
+			break;
+		park_wait(&thpool_p->idle_seq, seq);
 	}
+	__atomic_sub_fetch(&thpool_p->num_waiting, 1, __ATOMIC_SEQ_CST);
+}
+
+
+/* Descriptor that turns readable when a thpool_add_job_notify() job is done */
+int thpool_completion_fd(thpool_* thpool_p){
+#if defined(__linux__)
+	pthread_mutex_lock(&thpool_p->thcount_lock);
+	if (thpool_p->completion_fd == -1)
+		thpool_p->completion_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
 	pthread_mutex_unlock(&thpool_p->thcount_lock);
+	return thpool_p->completion_fd;
+#else
+	(void)thpool_p;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+
+/* Take every notify job finished so far, oldest first, linked by prev */
+job* thpool_completed(thpool_* thpool_p){
+	job* list = __atomic_exchange_n(&thpool_p->completed, NULL, __ATOMIC_ACQUIRE);
+	job* done = NULL;
+	job* next;
+
+	for (; list != NULL; list = next){
+		next = list->prev;
+		list->prev = done;
+		done = list;
+	}
+	return done;
+}
+
+
+/* Hand a finished notify job back, lock-free; pops take the whole list,
+ * so there is no ABA to worry about */
+static void thpool_notify(thpool_* thpool_p, job* job_p){
+	job* head = __atomic_load_n(&thpool_p->completed, __ATOMIC_RELAXED);
+	do {
+		job_p->prev = head;
+	} while (!__atomic_compare_exchange_n(&thpool_p->completed, &head, job_p, 1,
+	                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+#if defined(__linux__)
+	int fd = __atomic_load_n(&thpool_p->completion_fd, __ATOMIC_ACQUIRE);
+	if (fd != -1){
+		uint64_t one = 1;
+		while (write(fd, &one, sizeof(one)) == -1 && errno == EINTR)
+			;
+	}
+#endif
+}
+
+
+/* Pin thread n to CPU (first_cpu + n) % num_cpus */
+int thpool_set_affinity(thpool_* thpool_p, int first_cpu, int num_cpus){
+#if defined(__linux__)
+	int n, err = 0;
+
+	if (num_cpus < 1 || first_cpu < 0){
+		errno = EINVAL;
+		return -1;
+	}
+	for (n=0; n < thpool_p->num_threads; n++){
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET((first_cpu + n) % num_cpus, &cpus);
+		if ((err = pthread_setaffinity_np(thpool_p->threads[n]->pthread, sizeof(cpus), &cpus)) != 0){
+			errno = err;
+			return -1;
+		}
+	}
+	return 0;
+#else
+	(void)thpool_p; (void)first_cpu; (void)num_cpus;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+
+/* Sum up what every thread counted */
+void thpool_get_stats(thpool_* thpool_p, thpool_stats* stats_p){
+	int n;
+
+	memset(stats_p, 0, sizeof(thpool_stats));
+	stats_p->threads_alive = thpool_p->num_threads_alive;
+	for (n=0; n < thpool_p->num_threads; n++){
+		thread* thread_p = __atomic_load_n(&thpool_p->threads[n], __ATOMIC_ACQUIRE);
+		if (thread_p == NULL)
+			continue;
+		stats_p->threads_working += thread_p->busy;
+		stats_p->jobs_done       += thread_p->jobs_done;
+		stats_p->jobs_stolen     += thread_p->jobs_stolen;
+		stats_merge(&stats_p->wait, &thread_p->wait);
+		stats_merge(&stats_p->run, &thread_p->run);
+	}
+	stats_p->jobs_queued = __atomic_load_n(&thpool_p->num_jobs_pending, __ATOMIC_RELAXED)
+	                       - stats_p->threads_working;
+	if (stats_p->jobs_queued < 0)
+		stats_p->jobs_queued = 0;
 }
 
 
@@ -202,10 +574,10 @@ void thpool_destroy(thpool_* thpool_p){
 	/* No need to destory if it's NULL */
 	if (thpool_p == NULL) return ;
 
-	volatile int threads_total = thpool_p->num_threads_alive;
+	volatile int threads_total = thpool_p->num_threads;
 
 	/* End each thread 's infinite loop */
-	threads_keepalive = 0;
+	thpool_p->threads_keepalive = 0;
 	
 	/* Give one second to kill idle threads */
 	double TIMEOUT = 1.0;
@@ -213,14 +585,16 @@ void thpool_destroy(thpool_* thpool_p){
 	double tpassed = 0.0;
 	time (&start);
 	while (tpassed < TIMEOUT && thpool_p->num_threads_alive){
-		bsem_post_all(thpool_p->jobqueue_p->has_jobs);
+		__atomic_add_fetch(&thpool_p->wake_seq, 1, __ATOMIC_SEQ_CST);
+		park_wake(&thpool_p->wake_seq, INT_MAX);
 		time (&end);
 		tpassed = difftime(end,start);
 	}
 	
 	/* Poll remaining threads */
 	while (thpool_p->num_threads_alive){
-		bsem_post_all(thpool_p->jobqueue_p->has_jobs);
+		__atomic_add_fetch(&thpool_p->wake_seq, 1, __ATOMIC_SEQ_CST);
+		park_wake(&thpool_p->wake_seq, INT_MAX);
 		sleep(1);
 	}
 
@@ -233,6 +607,9 @@ void thpool_destroy(thpool_* thpool_p){
 	for (n=0; n < threads_total; n++){
 		thread_destroy(thpool_p->threads[n]);
 	}
+	if (thpool_p->completion_fd != -1)
+		close(thpool_p->completion_fd);
+	job_slabs_free(thpool_p);
 	free(thpool_p->threads);
 	free(thpool_p);
 }
@@ -241,6 +618,7 @@ void thpool_destroy(thpool_* thpool_p){
 /* Pause all threads in threadpool */
 void thpool_pause(thpool_* thpool_p) {
 	int n;
+	thpool_p->threads_on_hold = 1;
 	for (n=0; n < thpool_p->num_threads_alive; n++){
 		pthread_kill(thpool_p->threads[n]->pthread, SIGUSR1);
 	}
@@ -249,7 +627,96 @@ void thpool_pause(thpool_* thpool_p) {
 
 /* Resume all threads in threadpool */
 void thpool_resume(thpool_* thpool_p) {
-	threads_on_hold = 0;
+	thpool_p->threads_on_hold = 0;
+}
+
+
+/* Whether any queue of the pool holds a job */
+static int thpool_has_jobs(thpool_* thpool_p){
+	int n;
+	if (jobqueue_len(thpool_p))
+		return 1;
+	for (n=0; n < thpool_p->num_threads; n++){
+		thread* thread_p = __atomic_load_n(&thpool_p->threads[n], __ATOMIC_ACQUIRE);
+		if (thread_p != NULL && !deque_empty(&thread_p->jobs))
+			return 1;
+	}
+	return 0;
+}
+
+
+/* Wake a sleeping thread after a job was queued
+ *
+ * Not needed while some thread is still searching: it either finds the
+ * job or sees it before going to sleep. The fence pairs with the one
+ * in thread_sleep(), so either the sleeper sees the job or we see it.
+ */
+static void thpool_wake(thpool_* thpool_p){
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&thpool_p->num_threads_searching, __ATOMIC_RELAXED))
+		return;
+	if (__atomic_load_n(&thpool_p->num_threads_sleeping, __ATOMIC_RELAXED)
+	    && !__atomic_exchange_n(&thpool_p->wake_pending, 1, __ATOMIC_SEQ_CST)){
+		__atomic_add_fetch(&thpool_p->wake_seq, 1, __ATOMIC_SEQ_CST);
+		park_wake(&thpool_p->wake_seq, 1);
+	}
+}
+
+
+
+
+
+/* Wake every sleeping thread, there is work for more than one */
+static void thpool_wake_all(thpool_* thpool_p){
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&thpool_p->num_threads_sleeping, __ATOMIC_RELAXED)){
+		__atomic_add_fetch(&thpool_p->wake_seq, 1, __ATOMIC_SEQ_CST);
+		park_wake(&thpool_p->wake_seq, INT_MAX);
+	}
+}
+
+
+
+
+
+/* ============================ PARKING ============================= */
+
+
+#if !defined(__linux__)
+static pthread_mutex_t park_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  park_cond = PTHREAD_COND_INITIALIZER;
+#endif
+
+
+/* Block while *addr still holds val, until a park_wake() on it
+ *
+ * A futex on Linux: no lock is taken on either side, a waker with
+ * nobody parked costs one atomic add. Elsewhere one process-wide
+ * condition variable stands in. Callers change *addr before waking
+ * and recheck their condition after, wakeups may be spurious.
+ */
+static void park_wait(volatile int* addr, int val){
+#if defined(__linux__)
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+#else
+	pthread_mutex_lock(&park_lock);
+	while (*addr == val)
+		pthread_cond_wait(&park_cond, &park_lock);
+	pthread_mutex_unlock(&park_lock);
+#endif
+}
+
+
+/* Wake up to count threads parked on addr */
+static void park_wake(volatile int* addr, int count){
+#if defined(__linux__)
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+#else
+	(void)addr; (void)count;
+	pthread_mutex_lock(&park_lock);
+	pthread_cond_broadcast(&park_cond);
+	pthread_mutex_unlock(&park_lock);
+#endif
 }
 
 
@@ -267,30 +734,118 @@ void thpool_resume(thpool_* thpool_p) {
  */
 static int thread_init (thpool_* thpool_p, struct thread** thread_p, int id){
 	
-	*thread_p = (struct thread*)malloc(sizeof(struct thread));
-	if (thread_p == NULL){
+	thread* new_thread = (struct thread*)calloc(1, sizeof(struct thread));
+	if (new_thread == NULL){
 		fprintf(stderr, "thread_init(): Could not allocate memory for thread\n");
 		return -1;
 	}
 
-	(*thread_p)->thpool_p = thpool_p;
-	(*thread_p)->id       = id;
+	new_thread->thpool_p = thpool_p;
+	new_thread->id       = id;
+	new_thread->seed     = (unsigned int)id * 2654435761u + 1;
+	new_thread->free_jobs     = NULL;
+	new_thread->num_free_jobs = 0;
+	if (deque_init(&new_thread->jobs) == -1){
+		fprintf(stderr, "thread_init(): Could not allocate memory for deque\n");
+		free(new_thread);
+		return -1;
+	}
+
+	/* publish only once the deque is ready for thieves */
+	__atomic_store_n(thread_p, new_thread, __ATOMIC_RELEASE);
 
-	pthread_create(&(*thread_p)->pthread, NULL, (void *)thread_do, (*thread_p));
-	pthread_detach((*thread_p)->pthread);
+	pthread_create(&new_thread->pthread, NULL, (void *)thread_do, new_thread);
+	pthread_detach(new_thread->pthread);
 	return 0;
 }
 
 
 /* Sets the calling thread on hold */
-static void thread_hold () {
-	threads_on_hold = 1;
-	while (threads_on_hold){
+static void thread_hold (int sig_id) {
+	(void)sig_id;
+	if (thread_self == NULL)
+		return;
+	while (thread_self->thpool_p->threads_on_hold){
 		sleep(1);
 	}
 }
 
 
+/* Next job for a thread to run
+ *
+ * Its own deque first, newest job on top, then a batch out of the
+ * shared queue, then a job stolen from a random other thread.
+ */
+static job* thread_next_job(struct thread* thread_p){
+
+	thpool_* thpool_p = thread_p->thpool_p;
+	job* job_p;
+	int n, round, victim;
+
+	if ((job_p = deque_take(&thread_p->jobs)) != NULL)
+		return job_p;
+
+	long len = jobqueue_len(thpool_p);
+	if (len > 0){
+		job* batch[INJECT_BATCH];
+		int want = len / (thpool_p->num_threads + 1) + 1;
+		if (want > INJECT_BATCH)
+			want = INJECT_BATCH;
+		/* a batch would run behind jobs that outrank it */
+		if (thpool_p->jobqueue_p->heap != NULL)
+			want = 1;
+		int count = jobqueue_take(thpool_p, batch, want);
+
+		if (count){
+			/* pushed newest first, so they're taken in queue order */
+			for (n = count - 1; n > 0; n--)
+				deque_push(&thread_p->jobs, batch[n]);
+			if (count > 1)
+				thpool_wake(thpool_p);
+			return batch[0];
+		}
+	}
+
+	for (round = 0; round < STEAL_ATTEMPTS; round++){
+		for (n = 0; n < thpool_p->num_threads; n++){
+			victim = rand_r(&thread_p->seed) % thpool_p->num_threads;
+			thread* other = __atomic_load_n(&thpool_p->threads[victim], __ATOMIC_ACQUIRE);
+			if (other == NULL || other == thread_p)
+				continue;
+			if ((job_p = deque_steal(&other->jobs)) != NULL){
+				thread_p->jobs_stolen++;
+				return job_p;
+			}
+		}
+	}
+	return NULL;
+}
+
+
+/* Park a thread that found nothing to do until a job shows up */
+static void thread_sleep(struct thread* thread_p){
+
+	thpool_* thpool_p = thread_p->thpool_p;
+
+	/* read before looking for jobs: a wake after that changes it, so
+	 * park_wait() returns right away instead of missing it */
+	int seq = __atomic_load_n(&thpool_p->wake_seq, __ATOMIC_SEQ_CST);
+	__atomic_sub_fetch(&thpool_p->num_threads_searching, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&thpool_p->num_threads_sleeping, 1, __ATOMIC_SEQ_CST);
+	int jobs_left = !thpool_p->threads_keepalive || thpool_has_jobs(thpool_p);
+	if (!jobs_left){
+		park_wait(&thpool_p->wake_seq, seq);
+	}
+	__atomic_add_fetch(&thpool_p->num_threads_searching, 1, __ATOMIC_SEQ_CST);
+	__atomic_sub_fetch(&thpool_p->num_threads_sleeping, 1, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&thpool_p->wake_pending, 0, __ATOMIC_SEQ_CST);
+
+	/* jobs are there but others got them first, let those run */
+	if (jobs_left)
+		sched_yield();
+}
+
+
 /* What each thread is doing
 * 
 * In principle this is an endless loop. The only time this loop gets interuppted is once
@@ -316,6 +871,7 @@ static void* thread_do(struct thread* thread_p){
 
 	/* Assure all threads have been created before starting serving */
 	thpool_* thpool_p = thread_p->thpool_p;
+	thread_self = thread_p;
 	
 	/* Register signal handler */
 	struct sigaction act;
@@ -327,42 +883,46 @@ static void* thread_do(struct thread* thread_p){
 	}
 	
 	/* Mark thread as alive (initialized) */
+	__atomic_add_fetch(&thpool_p->num_threads_searching, 1, __ATOMIC_SEQ_CST);
 	pthread_mutex_lock(&thpool_p->thcount_lock);
 	thpool_p->num_threads_alive += 1;
 	pthread_mutex_unlock(&thpool_p->thcount_lock);
 
-	while(threads_keepalive){
-
-		bsem_wait(thpool_p->jobqueue_p->has_jobs);
-
-		if (threads_keepalive){
-			
-			pthread_mutex_lock(&thpool_p->thcount_lock);
-			thpool_p->num_threads_working++;
-			pthread_mutex_unlock(&thpool_p->thcount_lock);
-			
-			/* Read job from queue and execute it */
-			void*(*func_buff)(void* arg);
-			void*  arg_buff;
-			job* job_p;
-			pthread_mutex_lock(&thpool_p->jobqueue_p->rwmutex);
-			job_p = jobqueue_pull(thpool_p);
-			pthread_mutex_unlock(&thpool_p->jobqueue_p->rwmutex);
-			if (job_p) {
-				func_buff = job_p->function;
-				arg_buff  = job_p->arg;
-				func_buff(arg_buff);
-				free(job_p);
-			}
-			
-			pthread_mutex_lock(&thpool_p->thcount_lock);
-			thpool_p->num_threads_working--;
-			if (!thpool_p->num_threads_working) {
-				pthread_cond_signal(&thpool_p->threads_all_idle);
-			}
-			pthread_mutex_unlock(&thpool_p->thcount_lock);
+	while(thpool_p->threads_keepalive){
 
+		job* job_p = thread_next_job(thread_p);
+		if (job_p == NULL){
+			thread_sleep(thread_p);
+			continue;
 		}
+
+		/* the last searcher to find a job passes the search on */
+		if (__atomic_sub_fetch(&thpool_p->num_threads_searching, 1, __ATOMIC_SEQ_CST) == 0
+		    && thpool_has_jobs(thpool_p))
+			thpool_wake(thpool_p);
+
+		/* Execute the job */
+		void*(*func_buff)(void* arg);
+		void*  arg_buff;
+		func_buff = job_p->function;
+		arg_buff  = job_p->arg;
+		long start = stats_now_us();
+		stats_record_local(&thread_p->wait, start - job_p->queued_at);
+		/* the node is not touched again, the job may free its owner,
+		 * unless it goes back to the caller through thpool_completed() */
+		int notify = !job_p->pooled && job_p->notify;
+		if (job_p->pooled)
+			job_release(thpool_p, job_p);
+		thread_p->busy = 1;
+		func_buff(arg_buff);
+		thread_p->busy = 0;
+		if (notify)
+			thpool_notify(thpool_p, job_p);
+		stats_record_local(&thread_p->run, stats_now_us() - start);
+		thread_p->jobs_done++;
+		__atomic_add_fetch(&thpool_p->num_threads_searching, 1, __ATOMIC_SEQ_CST);
+
+		thpool_job_done(thpool_p);
 	}
 	pthread_mutex_lock(&thpool_p->thcount_lock);
 	thpool_p->num_threads_alive --;
@@ -374,6 +934,9 @@ static void* thread_do(struct thread* thread_p){
 
 /* Frees a thread  */
 static void thread_destroy (thread* thread_p){
+	if (thread_p == NULL)
+		return;
+	deque_destroy(&thread_p->jobs);
 	free(thread_p);
 }
 
@@ -385,7 +948,7 @@ static void thread_destroy (thread* thread_p){
 
 
 /* Initialize queue */
-static int jobqueue_init(thpool_* thpool_p){
+static int jobqueue_init(thpool_* thpool_p, int queue_size, int priority){
 	
 	thpool_p->jobqueue_p = (struct jobqueue*)malloc(sizeof(struct jobqueue));
 	if (thpool_p->jobqueue_p == NULL){
@@ -394,14 +957,26 @@ static int jobqueue_init(thpool_* thpool_p){
 	thpool_p->jobqueue_p->len = 0;
 	thpool_p->jobqueue_p->front = NULL;
 	thpool_p->jobqueue_p->rear  = NULL;
-
-	thpool_p->jobqueue_p->has_jobs = (struct bsem*)malloc(sizeof(struct bsem));
-	if (thpool_p->jobqueue_p->has_jobs == NULL){
-		return -1;
+	thpool_p->jobqueue_p->ring  = NULL;
+	thpool_p->jobqueue_p->heap  = NULL;
+	thpool_p->jobqueue_p->heap_size = 0;
+	thpool_p->jobqueue_p->seq   = 0;
+
+	if (priority){
+		thpool_p->jobqueue_p->heap_size = 64;
+		thpool_p->jobqueue_p->heap = (job**)malloc(64 * sizeof(job*));
+		if (thpool_p->jobqueue_p->heap == NULL){
+			free(thpool_p->jobqueue_p);
+			return -1;
+		}
 	}
 
 	pthread_mutex_init(&(thpool_p->jobqueue_p->rwmutex), NULL);
-	bsem_init(thpool_p->jobqueue_p->has_jobs, 0);
+
+	if (queue_size > 0 && jobring_init(thpool_p->jobqueue_p, queue_size) == -1){
+		free(thpool_p->jobqueue_p);
+		return -1;
+	}
 
 	return 0;
 }
@@ -410,13 +985,17 @@ static int jobqueue_init(thpool_* thpool_p){
 /* Clear the queue */
 static void jobqueue_clear(thpool_* thpool_p){
 
+	if (thpool_p->jobqueue_p->ring != NULL){
+		while (jobring_pull(thpool_p->jobqueue_p->ring) != NULL)
+			;
+	}
+
 	while(thpool_p->jobqueue_p->len){
-		free(jobqueue_pull(thpool_p));
+		jobqueue_pull(thpool_p);
 	}
 
 	thpool_p->jobqueue_p->front = NULL;
 	thpool_p->jobqueue_p->rear  = NULL;
-	bsem_reset(thpool_p->jobqueue_p->has_jobs);
 	thpool_p->jobqueue_p->len = 0;
 
 }
@@ -426,7 +1005,12 @@ static void jobqueue_clear(thpool_* thpool_p){
  *
  * Notice: Caller MUST hold a mutex
  */
-static void jobqueue_push(thpool_* thpool_p, struct job* newjob){
+static void jobqueue_push(thpool_* thpool_p, job* newjob){
+
+	if (thpool_p->jobqueue_p->heap != NULL){
+		jobheap_push(thpool_p->jobqueue_p, newjob);
+		return;
+	}
 
 	newjob->prev = NULL;
 
@@ -443,8 +1027,6 @@ static void jobqueue_push(thpool_* thpool_p, struct job* newjob){
 					
 	}
 	thpool_p->jobqueue_p->len++;
-	
-	bsem_post(thpool_p->jobqueue_p->has_jobs);
 }
 
 
@@ -452,7 +1034,10 @@ static void jobqueue_push(thpool_* thpool_p, struct job* newjob){
  * 
  * Notice: Caller MUST hold a mutex
  */
-static struct job* jobqueue_pull(thpool_* thpool_p){
+static job* jobqueue_pull(thpool_* thpool_p){
+
+	if (thpool_p->jobqueue_p->heap != NULL)
+		return jobheap_pull(thpool_p->jobqueue_p);
 
 	job* job_p;
 	job_p = thpool_p->jobqueue_p->front;
@@ -471,8 +1056,6 @@ static struct job* jobqueue_pull(thpool_* thpool_p){
 		default: /* if >1 jobs in queue */
 					thpool_p->jobqueue_p->front = job_p->prev;
 					thpool_p->jobqueue_p->len--;
-					/* more than one job in queue -> post it */
-					bsem_post(thpool_p->jobqueue_p->has_jobs);
 					
 	}
 	
@@ -480,61 +1063,498 @@ static struct job* jobqueue_pull(thpool_* thpool_p){
 }
 
 
+/* Queue count jobs linked by prev, blocking while a bounded queue is
+ * full unless told not to
+ *
+ * @return 0 on success, -1 when the queue is full and block is 0
+ */
+static int jobqueue_put(thpool_* thpool_p, job* first, int count, int block){
+
+	jobring* jobring_p = thpool_p->jobqueue_p->ring;
+	job* next;
+
+	if (jobring_p == NULL){
+		pthread_mutex_lock(&thpool_p->jobqueue_p->rwmutex);
+		for (; count > 0; count--, first = next){
+			next = first->prev;
+			jobqueue_push(thpool_p, first);
+		}
+		pthread_mutex_unlock(&thpool_p->jobqueue_p->rwmutex);
+		return 0;
+	}
+
+	for (; count > 0; count--, first = next){
+		next = first->prev;
+		if (jobring_push(jobring_p, first) == 0)
+			continue;
+		if (!block)
+			return -1;
+
+		/* whoever sleeps must drain the ring before we get room */
+		thpool_wake_all(thpool_p);
+
+		/* announce ourselves before the retry, consumers check after a pull */
+		pthread_mutex_lock(&jobring_p->room_lock);
+		__atomic_add_fetch(&jobring_p->num_producers_waiting, 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		while (jobring_push(jobring_p, first) == -1){
+			pthread_cond_wait(&jobring_p->has_room, &jobring_p->room_lock);
+		}
+		__atomic_sub_fetch(&jobring_p->num_producers_waiting, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&jobring_p->room_lock);
+	}
+	return 0;
+}
+
+
+/* Take up to max jobs off the queue
+ *
+ * @return number of jobs stored in batch
+ */
+static int jobqueue_take(thpool_* thpool_p, job** batch, int max){
+
+	jobring* jobring_p = thpool_p->jobqueue_p->ring;
+	int count = 0;
+
+	if (jobring_p == NULL){
+		pthread_mutex_lock(&thpool_p->jobqueue_p->rwmutex);
+		while (count < max && (batch[count] = jobqueue_pull(thpool_p)) != NULL)
+			count++;
+		pthread_mutex_unlock(&thpool_p->jobqueue_p->rwmutex);
+		return count;
+	}
+
+	while (count < max && (batch[count] = jobring_pull(jobring_p)) != NULL)
+		count++;
+
+	/* slots were freed, let blocked producers retry */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (count && __atomic_load_n(&jobring_p->num_producers_waiting, __ATOMIC_RELAXED)){
+		pthread_mutex_lock(&jobring_p->room_lock);
+		pthread_cond_broadcast(&jobring_p->has_room);
+		pthread_mutex_unlock(&jobring_p->room_lock);
+	}
+	return count;
+}
+
+
+/* Number of jobs in the queue, a hint */
+static long jobqueue_len(thpool_* thpool_p){
+
+	jobring* jobring_p = thpool_p->jobqueue_p->ring;
+
+	if (jobring_p == NULL)
+		return __atomic_load_n(&thpool_p->jobqueue_p->len, __ATOMIC_SEQ_CST);
+	return (long)(__atomic_load_n(&jobring_p->enqueue_pos, __ATOMIC_SEQ_CST)
+	              - __atomic_load_n(&jobring_p->dequeue_pos, __ATOMIC_SEQ_CST));
+}
+
+
 /* Free all queue resources back to the system */
 static void jobqueue_destroy(thpool_* thpool_p){
 	jobqueue_clear(thpool_p);
-	free(thpool_p->jobqueue_p->has_jobs);
+	if (thpool_p->jobqueue_p->ring != NULL)
+		jobring_destroy(thpool_p->jobqueue_p->ring);
+	free(thpool_p->jobqueue_p->heap);
+	pthread_mutex_destroy(&thpool_p->jobqueue_p->rwmutex);
+}
+
+
+
+
+
+/* ========================== PRIORITY HEAP ========================= */
+
+
+/* Whether a runs before b: higher priority, then earlier arrival */
+static int jobheap_before(job* a, job* b){
+	if (a->priority != b->priority)
+		return a->priority > b->priority;
+	return a->seq < b->seq;
+}
+
+
+/* Add job to the heap
+ *
+ * Notice: Caller MUST hold a mutex
+ */
+static void jobheap_push(jobqueue* jobqueue_p, job* newjob){
+
+	if (jobqueue_p->len == jobqueue_p->heap_size){
+		job** bigger = (job**)realloc(jobqueue_p->heap, 2 * jobqueue_p->heap_size * sizeof(job*));
+		if (bigger == NULL){
+			fprintf(stderr, "jobheap_push(): Could not allocate memory for job heap\n");
+			exit(1);
+		}
+		jobqueue_p->heap = bigger;
+		jobqueue_p->heap_size *= 2;
+	}
+
+	newjob->seq = jobqueue_p->seq++;
+
+	/* sift up */
+	int i = jobqueue_p->len++;
+	while (i > 0 && jobheap_before(newjob, jobqueue_p->heap[(i - 1) / 2])){
+		jobqueue_p->heap[i] = jobqueue_p->heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	jobqueue_p->heap[i] = newjob;
+}
+
+
+/* Get the job that runs next from the heap (removes it from the heap)
+ *
+ * Notice: Caller MUST hold a mutex
+ */
+static job* jobheap_pull(jobqueue* jobqueue_p){
+
+	if (jobqueue_p->len == 0)
+		return NULL;
+
+	job** heap = jobqueue_p->heap;
+	job* top  = heap[0];
+	job* last = heap[--jobqueue_p->len];
+	int n = jobqueue_p->len;
+
+	/* sift the last job down from the root */
+	int i = 0, child;
+	while ((child = 2 * i + 1) < n){
+		if (child + 1 < n && jobheap_before(heap[child + 1], heap[child]))
+			child++;
+		if (!jobheap_before(heap[child], last))
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	if (n > 0)
+		heap[i] = last;
+	return top;
+}
+
+
+
+
+
+/* ========================= BOUNDED JOB RING ======================= */
+
+
+/* Initialize ring of at least queue_size slots */
+static int jobring_init(jobqueue* jobqueue_p, int queue_size){
+
+	unsigned long size = 2, i;
+	while (size < (unsigned long)queue_size)
+		size <<= 1;
+
+	jobring* jobring_p = (struct jobring*)malloc(sizeof(struct jobring));
+	if (jobring_p == NULL){
+		return -1;
+	}
+	jobring_p->cells = (struct ring_cell*)malloc(size * sizeof(struct ring_cell));
+	if (jobring_p->cells == NULL){
+		free(jobring_p);
+		return -1;
+	}
+	for (i = 0; i < size; i++)
+		jobring_p->cells[i].seq = i;
+	jobring_p->mask        = size - 1;
+	jobring_p->enqueue_pos = 0;
+	jobring_p->dequeue_pos = 0;
+	jobring_p->num_producers_waiting = 0;
+	pthread_mutex_init(&jobring_p->room_lock, NULL);
+	pthread_cond_init(&jobring_p->has_room, NULL);
+
+	jobqueue_p->ring = jobring_p;
+	return 0;
+}
+
+
+/* Add job to the ring
+ *
+ * @return 0 on success, -1 when full
+ */
+static int jobring_push(jobring* jobring_p, job* newjob){
+
+	ring_cell* cell;
+	unsigned long pos = __atomic_load_n(&jobring_p->enqueue_pos, __ATOMIC_RELAXED);
+
+	for (;;){
+		cell = &jobring_p->cells[pos & jobring_p->mask];
+		unsigned long seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		long dif = (long)seq - (long)pos;
+		if (dif == 0){
+			if (__atomic_compare_exchange_n(&jobring_p->enqueue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if (dif < 0){
+			return -1;
+		}
+		else {
+			pos = __atomic_load_n(&jobring_p->enqueue_pos, __ATOMIC_RELAXED);
+		}
+	}
+	cell->job_p = newjob;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+
+/* Get oldest job from the ring, NULL when empty */
+static job* jobring_pull(jobring* jobring_p){
+
+	ring_cell* cell;
+	unsigned long pos = __atomic_load_n(&jobring_p->dequeue_pos, __ATOMIC_RELAXED);
+
+	for (;;){
+		cell = &jobring_p->cells[pos & jobring_p->mask];
+		unsigned long seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		long dif = (long)seq - (long)(pos + 1);
+		if (dif == 0){
+			if (__atomic_compare_exchange_n(&jobring_p->dequeue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if (dif < 0){
+			return NULL;
+		}
+		else {
+			pos = __atomic_load_n(&jobring_p->dequeue_pos, __ATOMIC_RELAXED);
+		}
+	}
+	job* job_p = cell->job_p;
+	__atomic_store_n(&cell->seq, pos + jobring_p->mask + 1, __ATOMIC_RELEASE);
+	return job_p;
+}
+
+
+/* Free the ring, jobs left in it are freed by jobqueue_clear() */
+static void jobring_destroy(jobring* jobring_p){
+	pthread_cond_destroy(&jobring_p->has_room);
+	pthread_mutex_destroy(&jobring_p->room_lock);
+	free(jobring_p->cells);
+	free(jobring_p);
 }
 
 
 
 
 
-/* ======================== SYNCHRONISATION ========================= */
+/* ============================ JOB NODES =========================== */
 
 
-/* Init semaphore to 1 or 0 */
-static void bsem_init(bsem *bsem_p, int value) {
-	if (value < 0 || value > 1) {
-		fprintf(stderr, "bsem_init(): Binary semaphore can take only values 1 or 0");
-		exit(1);
+/* Get count job nodes linked by prev
+ *
+ * A pool thread takes from its own cache first. Everyone else takes
+ * from the pool's freelist under one lock, carving a new slab when it
+ * runs dry, so no job costs a malloc once the pool is warm.
+ */
+static job* job_alloc(thpool_* thpool_p, int count){
+
+	job* first = NULL;
+	job* job_p;
+	int n = 0;
+
+	thread* thread_p = thread_self;
+	if (thread_p != NULL && thread_p->thpool_p == thpool_p){
+		while (n < count && (job_p = thread_p->free_jobs) != NULL){
+			thread_p->free_jobs = job_p->prev;
+			thread_p->num_free_jobs--;
+			job_p->prev = first;
+			first = job_p;
+			n++;
+		}
+		if (n == count)
+			return first;
 	}
-	pthread_mutex_init(&(bsem_p->mutex), NULL);
-	pthread_cond_init(&(bsem_p->cond), NULL);
-	bsem_p->v = value;
+
+	pthread_mutex_lock(&thpool_p->free_lock);
+	while (n < count){
+		if (thpool_p->free_jobs == NULL){
+			job_slab* slab = (job_slab*)malloc(sizeof(job_slab));
+			if (slab == NULL){
+				pthread_mutex_unlock(&thpool_p->free_lock);
+				while ((job_p = first) != NULL){
+					first = job_p->prev;
+					job_release(thpool_p, job_p);
+				}
+				return NULL;
+			}
+			slab->next = thpool_p->slabs;
+			thpool_p->slabs = slab;
+			int i;
+			for (i = 0; i < JOB_SLAB; i++){
+				slab->jobs[i].pooled = 1;
+				slab->jobs[i].prev = thpool_p->free_jobs;
+				thpool_p->free_jobs = &slab->jobs[i];
+			}
+		}
+		job_p = thpool_p->free_jobs;
+		thpool_p->free_jobs = job_p->prev;
+		job_p->prev = first;
+		first = job_p;
+		n++;
+	}
+	pthread_mutex_unlock(&thpool_p->free_lock);
+	return first;
 }
 
 
-/* Reset semaphore to 0 */
-static void bsem_reset(bsem *bsem_p) {
-	bsem_init(bsem_p, 0);
+/* Give a pooled node back
+ *
+ * Pool threads collect nodes and hand them back JOB_CACHE at a time.
+ */
+static void job_release(thpool_* thpool_p, job* job_p){
+
+	thread* thread_p = thread_self;
+	if (thread_p != NULL && thread_p->thpool_p == thpool_p){
+		job_p->prev = thread_p->free_jobs;
+		thread_p->free_jobs = job_p;
+		if (++thread_p->num_free_jobs < JOB_CACHE)
+			return;
+
+		/* hand the whole cache over */
+		job* last = job_p;
+		while (last->prev != NULL)
+			last = last->prev;
+		pthread_mutex_lock(&thpool_p->free_lock);
+		last->prev = thpool_p->free_jobs;
+		thpool_p->free_jobs = thread_p->free_jobs;
+		pthread_mutex_unlock(&thpool_p->free_lock);
+		thread_p->free_jobs = NULL;
+		thread_p->num_free_jobs = 0;
+		return;
+	}
+
+	pthread_mutex_lock(&thpool_p->free_lock);
+	job_p->prev = thpool_p->free_jobs;
+	thpool_p->free_jobs = job_p;
+	pthread_mutex_unlock(&thpool_p->free_lock);
+}
+
+
+/* Free the memory of every pooled node, wherever it was left */
+static void job_slabs_free(thpool_* thpool_p){
+	job_slab* slab;
+	while ((slab = thpool_p->slabs) != NULL){
+		thpool_p->slabs = slab->next;
+		free(slab);
+	}
+	pthread_mutex_destroy(&thpool_p->free_lock);
+}
+
+
+
+
+
+/* ======================= WORK-STEALING DEQUE ====================== */
+
+
+/* Chase and Lev, "Dynamic Circular Work-Stealing Deque", with the memory
+ * orderings of Le et al., "Correct and Efficient Work-Stealing for Weak
+ * Memory Models". Only the owner calls deque_push() and deque_take().
+ */
+
+
+/* Initialize deque */
+static int deque_init(deque* deque_p){
+	deque_array* array_p = (struct deque_array*)malloc(sizeof(struct deque_array) + DEQUE_INITIAL_SIZE * sizeof(job*));
+	if (array_p == NULL){
+		return -1;
+	}
+	array_p->size    = DEQUE_INITIAL_SIZE;
+	array_p->retired = NULL;
+	deque_p->top     = 0;
+	deque_p->bottom  = 0;
+	deque_p->array   = array_p;
+	return 0;
 }
 
 
-/* Post to at least one thread */
-static void bsem_post(bsem *bsem_p) {
-	pthread_mutex_lock(&bsem_p->mutex);
-	bsem_p->v = 1;
-	pthread_cond_signal(&bsem_p->cond);
-	pthread_mutex_unlock(&bsem_p->mutex);
+/* Add job at the bottom, growing the ring when it is full */
+static void deque_push(deque* deque_p, job* job_p){
+
+	long b = __atomic_load_n(&deque_p->bottom, __ATOMIC_RELAXED);
+	long t = __atomic_load_n(&deque_p->top, __ATOMIC_ACQUIRE);
+	deque_array* array_p = __atomic_load_n(&deque_p->array, __ATOMIC_RELAXED);
+
+	if (b - t > array_p->size - 1){
+		/* thieves may still read the old array, it is freed with the deque */
+		deque_array* bigger = (struct deque_array*)malloc(sizeof(struct deque_array) + 2 * array_p->size * sizeof(job*));
+		if (bigger == NULL){
+			fprintf(stderr, "deque_push(): Could not allocate memory for deque\n");
+			exit(1);
+		}
+		bigger->size    = 2 * array_p->size;
+		bigger->retired = array_p;
+		long i;
+		for (i = t; i < b; i++)
+			bigger->buf[i & (bigger->size - 1)] = array_p->buf[i & (array_p->size - 1)];
+		__atomic_store_n(&deque_p->array, bigger, __ATOMIC_RELEASE);
+		array_p = bigger;
+	}
+	__atomic_store_n(&array_p->buf[b & (array_p->size - 1)], job_p, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&deque_p->bottom, b + 1, __ATOMIC_RELAXED);
+}
+
+
+/* Take the newest job from the bottom, NULL when empty */
+static job* deque_take(deque* deque_p){
+
+	long b = __atomic_load_n(&deque_p->bottom, __ATOMIC_RELAXED) - 1;
+	deque_array* array_p = __atomic_load_n(&deque_p->array, __ATOMIC_RELAXED);
+	__atomic_store_n(&deque_p->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	long t = __atomic_load_n(&deque_p->top, __ATOMIC_RELAXED);
+
+	job* job_p = NULL;
+	if (t <= b){
+		job_p = __atomic_load_n(&array_p->buf[b & (array_p->size - 1)], __ATOMIC_RELAXED);
+		if (t == b){
+			/* last job, race the thieves for it */
+			if (!__atomic_compare_exchange_n(&deque_p->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+				job_p = NULL;
+			__atomic_store_n(&deque_p->bottom, b + 1, __ATOMIC_RELAXED);
+		}
+	}
+	else {
+		__atomic_store_n(&deque_p->bottom, b + 1, __ATOMIC_RELAXED);
+	}
+	return job_p;
+}
+
+
+/* Steal the oldest job from the top, NULL when empty or lost to another thief */
+static job* deque_steal(deque* deque_p){
+
+	long t = __atomic_load_n(&deque_p->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	long b = __atomic_load_n(&deque_p->bottom, __ATOMIC_ACQUIRE);
+
+	if (t >= b)
+		return NULL;
+
+	deque_array* array_p = __atomic_load_n(&deque_p->array, __ATOMIC_ACQUIRE);
+	job* job_p = __atomic_load_n(&array_p->buf[t & (array_p->size - 1)], __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&deque_p->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return NULL;
+	return job_p;
 }
 
 
-/* Post to all threads */
-static void bsem_post_all(bsem *bsem_p) {
-	pthread_mutex_lock(&bsem_p->mutex);
-	bsem_p->v = 1;
-	pthread_cond_broadcast(&bsem_p->cond);
-	pthread_mutex_unlock(&bsem_p->mutex);
+/* Whether the deque looks empty, a hint for sleeping */
+static int deque_empty(deque* deque_p){
+	long t = __atomic_load_n(&deque_p->top, __ATOMIC_SEQ_CST);
+	long b = __atomic_load_n(&deque_p->bottom, __ATOMIC_SEQ_CST);
+	return b <= t;
 }
 
 
-/* Wait on semaphore until semaphore has value 0 */
-static void bsem_wait(bsem* bsem_p) {
-	pthread_mutex_lock(&bsem_p->mutex);
-	while (bsem_p->v != 1) {
-		pthread_cond_wait(&bsem_p->cond, &bsem_p->mutex);
+/* Free the deque and every array it went through, nodes left in it
+ * belong to the slabs or the caller */
+static void deque_destroy(deque* deque_p){
+	deque_array* array_p = deque_p->array;
+	while (array_p != NULL){
+		deque_array* retired = array_p->retired;
+		free(array_p);
+		array_p = retired;
 	}
-	bsem_p->v = 0;
-	pthread_mutex_unlock(&bsem_p->mutex);
 }
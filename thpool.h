@@ -7,6 +7,7 @@
 #ifndef _THPOOL_
 #define _THPOOL_
 
+#include "stats.h"
 
 
 
@@ -17,6 +18,55 @@
 typedef struct thpool_* threadpool;
 
 
+/**
+ * @brief A job node
+ * 
+ * The pool keeps its own nodes for thpool_add_work(). Callers queuing
+ * many jobs can instead embed one in the struct the job works on and
+ * queue it with thpool_add_job(), which allocates nothing. The pool is
+ * done with the node once function is called, so function may free
+ * the struct around it.
+ * 
+ * @example
+ * 
+ *    struct item {
+ *       thpool_job job;
+ *       ..
+ *    };
+ * 
+ *    it->job.function = process_item;
+ *    it->job.arg      = it;
+ *    thpool_add_job(thpool, &it->job);
+ */
+typedef struct thpool_job{
+	struct thpool_job* prev;             /* used by the pool          */
+	void*  (*function)(void* arg);       /* function pointer          */
+	void*  arg;                          /* function's argument       */
+	long   priority;                     /* higher runs first on a priority pool */
+	int    pooled;                       /* used by the pool          */
+	unsigned long seq;                   /* used by the pool          */
+	long   queued_at;                    /* used by the pool          */
+	int    notify;                       /* used by the pool          */
+} thpool_job;
+
+
+/**
+ * @brief What a pool is doing, see thpool_get_stats()
+ * 
+ * Times are in microseconds. wait runs from a job being added to a
+ * thread starting it, run from start to finish.
+ */
+typedef struct thpool_stats{
+	int    threads_alive;
+	int    threads_working;              /* running a job             */
+	long   jobs_queued;                  /* added and not yet started */
+	long   jobs_done;
+	long   jobs_stolen;                  /* taken from another thread's deque */
+	stats_hist_t wait;
+	stats_hist_t run;
+} thpool_stats;
+
+
 /**
  * @brief  Initialize threadpool
  * 
@@ -37,6 +87,48 @@ typedef struct thpool_* threadpool;
 threadpool thpool_init(int num_threads);
 
 
+/**
+ * @brief  Initialize threadpool with a bounded job queue
+ * 
+ * Like thpool_init(), but at most queue_size jobs added from outside the
+ * pool wait in its queue (rounded up to a power of two). Past that,
+ * thpool_add_work() blocks until a thread takes a job and
+ * thpool_try_add_work() fails. Memory held by pending jobs stays flat
+ * however much work is fed in. A queue_size of 0 means unbounded.
+ * 
+ * @example
+ * 
+ *    threadpool thpool = thpool_init_bounded(8, 1024);
+ * 
+ * @param  num_threads   number of threads to be created in the threadpool
+ * @param  queue_size    most jobs waiting in the queue, 0 for no limit
+ * @return threadpool    created threadpool on success,
+ *                       NULL on error
+ */
+threadpool thpool_init_bounded(int num_threads, int queue_size);
+
+
+/**
+ * @brief  Initialize threadpool that runs jobs by priority
+ * 
+ * Like thpool_init(), but jobs added from outside the pool wait in a
+ * heap and the one with the highest priority is taken next, ties in
+ * the order they were added. Jobs added from inside a job still run
+ * on that thread first.
+ * 
+ * @example
+ * 
+ *    threadpool thpool = thpool_init_priority(8);
+ *    thpool_add_work_priority(thpool, (void*)fetch, (void*)big, 100);
+ *    thpool_add_work_priority(thpool, (void*)fetch, (void*)small, 1);
+ * 
+ * @param  num_threads   number of threads to be created in the threadpool
+ * @return threadpool    created threadpool on success,
+ *                       NULL on error
+ */
+threadpool thpool_init_priority(int num_threads);
+
+
 /**
  * @brief Add work to the job queue
  * 
@@ -44,6 +136,9 @@ threadpool thpool_init(int num_threads);
  * If you want to add to work a function with more than one arguments then
  * a way to implement this is by passing a pointer to a structure.
  * 
+ * On a pool made with thpool_init_bounded() this waits while the queue
+ * is full. Jobs added from inside a job never wait.
+ * 
  * NOTICE: You have to cast both the function and argument to not get warnings.
  * 
  * @example
@@ -67,6 +162,87 @@ threadpool thpool_init(int num_threads);
 int thpool_add_work(threadpool, void *(*function_p)(void*), void* arg_p);
 
 
+/**
+ * @brief Add work to the job queue unless it is full
+ * 
+ * Same as thpool_add_work() but never blocks: when a bounded queue has
+ * no room the job is not added and errno is set to EAGAIN.
+ * 
+ * @param  threadpool    threadpool to which the work will be added
+ * @param  function_p    pointer to function to add as work
+ * @param  arg_p         pointer to an argument
+ * @return 0 on successs, -1 otherwise (EAGAIN when the queue is full).
+ */
+int thpool_try_add_work(threadpool, void *(*function_p)(void*), void* arg_p);
+
+
+/**
+ * @brief Add work with a priority to the job queue
+ * 
+ * On a pool made with thpool_init_priority() jobs with a higher
+ * priority are run first. Other pools ignore it. thpool_add_work() and
+ * thpool_add_work_batch() add with priority 0.
+ * 
+ * @param  threadpool    threadpool to which the work will be added
+ * @param  function_p    pointer to function to add as work
+ * @param  arg_p         pointer to an argument
+ * @param  priority      higher runs first
+ * @return 0 on successs, -1 otherwise.
+ */
+int thpool_add_work_priority(threadpool, void *(*function_p)(void*), void* arg_p, long priority);
+
+
+/**
+ * @brief Add a batch of work to the job queue
+ * 
+ * Queues count jobs, each calling function_p with one of arg_p. Takes
+ * the queue lock once and wakes the threads once for the whole batch.
+ * Like thpool_add_work() it waits while a bounded queue is full.
+ * 
+ * @example
+ * 
+ *    void* args[64];
+ *    ..
+ *    thpool_add_work_batch(thpool, (void*)task, args, 64);
+ * 
+ * @param  threadpool    threadpool to which the work will be added
+ * @param  function_p    pointer to function to add as work
+ * @param  arg_p         array of count arguments
+ * @param  count         number of jobs
+ * @return 0 on successs, -1 otherwise.
+ */
+int thpool_add_work_batch(threadpool, void *(*function_p)(void*), void** arg_p, int count);
+
+
+/**
+ * @brief Add work with a job node the caller owns
+ * 
+ * Queues job_p without allocating. function, arg and priority must be
+ * set, the node must stay put until function is called. Waits while a bounded
+ * queue is full.
+ * 
+ * @param  threadpool    threadpool to which the work will be added
+ * @param  job_p         the job node, see thpool_job
+ * @return 0 on successs, -1 otherwise.
+ */
+int thpool_add_job(threadpool, thpool_job* job_p);
+
+
+/**
+ * @brief Add a batch of work with job nodes the caller owns
+ * 
+ * thpool_add_job() for count nodes at once, queued under one lock and
+ * with one wakeup like thpool_add_work_batch(). On a priority pool no
+ * thread picks a job before the whole batch is in the heap.
+ * 
+ * @param  threadpool    threadpool to which the work will be added
+ * @param  jobs          array of count job nodes
+ * @param  count         number of jobs
+ * @return 0 on successs, -1 otherwise.
+ */
+int thpool_add_job_batch(threadpool, thpool_job** jobs, int count);
+
+
 /**
  * @brief Wait for all queued jobs to finish
  * 
@@ -137,6 +313,105 @@ void thpool_pause(threadpool);
 void thpool_resume(threadpool);
 
 
+/**
+ * @brief Add work and be told when it is done, without blocking
+ * 
+ * Like thpool_add_job(), except that the pool keeps the node after
+ * function returned and hands it back through thpool_completed(), so
+ * function must not free it. Together with thpool_completion_fd() an
+ * event loop can hand CPU work to the pool and pick up the results
+ * when its poll says so, with no thread stuck in thpool_wait().
+ * 
+ * @example
+ * 
+ *    int fd = thpool_completion_fd(thpool);
+ *    // register fd with epoll, then
+ *    thpool_add_job_notify(thpool, &it->job);
+ *    ..
+ *    // fd is readable
+ *    uint64_t n;
+ *    read(fd, &n, sizeof(n));
+ *    for (job = thpool_completed(thpool); job; job = next){
+ *       next = job->prev;
+ *       ..
+ *    }
+ * 
+ * @param  threadpool    the threadpool to which the work will be added
+ * @param  job_p         node owned by the caller, function and arg set
+ * @return 0 on success, -1 otherwise
+ */
+int thpool_add_job_notify(threadpool, thpool_job* job_p);
+
+
+/**
+ * @brief Descriptor that turns readable once notify jobs are done
+ * 
+ * An eventfd, created on the first call and closed by thpool_destroy().
+ * Each job added with thpool_add_job_notify() adds one to its counter
+ * when it finished; reading it returns the count and resets it. It is
+ * non-blocking, meant for epoll or poll. Linux only.
+ * 
+ * @param  threadpool    the threadpool of interest
+ * @return the descriptor, -1 on error or where there is no eventfd
+ */
+int thpool_completion_fd(threadpool);
+
+
+/**
+ * @brief Take back the notify jobs that finished
+ * 
+ * Never blocks. Returns every job added with thpool_add_job_notify()
+ * that finished since the last call, oldest first, linked through
+ * prev, or NULL if none did.
+ * 
+ * @param  threadpool    the threadpool of interest
+ * @return the first finished job, or NULL
+ */
+thpool_job* thpool_completed(threadpool);
+
+
+/**
+ * @brief Pin the threads to CPUs
+ * 
+ * Thread n runs on CPU (first_cpu + n) % num_cpus only. Meant for pools
+ * doing CPU bound work, so their threads don't migrate between cores.
+ * 
+ * @example
+ * 
+ *    threadpool thpool = thpool_init(4);
+ *    thpool_set_affinity(thpool, 0, sysconf(_SC_NPROCESSORS_ONLN));
+ * 
+ * @param threadpool     the threadpool whose threads to pin
+ * @param first_cpu      CPU of the first thread
+ * @param num_cpus       CPUs to spread the threads over
+ * @return 0 on success, -1 if a thread could not be pinned or
+ *         the platform can't pin threads
+ */
+int thpool_set_affinity(threadpool, int first_cpu, int num_cpus);
+
+
+/**
+ * @brief Read the pool's counters and latency histograms
+ * 
+ * Every thread keeps its own and updates them without atomics or
+ * locks, so adding and running jobs costs next to nothing extra. This
+ * sums them up; it may run at any time from any thread and sees the
+ * counters a moment old.
+ * 
+ * @example
+ * 
+ *    thpool_stats st;
+ *    thpool_get_stats(thpool, &st);
+ *    printf("%ld done, p99 wait %ld us\n", st.jobs_done,
+ *           stats_percentile(&st.wait, 99.0));
+ * 
+ * @param threadpool     the threadpool of interest
+ * @param stats_p        filled in
+ * @return nothing
+ */
+void thpool_get_stats(threadpool, thpool_stats* stats_p);
+
+
 /**
  * @brief Destroy the threadpool
  * 
@@ -0,0 +1,293 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "tls.h"
+
+#ifdef HAVE_OPENSSL
+
+#include <pthread.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+struct tls_conn
+{
+    SSL            *ssl;
+    char           *key;        /* "host:port" of its session cache slot */
+};
+
+/* TLS 1.3 tickets are single use, a host gets a few of them per handshake */
+#define TLS_SESSIONS_PER_HOST   4
+
+typedef struct tls_session
+{
+    char                *key;
+    int                  count;
+    SSL_SESSION         *session[TLS_SESSIONS_PER_HOST];  /* newest last */
+    struct tls_session  *next;
+} tls_session_t;
+
+static SSL_CTX         *tls_ctx = NULL;
+static int              tls_key_index = -1;
+static tls_session_t   *tls_sessions = NULL;
+static pthread_mutex_t  tls_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* per run statistics, updated from the worker threads */
+static volatile long    tls_handshakes = 0;
+static volatile long    tls_resumed = 0;
+
+static int __tls_new_session__ (SSL *ssl, SSL_SESSION *session);
+static void __tls_error__ (const char *what, const char *key);
+
+static void
+__tls_error__ (const char *what, const char *key)
+{
+    unsigned long   err;
+    char            buf[256];
+
+    err = ERR_get_error ();
+    ERR_error_string_n (err, buf, sizeof (buf));
+    fprintf (stderr, "tls: %s %s: %s\n", what, key, err ? buf : strerror (errno));
+    ERR_clear_error ();
+}
+
+/* keep the newest sessions of a host, dropping the oldest */
+static int
+__tls_new_session__ (SSL *ssl, SSL_SESSION *session)
+{
+    tls_session_t   *s;
+    const char      *key;
+
+    if ((key = SSL_get_ex_data (ssl, tls_key_index)) == NULL)
+        return 0;
+
+    pthread_mutex_lock (&tls_lock);
+    for (s = tls_sessions; s != NULL; s = s->next) {
+        if (strcmp (s->key, key) == 0)
+            break;
+    }
+    if (s == NULL) {
+        s = (tls_session_t *) calloc (1, sizeof (tls_session_t));
+        s->key = strdup (key);
+        s->next = tls_sessions;
+        tls_sessions = s;
+    }
+    if (s->count == TLS_SESSIONS_PER_HOST) {
+        SSL_SESSION_free (s->session[0]);
+        memmove (s->session, s->session + 1,
+                 (TLS_SESSIONS_PER_HOST - 1) * sizeof (SSL_SESSION *));
+        s->count--;
+    }
+    s->session[s->count++] = session;
+    pthread_mutex_unlock (&tls_lock);
+
+    /* we keep the reference */
+    return 1;
+}
+
+int
+tls_init (int insecure)
+{
+    if (tls_ctx != NULL)
+        return 0;
+
+    tls_ctx = SSL_CTX_new (TLS_client_method ());
+    if (tls_ctx == NULL) {
+        __tls_error__ ("init", "");
+        return -1;
+    }
+    SSL_CTX_set_min_proto_version (tls_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_default_verify_paths (tls_ctx);
+    SSL_CTX_set_verify (tls_ctx, insecure ? SSL_VERIFY_NONE : SSL_VERIFY_PEER,
+                        NULL);
+
+    /* sessions live in tls_sessions, keyed by host rather than by SSL_CTX */
+    SSL_CTX_set_session_cache_mode (tls_ctx, SSL_SESS_CACHE_CLIENT
+                                    | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb (tls_ctx, __tls_new_session__);
+    tls_key_index = SSL_get_ex_new_index (0, NULL, NULL, NULL, NULL);
+
+    return 0;
+}
+
+/* handshake on the connected socket fd, resuming the host's session */
+tls_conn_t *
+tls_connect (int fd, const char *host, unsigned short port)
+{
+    tls_conn_t      *tls;
+    tls_session_t   *s;
+    SSL_SESSION     *session;
+    char             key[300];
+
+    if (tls_ctx == NULL && tls_init (0) == -1)
+        return NULL;
+
+    snprintf (key, sizeof (key), "%s:%u", host, port);
+    tls = (tls_conn_t *) calloc (1, sizeof (tls_conn_t));
+    if (tls == NULL || (tls->ssl = SSL_new (tls_ctx)) == NULL) {
+        free (tls);
+        return NULL;
+    }
+    tls->key = strdup (key);
+
+    SSL_set_fd (tls->ssl, fd);
+    SSL_set_ex_data (tls->ssl, tls_key_index, tls->key);
+    SSL_set_tlsext_host_name (tls->ssl, host);
+    SSL_set1_host (tls->ssl, host);
+
+    pthread_mutex_lock (&tls_lock);
+    for (s = tls_sessions; s != NULL; s = s->next) {
+        if (strcmp (s->key, key) != 0 || s->count == 0)
+            continue;
+        session = s->session[s->count - 1];
+        SSL_set_session (tls->ssl, session);
+        /* a TLS 1.2 session can be resumed again, a ticket can't */
+        if (SSL_SESSION_get_protocol_version (session) >= TLS1_3_VERSION) {
+            SSL_SESSION_free (session);
+            s->count--;
+        }
+        break;
+    }
+    pthread_mutex_unlock (&tls_lock);
+
+    if (SSL_connect (tls->ssl) != 1) {
+        __tls_error__ ("handshake with", key);
+        tls_close (tls);
+        return NULL;
+    }
+
+    __sync_fetch_and_add (&tls_handshakes, 1);
+    if (SSL_session_reused (tls->ssl))
+        __sync_fetch_and_add (&tls_resumed, 1);
+    return tls;
+}
+
+ssize_t
+tls_read (tls_conn_t *tls, void *buf, size_t n)
+{
+    int     m;
+
+    errno = 0;
+    m = SSL_read (tls->ssl, buf, n > INT_MAX ? INT_MAX : (int) n);
+    if (m > 0)
+        return m;
+    switch (SSL_get_error (tls->ssl, m)) {
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_SYSCALL:
+            /* a peer that skips close_notify, common with http/1.1 */
+            if (ERR_peek_error () == 0 && errno == 0)
+                return 0;
+            ERR_clear_error ();
+            return -1;
+        default:
+            ERR_clear_error ();
+            errno = EPROTO;
+            return -1;
+    }
+}
+
+ssize_t
+tls_write (tls_conn_t *tls, const void *buf, size_t n)
+{
+    int     m;
+
+    m = SSL_write (tls->ssl, buf, n > INT_MAX ? INT_MAX : (int) n);
+    if (m > 0)
+        return m;
+    if (SSL_get_error (tls->ssl, m) != SSL_ERROR_SYSCALL)
+        errno = EPROTO;
+    ERR_clear_error ();
+    return -1;
+}
+
+/* decrypted bytes waiting inside OpenSSL */
+int
+tls_pending (tls_conn_t *tls)
+{
+    return SSL_pending (tls->ssl);
+}
+
+/* frees the TLS state, the socket stays with the caller */
+void
+tls_close (tls_conn_t *tls)
+{
+    if (tls == NULL)
+        return;
+    if (tls->ssl != NULL) {
+        SSL_shutdown (tls->ssl);
+        SSL_free (tls->ssl);
+    }
+    free (tls->key);
+    free (tls);
+}
+
+void
+tls_report (void)
+{
+    if (tls_handshakes == 0)
+        return;
+    printf ("tls: %ld handshakes, %ld resumed\n", tls_handshakes, tls_resumed);
+}
+
+#else /* !HAVE_OPENSSL */
+
+int
+tls_init (int insecure)
+{
+    (void) insecure;
+    return -1;
+}
+
+tls_conn_t *
+tls_connect (int fd, const char *host, unsigned short port)
+{
+    (void) fd;
+    (void) port;
+    fprintf (stderr, "tls: %s: built without OpenSSL\n", host);
+    errno = EPROTONOSUPPORT;
+    return NULL;
+}
+
+ssize_t
+tls_read (tls_conn_t *tls, void *buf, size_t n)
+{
+    (void) tls;
+    (void) buf;
+    (void) n;
+    errno = EPROTONOSUPPORT;
+    return -1;
+}
+
+ssize_t
+tls_write (tls_conn_t *tls, const void *buf, size_t n)
+{
+    (void) tls;
+    (void) buf;
+    (void) n;
+    errno = EPROTONOSUPPORT;
+    return -1;
+}
+
+int
+tls_pending (tls_conn_t *tls)
+{
+    (void) tls;
+    return 0;
+}
+
+void
+tls_close (tls_conn_t *tls)
+{
+    (void) tls;
+}
+
+void
+tls_report (void)
+{
+}
+
+#endif /* HAVE_OPENSSL */
@@ -0,0 +1,28 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <sys/types.h>
+
+/*
+ * TLS under the native http client, built with -DHAVE_OPENSSL. Sessions
+ * are cached per host and port, so later connections to a host resume
+ * instead of doing a full handshake. Without OpenSSL every call fails.
+ */
+
+typedef struct tls_conn tls_conn_t;
+
+int tls_init (int insecure);
+
+tls_conn_t *tls_connect (int fd, const char *host, unsigned short port);
+
+ssize_t tls_read (tls_conn_t *tls, void *buf, size_t n);
+
+ssize_t tls_write (tls_conn_t *tls, const void *buf, size_t n);
+
+int tls_pending (tls_conn_t *tls);
+
+void tls_close (tls_conn_t *tls);
+
+void tls_report (void);
+
+#endif /* TLS_H */